@@ -21,12 +21,13 @@
 #include <stdlib.h>
 #include <memory.h>
 #include <string.h>
-#include <time.h>
 
 #include "emulator.h"
 #include "memory.h"
 #include "6502.h"
+#define DBG_MODULE DBG_MOD_CPU
 #include "debug.h"
+#include "metrics.h"
 
 #define _INCLUDE_OPCODE_MAP
 #include "opcodes.h"
@@ -128,6 +129,22 @@ int cpu_flag(uint8_t flag) {
     return 0;
 }
 
+/*
+ * private
+ *
+ * take a branch, returning the extra cycles it costs: one
+ * for the branch, and one more if it lands on another page
+ */
+uint8_t cpu_branch(uint16_t addr) {
+    uint8_t extra = 1;
+
+    if((addr & 0xFF00) != (cpu_state.ip & 0xFF00))
+        extra++;
+
+    cpu_state.ip = addr;
+    return extra;
+}
+
 /*
  * private
  *
@@ -158,11 +175,12 @@ uint8_t cpu_execute(void) {
     uint8_t t81, t82;     /* temp 8 bit numbers */
     uint16_t t161, t162;  /* temp 16 bit numbers */
     int16_t ts161, ts162; /* temp 16 bit signed number */
-    struct timespec rqtp;
+    uint8_t cycles;
 
     opcode = cpu_fetch();
     opmap = &cpu_opcode_map[opcode];
     opinfo = &cpu_opcode_info[opmap->opcode_family];
+    cycles = opmap->cycles;
 
     /* get base operands */
     switch(opmap->addressing_mode) {
@@ -215,10 +233,16 @@ uint8_t cpu_execute(void) {
         addr = (addr + cpu_state.y) % 256;
         break;
     case CPU_ADDR_MODE_ABSOLUTE_X:
+        t161 = addr;
         addr = addr + cpu_state.x;
+        if(opmap->page_overflow && ((t161 ^ addr) & 0xFF00))
+            cycles++;
         break;
     case CPU_ADDR_MODE_ABSOLUTE_Y:
+        t161 = addr;
         addr = addr + cpu_state.y;
+        if(opmap->page_overflow && ((t161 ^ addr) & 0xFF00))
+            cycles++;
         break;
     case CPU_ADDR_MODE_INDIRECT:
         addr = cpu_makeword(memory_read(addr), memory_read(addr+1));
@@ -231,8 +255,10 @@ uint8_t cpu_execute(void) {
         /*                     memory_read(addr + cpu_state.x + 1)); */
         break;
     case CPU_ADDR_MODE_IND_Y:
-        addr = cpu_makeword(memory_read(addr),
-                            memory_read(addr + 1)) + cpu_state.y;
+        t161 = cpu_makeword(memory_read(addr), memory_read(addr + 1));
+        addr = t161 + cpu_state.y;
+        if(opmap->page_overflow && ((t161 ^ addr) & 0xFF00))
+            cycles++;
         INFO("Ind_Y addr: $%04x", addr);
         break;
 
@@ -339,17 +365,17 @@ uint8_t cpu_execute(void) {
 
     case CPU_OPCODE_BCC:
         if(!cpu_flag(FLAG_C))
-            cpu_state.ip = addr;
+            cycles += cpu_branch(addr);
         break;
 
     case CPU_OPCODE_BCS:
         if(cpu_flag(FLAG_C))
-            cpu_state.ip = addr;
+            cycles += cpu_branch(addr);
         break;
 
     case CPU_OPCODE_BEQ:
         if(cpu_flag(FLAG_Z))
-            cpu_state.ip = addr;
+            cycles += cpu_branch(addr);
         break;
 
     case CPU_OPCODE_BIT:
@@ -369,17 +395,17 @@ uint8_t cpu_execute(void) {
 
     case CPU_OPCODE_BMI:
         if(cpu_flag(FLAG_N))
-            cpu_state.ip = addr;
+            cycles += cpu_branch(addr);
         break;
 
     case CPU_OPCODE_BNE:
         if(!cpu_flag(FLAG_Z))
-            cpu_state.ip = addr;
+            cycles += cpu_branch(addr);
         break;
 
     case CPU_OPCODE_BPL:
         if(!cpu_flag(FLAG_N))
-            cpu_state.ip = addr;
+            cycles += cpu_branch(addr);
         break;
 
     case CPU_OPCODE_BRK:
@@ -393,16 +419,17 @@ uint8_t cpu_execute(void) {
         /* as with NMI, disable interrupts in the handler */
         cpu_set_flag(FLAG_I, 1);
         cpu_state.ip = cpu_makeword(memory_read(0xfffe), memory_read(0xffff));
+        metrics.irqs++;
         break;
 
     case CPU_OPCODE_BVC:
         if(!cpu_flag(FLAG_V))
-            cpu_state.ip = addr;
+            cycles += cpu_branch(addr);
         break;
 
     case CPU_OPCODE_BVS:
         if(cpu_flag(FLAG_V))
-            cpu_state.ip = addr;
+            cycles += cpu_branch(addr);
         break;
 
     case CPU_OPCODE_CLC:
@@ -534,13 +561,7 @@ uint8_t cpu_execute(void) {
         break;
 
     case CPU_OPCODE_NOP:
-        /* there should probably be an undoc opcode
-           for waiting until an irq, but we'll just
-           sleep a bit on a nop, to keep my laptop
-           from overheating.  :p */
-        rqtp.tv_sec = 0;
-        rqtp.tv_nsec = 100000000;  /* .1 sec */
-        nanosleep(&rqtp, NULL);
+        /* pacing (throttle.c) is what keeps the host cool now */
         break;
 
     case CPU_OPCODE_ORA:
@@ -692,8 +713,11 @@ uint8_t cpu_execute(void) {
     }
 
 
+    metrics.instructions++;
+    metrics.cycles += cycles;
+
     /*  woo hoo */
-    return 1;
+    return cycles;
 }
 
 /*
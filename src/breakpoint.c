@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "6502.h"
+#include "breakpoint.h"
+#include "memory.h"
+#include "redblack.h"
+#include "stepwise.h"
+
+/* condition attached to a breakpoint.  These are only looked
+ * up when the bitmap says there is a breakpoint at the pc.
+ */
+typedef struct bp_cond_t {
+    uint16_t addr;
+    uint16_t count;
+    uint16_t hits;
+    uint16_t len;
+    uint8_t code[];
+} bp_cond_t;
+
+uint8_t breakpoint_map[65536 / 8];
+
+static struct rbtree *bp_conditions = NULL;
+
+/*
+ * private
+ *
+ * order conditions by address
+ */
+static int breakpoint_compare(const void *a, const void *b, const void *config) {
+    uint16_t a1 = *(uint16_t *)a;
+    uint16_t a2 = *(uint16_t *)b;
+
+    if(a1 == a2)
+        return 0;
+
+    if(a1 < a2)
+        return -1;
+
+    return 1;
+}
+
+/*
+ * private
+ *
+ * drop the condition for an address, if there is one
+ */
+static void breakpoint_remove_condition(uint16_t addr) {
+    const void *cond;
+
+    if(!bp_conditions)
+        return;
+
+    cond = rbdelete((void*)&addr, bp_conditions);
+    if(cond)
+        free((void*)cond);
+}
+
+/**
+ * set a breakpoint
+ *
+ * @param addr address to break at
+ */
+void breakpoint_set(uint16_t addr) {
+    breakpoint_map[addr >> 3] |= (1 << (addr & 7));
+}
+
+/**
+ * clear a breakpoint, and any condition on it
+ *
+ * @param addr address to stop breaking at
+ */
+void breakpoint_clear(uint16_t addr) {
+    breakpoint_map[addr >> 3] &= ~(1 << (addr & 7));
+    breakpoint_remove_condition(addr);
+}
+
+/**
+ * clear every breakpoint
+ */
+void breakpoint_clear_all(void) {
+    const void *cond;
+
+    memset(breakpoint_map, 0, sizeof(breakpoint_map));
+
+    if(!bp_conditions)
+        return;
+
+    while((cond = rblookup(RB_LUFIRST, NULL, bp_conditions))) {
+        rbdelete(cond, bp_conditions);
+        free((void*)cond);
+    }
+}
+
+/**
+ * check that condition bytecode is well formed: known opcodes,
+ * operands present, and the stack never under or overflows.
+ *
+ * @param code bytecode
+ * @param len length of code
+ * @returns TRUE if it is safe to run
+ */
+int breakpoint_validate(uint8_t *code, uint16_t len) {
+    int depth = 0;
+    int pc = 0;
+
+    if(len > BC_MAX_LEN)
+        return FALSE;
+
+    while(pc < len) {
+        switch(code[pc++]) {
+        case BC_END:
+            return depth == 1;
+        case BC_PUSH:
+            if(pc + 2 > len)
+                return FALSE;
+            pc += 2;
+            depth++;
+            break;
+        case BC_REG:
+            if((pc + 1 > len) || (code[pc] < PARAM_A) || (code[pc] > PARAM_IP))
+                return FALSE;
+            pc++;
+            depth++;
+            break;
+        case BC_MEM:
+        case BC_NOT:
+            if(depth < 1)
+                return FALSE;
+            break;
+        case BC_EQ:
+        case BC_NE:
+        case BC_LT:
+        case BC_LE:
+        case BC_GT:
+        case BC_GE:
+        case BC_LAND:
+        case BC_LOR:
+        case BC_AND:
+        case BC_OR:
+        case BC_ADD:
+        case BC_SUB:
+            if(depth < 2)
+                return FALSE;
+            depth--;
+            break;
+        default:
+            return FALSE;
+        }
+
+        if(depth > BC_STACK_DEPTH)
+            return FALSE;
+    }
+
+    return depth == 1;
+}
+
+/**
+ * attach a condition to a breakpoint (setting it, if not
+ * already set), replacing any previous condition
+ *
+ * @param addr breakpoint address
+ * @param count stop on the count'th time the condition holds
+ * @param code condition bytecode, validated here
+ * @param len length of code, zero for unconditional
+ * @returns TRUE on success, FALSE if the code is invalid
+ */
+int breakpoint_set_condition(uint16_t addr, uint16_t count,
+                             uint8_t *code, uint16_t len) {
+    bp_cond_t *cond;
+
+    if(len && !breakpoint_validate(code, len))
+        return FALSE;
+
+    breakpoint_remove_condition(addr);
+
+    if(!bp_conditions) {
+        bp_conditions = rbinit(breakpoint_compare, NULL);
+        if(!bp_conditions) {
+            perror("rbinit");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    cond = (bp_cond_t*)malloc(sizeof(bp_cond_t) + len);
+    if(!cond) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    cond->addr = addr;
+    cond->count = count;
+    cond->hits = 0;
+    cond->len = len;
+    memcpy(cond->code, code, len);
+
+    rbsearch((void*)cond, bp_conditions);
+    breakpoint_set(addr);
+    return TRUE;
+}
+
+/*
+ * private
+ *
+ * run validated condition bytecode against the current cpu state
+ */
+static uint16_t breakpoint_eval(bp_cond_t *cond) {
+    uint16_t stack[BC_STACK_DEPTH];
+    uint16_t a, b;
+    int sp = 0;
+    int pc = 0;
+
+    while(pc < cond->len) {
+        switch(cond->code[pc++]) {
+        case BC_END:
+            return stack[sp - 1];
+        case BC_PUSH:
+            memcpy(&stack[sp++], &cond->code[pc], sizeof(uint16_t));
+            pc += 2;
+            break;
+        case BC_REG:
+            switch(cond->code[pc++]) {
+            case PARAM_A: stack[sp++] = cpu_state.a; break;
+            case PARAM_X: stack[sp++] = cpu_state.x; break;
+            case PARAM_Y: stack[sp++] = cpu_state.y; break;
+            case PARAM_P: stack[sp++] = cpu_state.p; break;
+            case PARAM_SP: stack[sp++] = cpu_state.sp; break;
+            default: stack[sp++] = cpu_state.ip; break;
+            }
+            break;
+        case BC_MEM:
+            stack[sp - 1] = memory_peek(stack[sp - 1]);
+            break;
+        case BC_NOT:
+            stack[sp - 1] = !stack[sp - 1];
+            break;
+        default:
+            b = stack[--sp];
+            a = stack[sp - 1];
+            switch(cond->code[pc - 1]) {
+            case BC_EQ: a = (a == b); break;
+            case BC_NE: a = (a != b); break;
+            case BC_LT: a = (a < b); break;
+            case BC_LE: a = (a <= b); break;
+            case BC_GT: a = (a > b); break;
+            case BC_GE: a = (a >= b); break;
+            case BC_LAND: a = (a && b); break;
+            case BC_LOR: a = (a || b); break;
+            case BC_AND: a &= b; break;
+            case BC_OR: a |= b; break;
+            case BC_ADD: a += b; break;
+            case BC_SUB: a -= b; break;
+            }
+            stack[sp - 1] = a;
+            break;
+        }
+    }
+
+    return stack[sp - 1];
+}
+
+/**
+ * decide whether the breakpoint at addr should stop the cpu.
+ * Only called when the bitmap has addr set.
+ *
+ * @param addr address of the breakpoint
+ * @returns TRUE to stop
+ */
+int breakpoint_check(uint16_t addr) {
+    bp_cond_t *cond;
+
+    if(!bp_conditions)
+        return TRUE;
+
+    cond = (bp_cond_t*)rbfind((void*)&addr, bp_conditions);
+    if(!cond)
+        return TRUE;
+
+    if(cond->len && !breakpoint_eval(cond))
+        return FALSE;
+
+    if(cond->hits < 0xFFFF)
+        cond->hits++;
+
+    return cond->hits >= cond->count;
+}
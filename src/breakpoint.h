@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _BREAKPOINT_H_
+#define _BREAKPOINT_H_
+
+#include <stdint.h>
+
+/* one bit per address, so the run loop can test the pc
+ * with a single load per instruction.  Conditions are only
+ * evaluated (by breakpoint_check) when the bit is set.
+ */
+extern uint8_t breakpoint_map[65536 / 8];
+
+#define BREAKPOINT_ISSET(addr) \
+    (breakpoint_map[(uint16_t)(addr) >> 3] & (1 << ((addr) & 7)))
+
+extern void breakpoint_set(uint16_t addr);
+extern void breakpoint_clear(uint16_t addr);
+extern void breakpoint_clear_all(void);
+extern int breakpoint_validate(uint8_t *code, uint16_t len);
+extern int breakpoint_set_condition(uint16_t addr, uint16_t count,
+                                    uint8_t *code, uint16_t len);
+extern int breakpoint_check(uint16_t addr);
+
+#endif /* _BREAKPOINT_H_ */
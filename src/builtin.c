@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+
+#include "builtin.h"
+
+typedef struct builtin_module_t {
+    const char *name;
+    hw_init_t init;
+} builtin_module_t;
+
+#ifdef HW_BUILTIN
+extern hw_reg_t *HW_MODULE_INIT(memory)(hw_config_t *, hw_callbacks_t *);
+extern hw_reg_t *HW_MODULE_INIT(bank_register)(hw_config_t *, hw_callbacks_t *);
+extern hw_reg_t *HW_MODULE_INIT(uart_16550)(hw_config_t *, hw_callbacks_t *);
+extern hw_reg_t *HW_MODULE_INIT(acia_6551)(hw_config_t *, hw_callbacks_t *);
+extern hw_reg_t *HW_MODULE_INIT(generic_video)(hw_config_t *, hw_callbacks_t *);
+extern hw_reg_t *HW_MODULE_INIT(vnc_video)(hw_config_t *, hw_callbacks_t *);
+#endif
+
+static builtin_module_t builtin_modules[] = {
+#ifdef HW_BUILTIN
+    { "memory", HW_MODULE_INIT(memory) },
+    { "bank-register", HW_MODULE_INIT(bank_register) },
+    { "uart-16550", HW_MODULE_INIT(uart_16550) },
+    { "acia-6551", HW_MODULE_INIT(acia_6551) },
+    { "generic-video", HW_MODULE_INIT(generic_video) },
+    { "vnc-video", HW_MODULE_INIT(vnc_video) },
+#endif
+    { NULL, NULL }
+};
+
+/**
+ * find a module built into the emulator
+ *
+ * @param name short name of the module, without BUILTIN_PREFIX
+ * @returns its init function, or NULL if it isn't built in
+ */
+hw_init_t builtin_find(const char *name) {
+    builtin_module_t *module;
+
+    for(module = builtin_modules; module->name; module++) {
+        if(strcmp(module->name, name) == 0)
+            return module->init;
+    }
+
+    return NULL;
+}
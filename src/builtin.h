@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _BUILTIN_H_
+#define _BUILTIN_H_
+
+#include "hardware.h"
+
+/* modules built into the emulator are configured with a module
+ * of BUILTIN_PREFIX and their short name, eg "builtin:memory" */
+#define BUILTIN_PREFIX "builtin:"
+
+typedef hw_reg_t *(*hw_init_t)(hw_config_t *, hw_callbacks_t *);
+
+extern hw_init_t builtin_find(const char *name);
+
+#ifdef HW_BUILTIN
+/* plain memory's memop, so the bus can call it directly */
+extern uint8_t mem_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data);
+#endif
+
+#endif /* _BUILTIN_H_ */
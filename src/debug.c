@@ -16,25 +16,649 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-#include <stdio.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
 
 #include "emulator.h"
 #include "debug.h"
 
-static int debug_threshold = 2;
+/*
+ * Log messages are recorded as binary entries in a bounded
+ * multi-producer ring (after Vyukov): the producer stores the
+ * format pointer and the raw argument values, and a background
+ * thread does the actual formatting and writes to stderr.  Until
+ * debug_async_start is called, messages are printed synchronously.
+ */
+
+#define LOG_RING_SIZE  1024            /* power of two */
+#define LOG_RING_MASK  (LOG_RING_SIZE - 1)
+#define LOG_ENTRY_DATA 480
+#define LOG_LINE_MAX   1024
+#define LOG_IDLE_NSEC  2000000
+
+typedef struct log_entry_t {
+    uint64_t sequence;
+    char *format;       /* NULL if data is already a formatted string */
+    uint16_t len;
+    uint8_t level;
+    uint8_t data[LOG_ENTRY_DATA];
+} log_entry_t;
+
+/* what a conversion spec consumes from the argument list */
+#define LOG_ARG_NONE   0
+#define LOG_ARG_INT    1
+#define LOG_ARG_UINT   2
+#define LOG_ARG_DOUBLE 3
+#define LOG_ARG_STRING 4
+#define LOG_ARG_PTR    5
+#define LOG_ARG_SKIP   6    /* %n */
+
+typedef struct log_spec_t {
+    const char *start;   /* the '%' */
+    const char *end;     /* one past the conversion char */
+    int star_width;
+    int star_precision;
+    int length;          /* 'H' hh, 'h', 'l', 'q' ll, 'j', 'z', 't', 'L' */
+    char conversion;
+    int type;
+} log_spec_t;
 
+int debug_levels[DBG_MOD_MAX] = { 2, 2, 2, 2, 2 };
+
+static char *debug_module_names[DBG_MOD_MAX] = {
+    "core", "cpu", "bus", "debugger", "hw"
+};
+
+static log_entry_t log_ring[LOG_RING_SIZE];
+static uint64_t log_head;
+static uint64_t log_tail;
+static uint64_t log_dropped;
+static int log_async;
+static int log_stopping;
+static pthread_t log_tid;
+
+/**
+ * set the log threshold for every module
+ *
+ * @param newlevel highest level to print (DBG_*)
+ */
 void debug_level(int newlevel) {
-    debug_threshold = newlevel;
+    for(int x = 0; x < DBG_MOD_MAX; x++)
+        debug_levels[x] = newlevel;
 }
 
+/**
+ * parse a log level spec of the form "2", "cpu=4" or
+ * "2,cpu=4,bus=3".  A bare number applies to every module.
+ *
+ * @param spec level spec
+ * @returns TRUE on success, FALSE on bad module name
+ */
+int debug_parse_levels(char *spec) {
+    char *copy, *item, *value, *saveptr = NULL;
+    int found;
+    int retval = TRUE;
 
-void debug_printf(int level, char *format, ...) {
-    va_list args;
-    if(level > debug_threshold)
+    copy = strdup(spec);
+    if(!copy) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+
+    for(item = strtok_r(copy, ",", &saveptr); item;
+        item = strtok_r(NULL, ",", &saveptr)) {
+        value = strchr(item, '=');
+        if(!value) {
+            debug_level(atoi(item));
+            continue;
+        }
+
+        *value++ = '\0';
+        found = 0;
+        for(int x = 0; x < DBG_MOD_MAX; x++) {
+            if(strcasecmp(item, debug_module_names[x]) == 0) {
+                debug_levels[x] = atoi(value);
+                found = 1;
+            }
+        }
+
+        if(!found) {
+            fprintf(stderr, "Unknown log module: %s\n", item);
+            retval = FALSE;
+        }
+    }
+
+    free(copy);
+    return retval;
+}
+
+/*
+ * private
+ *
+ * parse the next conversion spec in a printf format.
+ *
+ * @param format where to start looking
+ * @param spec filled with the spec details
+ * @returns TRUE if a spec was found
+ */
+static int debug_next_spec(const char *format, log_spec_t *spec) {
+    const char *p = strchr(format, '%');
+
+    if(!p)
+        return FALSE;
+
+    memset(spec, 0, sizeof(log_spec_t));
+    spec->start = p++;
+
+    while(*p && strchr("-+ #0'", *p))
+        p++;
+
+    if(*p == '*') {
+        spec->star_width = 1;
+        p++;
+    } else {
+        while(*p >= '0' && *p <= '9')
+            p++;
+    }
+
+    if(*p == '.') {
+        p++;
+        if(*p == '*') {
+            spec->star_precision = 1;
+            p++;
+        } else {
+            while(*p >= '0' && *p <= '9')
+                p++;
+        }
+    }
+
+    switch(*p) {
+    case 'h':
+        spec->length = 'h';
+        if(*++p == 'h') {
+            spec->length = 'H';
+            p++;
+        }
+        break;
+    case 'l':
+        spec->length = 'l';
+        if(*++p == 'l') {
+            spec->length = 'q';
+            p++;
+        }
+        break;
+    case 'j':
+    case 'z':
+    case 't':
+    case 'L':
+        spec->length = *p++;
+        break;
+    }
+
+    spec->conversion = *p;
+    spec->end = *p ? p + 1 : p;
+
+    switch(*p) {
+    case 'd':
+    case 'i':
+    case 'c':
+        spec->type = LOG_ARG_INT;
+        break;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        spec->type = LOG_ARG_UINT;
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        spec->type = LOG_ARG_DOUBLE;
+        break;
+    case 's':
+        spec->type = LOG_ARG_STRING;
+        break;
+    case 'p':
+        spec->type = LOG_ARG_PTR;
+        break;
+    case 'n':
+        spec->type = LOG_ARG_SKIP;
+        break;
+    default:
+        spec->type = LOG_ARG_NONE;
+        break;
+    }
+
+    return TRUE;
+}
+
+/*
+ * private
+ *
+ * fetch an integer argument, truncated as the length
+ * modifier requires, so it can be printed back with %ll
+ */
+static uint64_t debug_int_arg(log_spec_t *spec, va_list *args) {
+    int is_signed = (spec->type == LOG_ARG_INT);
+
+    switch(spec->length) {
+    case 'H':
+        if(is_signed)
+            return (int64_t)(signed char)va_arg(*args, int);
+        return (unsigned char)va_arg(*args, unsigned int);
+    case 'h':
+        if(is_signed)
+            return (int64_t)(short)va_arg(*args, int);
+        return (unsigned short)va_arg(*args, unsigned int);
+    case 'l':
+        if(is_signed)
+            return (int64_t)va_arg(*args, long);
+        return va_arg(*args, unsigned long);
+    case 'q':
+        return va_arg(*args, unsigned long long);
+    case 'j':
+        return va_arg(*args, uintmax_t);
+    case 'z':
+    case 't':
+        if(is_signed)
+            return (int64_t)va_arg(*args, ssize_t);
+        return va_arg(*args, size_t);
+    default:
+        if(is_signed)
+            return (int64_t)va_arg(*args, int);
+        return va_arg(*args, unsigned int);
+    }
+}
+
+/*
+ * private
+ *
+ * copy the arguments described by format into an entry.
+ *
+ * @returns bytes used, or -1 if they don't fit
+ */
+static int debug_capture(log_entry_t *entry, const char *format, va_list *args) {
+    log_spec_t spec;
+    uint8_t *dst = entry->data;
+    uint8_t *end = entry->data + LOG_ENTRY_DATA;
+    uint64_t value;
+    double dvalue;
+    char *str;
+    uint16_t len;
+
+    while(debug_next_spec(format, &spec)) {
+        format = spec.end;
+
+        if(spec.star_width || spec.star_precision) {
+            if(dst + ((spec.star_width + spec.star_precision) * sizeof(int)) > end)
+                return -1;
+            if(spec.star_width) {
+                int w = va_arg(*args, int);
+                memcpy(dst, &w, sizeof(int));
+                dst += sizeof(int);
+            }
+            if(spec.star_precision) {
+                int p = va_arg(*args, int);
+                memcpy(dst, &p, sizeof(int));
+                dst += sizeof(int);
+            }
+        }
+
+        switch(spec.type) {
+        case LOG_ARG_INT:
+        case LOG_ARG_UINT:
+            if(dst + sizeof(uint64_t) > end)
+                return -1;
+            value = debug_int_arg(&spec, args);
+            memcpy(dst, &value, sizeof(uint64_t));
+            dst += sizeof(uint64_t);
+            break;
+        case LOG_ARG_DOUBLE:
+            if(dst + sizeof(double) > end)
+                return -1;
+            if(spec.length == 'L')
+                dvalue = (double)va_arg(*args, long double);
+            else
+                dvalue = va_arg(*args, double);
+            memcpy(dst, &dvalue, sizeof(double));
+            dst += sizeof(double);
+            break;
+        case LOG_ARG_STRING:
+            str = va_arg(*args, char *);
+            if(!str)
+                str = "(null)";
+            len = strlen(str);
+            if(dst + sizeof(uint16_t) + len + 1 > end)
+                return -1;
+            memcpy(dst, &len, sizeof(uint16_t));
+            dst += sizeof(uint16_t);
+            memcpy(dst, str, len + 1);
+            dst += len + 1;
+            break;
+        case LOG_ARG_PTR:
+            if(dst + sizeof(void*) > end)
+                return -1;
+            str = va_arg(*args, void *);
+            memcpy(dst, &str, sizeof(void*));
+            dst += sizeof(void*);
+            break;
+        case LOG_ARG_SKIP:
+            (void)va_arg(*args, void *);
+            break;
+        }
+    }
+
+    return dst - entry->data;
+}
+
+/*
+ * private
+ *
+ * render a captured entry into buffer
+ */
+static void debug_render(log_entry_t *entry, char *buffer, size_t size) {
+    log_spec_t spec;
+    const char *format = entry->format;
+    uint8_t *src = entry->data;
+    char spec_format[32];
+    char *out = buffer;
+    size_t left = size;
+    int width = 0, precision = 0;
+    int written;
+    uint64_t value;
+    double dvalue;
+    void *ptr;
+    uint16_t len;
+    int pos;
+
+    while(left > 1) {
+        if(!debug_next_spec(format, &spec)) {
+            written = snprintf(out, left, "%s", format);
+            break;
+        }
+
+        /* literal text up to the spec */
+        written = (int)(spec.start - format);
+        if((size_t)written >= left)
+            written = left - 1;
+        memcpy(out, format, written);
+        out += written;
+        left -= written;
+        format = spec.end;
+
+        if(spec.star_width) {
+            memcpy(&width, src, sizeof(int));
+            src += sizeof(int);
+        }
+        if(spec.star_precision) {
+            memcpy(&precision, src, sizeof(int));
+            src += sizeof(int);
+        }
+
+        /* rebuild the spec with a length modifier matching
+           what was captured */
+        pos = 0;
+        for(const char *p = spec.start; p < spec.end - 1 && pos < 24; p++) {
+            if(strchr("hljztLq", *p))
+                break;
+            spec_format[pos++] = *p;
+        }
+        if((spec.type == LOG_ARG_INT) || (spec.type == LOG_ARG_UINT)) {
+            if(spec.conversion != 'c') {
+                spec_format[pos++] = 'l';
+                spec_format[pos++] = 'l';
+            }
+        }
+        spec_format[pos++] = spec.conversion;
+        spec_format[pos] = '\0';
+
+/* star width and precision come ahead of the value */
+#define LOG_RENDER(arg)                                                 \
+        ((spec.star_width && spec.star_precision) ?                     \
+         snprintf(out, left, spec_format, width, precision, arg) :      \
+         spec.star_width ? snprintf(out, left, spec_format, width, arg) : \
+         spec.star_precision ? snprintf(out, left, spec_format, precision, arg) : \
+         snprintf(out, left, spec_format, arg))
+
+        written = 0;
+        switch(spec.type) {
+        case LOG_ARG_NONE:
+            if(spec.conversion == '%')
+                written = snprintf(out, left, "%%");
+            break;
+        case LOG_ARG_INT:
+        case LOG_ARG_UINT:
+            memcpy(&value, src, sizeof(uint64_t));
+            src += sizeof(uint64_t);
+            if(spec.conversion == 'c')
+                written = LOG_RENDER((int)value);
+            else
+                written = LOG_RENDER(value);
+            break;
+        case LOG_ARG_DOUBLE:
+            memcpy(&dvalue, src, sizeof(double));
+            src += sizeof(double);
+            written = LOG_RENDER(dvalue);
+            break;
+        case LOG_ARG_STRING:
+            memcpy(&len, src, sizeof(uint16_t));
+            src += sizeof(uint16_t);
+            written = LOG_RENDER((char*)src);
+            src += len + 1;
+            break;
+        case LOG_ARG_PTR:
+            memcpy(&ptr, src, sizeof(void*));
+            src += sizeof(void*);
+            written = LOG_RENDER(ptr);
+            break;
+        }
+#undef LOG_RENDER
+
+        if(written < 0)
+            written = 0;
+        if((size_t)written >= left)
+            written = left - 1;
+        out += written;
+        left -= written;
+    }
+
+    buffer[size - 1] = '\0';
+}
+
+/*
+ * private
+ *
+ * claim a free ring slot.
+ *
+ * @param wait spin until a slot is free rather than failing
+ * @returns slot, or NULL if the ring is full
+ */
+static log_entry_t *debug_claim(int wait, uint64_t *pos) {
+    log_entry_t *entry;
+    uint64_t seq;
+    int64_t diff;
+
+    *pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    while(1) {
+        entry = &log_ring[*pos & LOG_RING_MASK];
+        seq = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+        diff = (int64_t)seq - (int64_t)*pos;
+
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&log_head, pos, *pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                return entry;
+        } else if(diff < 0) {
+            if(!wait)
+                return NULL;
+            sched_yield();
+            *pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+        } else {
+            *pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * private
+ *
+ * format and print everything waiting in the ring
+ *
+ * @returns number of entries printed
+ */
+static int debug_drain(void) {
+    log_entry_t *entry;
+    char line[LOG_LINE_MAX];
+    uint64_t dropped;
+    int count = 0;
+
+    while(1) {
+        entry = &log_ring[log_tail & LOG_RING_MASK];
+        if(__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != log_tail + 1)
+            break;
+
+        if(entry->format) {
+            debug_render(entry, line, sizeof(line));
+            fputs(line, stderr);
+        } else {
+            fwrite(entry->data, 1, entry->len, stderr);
+        }
+
+        __atomic_store_n(&entry->sequence, log_tail + LOG_RING_SIZE,
+                         __ATOMIC_RELEASE);
+        log_tail++;
+        count++;
+    }
+
+    dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if(dropped)
+        fprintf(stderr, "[WARN] log ring full: dropped %llu messages\n",
+                (unsigned long long)dropped);
+
+    return count;
+}
+
+/*
+ * private
+ *
+ * logging thread: format entries as they arrive
+ */
+static void *debug_proc(void *arg) {
+    struct timespec idle = { 0, LOG_IDLE_NSEC };
+
+    while(1) {
+        if(debug_drain()) {
+            fflush(stderr);
+            continue;
+        }
+
+        if(__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE))
+            break;
+
+        nanosleep(&idle, NULL);
+    }
+
+    debug_drain();
+    fflush(stderr);
+    return NULL;
+}
+
+/**
+ * start the logging thread.  Messages logged after this are
+ * formatted in the background.  Pending messages are flushed
+ * at exit.
+ */
+void debug_async_start(void) {
+    if(log_async)
         return;
 
+    for(int x = 0; x < LOG_RING_SIZE; x++)
+        log_ring[x].sequence = x;
+
+    if(pthread_create(&log_tid, NULL, debug_proc, NULL)) {
+        perror("pthread_create");
+        return;
+    }
+
+    __atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+    atexit(debug_async_stop);
+}
+
+/**
+ * flush pending messages and stop the logging thread,
+ * going back to synchronous printing
+ */
+void debug_async_stop(void) {
+    if(!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+        return;
+
+    __atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(log_tid, NULL);
+    __atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * log a message.  Callers should use the DEBUG/INFO/etc macros,
+ * which check the level before evaluating arguments.  format
+ * must outlive the call (i.e. be a string literal).
+ *
+ * @param level DBG_* level of the message
+ * @param format printf style format
+ */
+void debug_printf(int level, char *format, ...) {
+    log_entry_t *entry;
+    uint64_t pos;
+    va_list args, copy;
+    int len;
+
     va_start(args, format);
-    vfprintf(stderr, format, args);
+
+    if(!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)) {
+        vfprintf(stderr, format, args);
+        va_end(args);
+        return;
+    }
+
+    /* never lose errors; debug spew can be dropped */
+    entry = debug_claim(level <= DBG_WARN, &pos);
+    if(!entry) {
+        __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
+    }
+
+    entry->level = level;
+    va_copy(copy, args);
+    len = debug_capture(entry, format, &copy);
+    va_end(copy);
+
+    if(len >= 0) {
+        entry->format = format;
+        entry->len = len;
+    } else {
+        /* too big to capture, so format it here */
+        len = vsnprintf((char*)entry->data, LOG_ENTRY_DATA, format, args);
+        if(len >= LOG_ENTRY_DATA) {
+            len = LOG_ENTRY_DATA - 1;
+            entry->data[len - 1] = '\n';
+        }
+        entry->format = NULL;
+        entry->len = len < 0 ? 0 : len;
+    }
+
     va_end(args);
+    __atomic_store_n(&entry->sequence, pos + 1, __ATOMIC_RELEASE);
 }
@@ -25,40 +25,69 @@
 #define DBG_INFO  3
 #define DBG_DEBUG 4
 
+/* log modules, each with its own threshold.  A source file
+ * selects its module by defining DBG_MODULE before use
+ */
+#define DBG_MOD_CORE     0
+#define DBG_MOD_CPU      1
+#define DBG_MOD_BUS      2
+#define DBG_MOD_DEBUGGER 3
+#define DBG_MOD_HW       4
+#define DBG_MOD_MAX      5
+
+#ifndef DBG_MODULE
+# define DBG_MODULE DBG_MOD_CORE
+#endif
+
+/* the level check happens here, so arguments of suppressed
+ * messages are never evaluated.  Formats must be string
+ * literals, as formatting is deferred to the logging thread
+ */
+#define DBG_ON(level) (debug_levels[DBG_MODULE] >= (level))
+#define DBG_LOG(level, format, args...) do { \
+        if(DBG_ON(level))                  \
+            debug_printf(level, format, ##args); \
+    } while(0)
+
 #if defined(NDEBUG)
 #define DEBUG(format, args...)
 #define INFO(format, args...)
 #define WARN(format, args...)
-#define ERROR(format, args...) debug_printf(DBG_ERROR, "Error: " format "\n", ##args)
-#define FATAL(format, args...) debug_printf(DBG_FATAL, "Fatal: " format "\n", ##args)
+#define ERROR(format, args...) DBG_LOG(DBG_ERROR, "Error: " format "\n", ##args)
+#define FATAL(format, args...) DBG_LOG(DBG_FATAL, "Fatal: " format "\n", ##args)
 
 #define PDEBUG(format, args...)
 #define PINFO(format, args...)
 #define PWARN(format, args...)
-#define PERROR(format, args...) debug_printf(DBG_ERROR, "%s:%s: error: %s" format "\n", parser_file, parser_line, ##args)
-#define PFATAL(format, args...) debug_printf(DBG_FATAL, "%s:%s: fatal: %s" format "\n", parser_file, parser_line, ##args)
+#define PERROR(format, args...) DBG_LOG(DBG_ERROR, "%s:%s: error: %s" format "\n", parser_file, parser_line, ##args)
+#define PFATAL(format, args...) DBG_LOG(DBG_FATAL, "%s:%s: fatal: %s" format "\n", parser_file, parser_line, ##args)
 
 #define YERROR(format, args...) yyerror(format, ##args)
 # define DPRINTF(level, format, args...);
 #else
-#define DEBUG(format, args...) debug_printf(DBG_DEBUG, "[DEBUG] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define INFO(format, args...) debug_printf(DBG_INFO, "[INFO] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define WARN(format, args...) debug_printf(DBG_WARN, "[WARN] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define ERROR(format, args...) debug_printf(DBG_ERROR, "[ERROR] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define FATAL(format, args...) debug_printf(DBG_FATAL, "[FATAL] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
+#define DEBUG(format, args...) DBG_LOG(DBG_DEBUG, "[DEBUG] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
+#define INFO(format, args...) DBG_LOG(DBG_INFO, "[INFO] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
+#define WARN(format, args...) DBG_LOG(DBG_WARN, "[WARN] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
+#define ERROR(format, args...) DBG_LOG(DBG_ERROR, "[ERROR] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
+#define FATAL(format, args...) DBG_LOG(DBG_FATAL, "[FATAL] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
 
-#define PDEBUG(format, args...) debug_printf(DBG_DEBUG, "%s:%d: debug: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
-#define PINFO(format, args...) debug_printf(DBG_INFO, "%s:%d: info: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
-#define PWARN(format, args...) debug_printf(DBG_WARN, "%s:%d: warning: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
-#define PERROR(format, args...) debug_printf(DBG_ERROR, "%s:%d: error: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
-#define PFATAL(format, args...) debug_printf(DBG_FATAL, "%s:%d: fatal: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
+#define PDEBUG(format, args...) DBG_LOG(DBG_DEBUG, "%s:%d: debug: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
+#define PINFO(format, args...) DBG_LOG(DBG_INFO, "%s:%d: info: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
+#define PWARN(format, args...) DBG_LOG(DBG_WARN, "%s:%d: warning: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
+#define PERROR(format, args...) DBG_LOG(DBG_ERROR, "%s:%d: error: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
+#define PFATAL(format, args...) DBG_LOG(DBG_FATAL, "%s:%d: fatal: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
 
 #define YERROR(format, args...) yyerror(format, ##args)
 
-#define DPRINTF(level, format, args...)  debug_printf(level, "[%s] %s:%d (%s): " format "\n", #level, __FILE__, __LINE__, __FUNCTION__, ##args)
+#define DPRINTF(level, format, args...)  DBG_LOG(level, "[%s] %s:%d (%s): " format "\n", #level, __FILE__, __LINE__, __FUNCTION__, ##args)
 #endif /* NDEBUG */
 
+extern int debug_levels[DBG_MOD_MAX];
+
 extern void debug_level(int newlevel);
+extern int debug_parse_levels(char *spec);
+extern void debug_async_start(void);
+extern void debug_async_stop(void);
 extern void debug_printf(int level, char *format, ...);
 
 #endif /* _DEBUG_H_ */
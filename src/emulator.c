@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <libconfig.h>
@@ -34,9 +35,16 @@
 #include "6502.h"
 #include "stepwise.h"
 #include "hardware.h"
+#include "metrics.h"
+#include "runloop.h"
+#include "shmview.h"
+#include "loader.h"
+#include "throttle.h"
 
 config_t main_config;
 static void *stepwise_proc(void *arg);
+static void *headless_proc(void *arg);
+static void *metrics_proc(void *arg);
 
 #define DEFAULT_CONFIG_FILE "emulator.conf"
 #define DEFAULT_DEBUG_FIFO "/tmp/debug"
@@ -51,6 +59,7 @@ int load_memory(void) {
     int arg_items = 0;
     char *name;
     const char *module;
+    const char *setup;
 
     hw_config_t *hw_config = NULL;
 
@@ -77,6 +86,11 @@ int load_memory(void) {
         }
 
         INFO("  Module name: %s", module);
+
+        /* optional override of when the module's slow setup runs */
+        setup = NULL;
+        config_setting_lookup_string(pblock, "setup", &setup);
+
         args = config_setting_get_member(pblock, "args");
 
         if (!args) {
@@ -124,7 +138,7 @@ int load_memory(void) {
         }
 
         /* now, let's load it */
-        memory_load(name, module, hw_config);
+        memory_load(name, module, hw_config, setup);
 
         if (hw_config) {
             free(hw_config);
@@ -136,19 +150,80 @@ int load_memory(void) {
     return TRUE;
 }
 
+/**
+ * load the programs in the preload section of the config, after
+ * the hardware is loaded.  Each entry needs a file, and can have
+ * an address (for raw binaries) and set_pc.
+ *
+ * @param pc set to the entry point of the last preload with set_pc
+ * @returns TRUE if pc was set, FALSE otherwise
+ */
+int preload_memory(uint16_t *pc) {
+    config_setting_t *ppreload;
+    config_setting_t *pitem;
+    const char *file;
+    const char *value;
+    loader_result_t result;
+    uint16_t addr;
+    int set_pc = FALSE;
+    int error;
+    int index = 0;
+
+    ppreload = config_lookup(&main_config, "preload");
+    if(!ppreload)
+        return FALSE;
+
+    while((pitem = config_setting_get_elem(ppreload, index++))) {
+        if(!config_setting_lookup_string(pitem, "file", &file)) {
+            FATAL("Missing file entry for preload item %s",
+                  config_setting_name(pitem));
+            exit(1);
+        }
+
+        addr = 0;
+        if(config_setting_lookup_string(pitem, "address", &value))
+            addr = (uint16_t)strtoul(value, NULL, 0);
+
+        error = loader_load(file, addr, &result);
+        if(error != LOADER_OK) {
+            FATAL("Can't preload %s: %s", file, loader_error(error));
+            exit(1);
+        }
+
+        INFO("Preloaded %s: %d bytes, entry $%04x", file, result.bytes,
+             result.entry);
+
+        if(config_setting_lookup_string(pitem, "set_pc", &value) &&
+           ((strcasecmp(value, "true") == 0) || (strcmp(value, "1") == 0) ||
+            (strcasecmp(value, "yes") == 0))) {
+            *pc = result.entry;
+            set_pc = TRUE;
+        }
+    }
+
+    return set_pc;
+}
+
 int main(int argc, char *argv[]) {
     char *configfile = DEFAULT_CONFIG_FILE;
     char *base_path = DEFAULT_DEBUG_FIFO;
     int option;
     int step = 0;
-    int debuglevel = 2;
+    char *debuglevels = "2";
+    int metrics_interval = 0;
+    int clock_khz = -1;
+    char *shm_name = NULL;
+    char *socket_path = NULL;
+    uint16_t preload_pc;
+    int set_pc;
     pthread_t run_tid;
+    pthread_t metrics_tid;
     int running=1;
 
-    while((option = getopt(argc, argv, "d:sc:b:")) != -1) {
+    while((option = getopt(argc, argv, "d:sc:b:m:S:u:k:")) != -1) {
         switch(option) {
         case 'd':
-            debuglevel = atoi(optarg);
+            debuglevels = optarg;
             break;
 
         case 'c':
@@ -163,13 +238,31 @@ int main(int argc, char *argv[]) {
             step = 1;
             break;
 
+        case 'm':
+            metrics_interval = atoi(optarg);
+            break;
+
+        case 'S':
+            shm_name = optarg;
+            break;
+
+        case 'u':
+            socket_path = optarg;
+            break;
+
+        case 'k':
+            clock_khz = atoi(optarg);
+            break;
+
         default:
             fprintf(stderr,"Srsly?");
             exit(EXIT_FAILURE);
         }
     }
 
-    debug_level(debuglevel);
+    if(!debug_parse_levels(debuglevels))
+        exit(EXIT_FAILURE);
+    debug_async_start();
 
     config_init(&main_config);
     if(config_read_file(&main_config, configfile) != CONFIG_TRUE) {
@@ -179,14 +272,31 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    if(step)
-        step_init(NULL);
+    /* the socket replaces the fifos */
+    if(step && socket_path)
+        step_listen(socket_path);
+    else if(step)
+        step_init(base_path);
+
+    if(shm_name && !shmview_init(shm_name))
+        exit(EXIT_FAILURE);
 
     memory_init();
     if(!load_memory())
         exit(EXIT_FAILURE);
 
+    /* before the cpu picks up its reset vector */
+    set_pc = preload_memory(&preload_pc);
+
     cpu_init();
+    if(set_pc)
+        cpu_state.ip = preload_pc;
+    metrics_init();
+
+    /* -k overrides the config, and -k 0 runs flat out */
+    if((clock_khz < 0) && !config_lookup_int(&main_config, "clock_khz", &clock_khz))
+        clock_khz = 0;
+    throttle_init(clock_khz);
 
     if(step) {
         if(pthread_create(&run_tid, NULL, stepwise_proc, &running) < 0) {
@@ -194,6 +304,18 @@ int main(int argc, char *argv[]) {
             exit(EXIT_FAILURE);
         }
     } else {
+        if(pthread_create(&run_tid, NULL, headless_proc, &running) < 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(metrics_interval > 0) {
+        if(pthread_create(&metrics_tid, NULL, metrics_proc,
+                          &metrics_interval) < 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
     }
 
     /* here, we should run the event loop required by any drivers.
@@ -218,9 +340,47 @@ int main(int argc, char *argv[]) {
 static void *stepwise_proc(void *arg) {
     int *running = (int*) arg;
 
+    metrics_cpu_thread();
+
     *running = 1;
     stepwise_debugger();
     *running = 0;
+    memory_wake_eventloop();
 
     return running;
 }
+
+/**
+ * headless_proc - run the cpu flat out when there is no
+ * debugger attached
+ *
+ * @args arg: unused
+ */
+static void *headless_proc(void *arg) {
+    metrics_cpu_thread();
+
+    while(1) {
+        run_cpu(NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * metrics_proc - periodically dump the emulator counters
+ * to stderr as csv
+ *
+ * @args arg: pointer to dump interval, in seconds
+ */
+static void *metrics_proc(void *arg) {
+    int interval = *(int*)arg;
+
+    metrics_csv_header(stderr);
+
+    while(1) {
+        sleep(interval);
+        metrics_csv_line(stderr);
+    }
+
+    return NULL;
+}
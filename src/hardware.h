@@ -29,6 +29,12 @@
 #define MEMOP_READ       0
 #define MEMOP_WRITE      1
 
+/* when a module's setup runs, if it has one (see hw_reg_t) */
+#define HW_SETUP_NOW     0x00  /* during load, like init */
+#define HW_SETUP_THREAD  0x01  /* on a worker thread, while the cpu runs */
+#define HW_SETUP_LAZY    0x02  /* on the first access to the device */
+#define HW_SETUP_MAIN    0x10  /* ...but on the main (eventloop) thread */
+
 typedef struct mem_remap_t {
     uint16_t mem_start;
     uint16_t mem_end;
@@ -36,19 +42,56 @@ typedef struct mem_remap_t {
     uint8_t writable;
 } mem_remap_t;
 
+/* per-device counters.  reads and writes are maintained by the
+ * bus, the rest are up to the module to keep up to date
+ */
+typedef struct hw_stats_t {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t refreshes;
+} hw_stats_t;
+
+/* init should only parse the config and register the device.
+ * Anything slow (opening windows, starting servers) goes in
+ * setup, which runs according to setup_mode.  Until setup has
+ * returned, accesses to the device wait for it, and its memop
+ * and eventloop are not called.  setup returns 0 on failure.
+ *
+ * peek is optional, for devices where a read has side effects
+ * (taking a byte from a fifo, clearing status bits).  It gives
+ * the debugger the value a read would return, and changes
+ * nothing; it may be called from the debugger thread while the
+ * cpu runs.  Without it the debugger reads through memop.
+ */
 typedef struct hw_reg_t {
     char *name;
     char *descr;
     int hw_family;
     uint8_t (*memop)(struct hw_reg_t *, uint16_t, uint8_t, uint8_t);
     uint8_t (*eventloop)(void *, int);
+    int (*setup)(struct hw_reg_t *);
+    int setup_mode;
+    uint8_t (*peek)(struct hw_reg_t *, uint16_t);
     int irq_asserted;
     int nmi_asserted;
     void *state;
+    hw_stats_t stats;
     int remapped_regions;
     mem_remap_t remap[];
 } hw_reg_t;
 
+/* a module's entry point.  Built as a plugin it is "init"; built
+ * into the emulator (HW_BUILTIN) each module's gets a name of its
+ * own, for the registry in builtin.c
+ */
+#ifdef HW_BUILTIN
+#define HW_MODULE_INIT(name) hw_##name##_init
+#else
+#define HW_MODULE_INIT(name) init
+#endif
+
 typedef struct hw_config_item_t {
     const char *key;
     const char *value;
@@ -59,11 +102,68 @@ typedef struct hw_config_t {
     hw_config_item_t item[];
 } hw_config_t;
 
+/* a scheduled device event: called with its arg and the cpu
+ * cycle it was due at */
+typedef void (*hw_event_t)(void *, uint64_t);
+
+/* fd readiness for hw_io_add: an i/o callback gets its arg, the
+ * fd, and which of these are ready */
+#define HW_IO_READ  0x01
+#define HW_IO_WRITE 0x02
+#define HW_IO_HUP   0x04
+
+typedef void (*hw_io_t)(void *, int, int);
+
+/* hw_remap(hw, region, readable, writable) turns one of a device's
+ * mapped regions on or off for reads and writes.  It rebuilds the
+ * bus page table for that region's pages under a lock, so it's for
+ * occasional changes.  Where mapped regions overlap, the device
+ * loaded last wins.  hw_find_device looks up an already loaded
+ * device by its config name.
+ *
+ * Banking goes through hw_bank_add(controller, devices, count),
+ * called from the controller's init, which defines a bank as the
+ * devices mapped in while it's selected and returns its number
+ * (or -1).  Every device in any of a controller's banks is mapped
+ * out of the others.  hw_bank_select(controller, bank) then just
+ * copies page table entries worked out ahead of time, so it is
+ * cheap enough for every write to a bank register, and costs
+ * nothing per access.  Only from the cpu thread.
+ *
+ * hw_schedule(cycle, callback, arg) calls back when the cpu cycle
+ * count (hw_cycles) reaches cycle, for device timing in emulated
+ * time, and returns an id for hw_unschedule.  These are only for
+ * the cpu thread: init, memop, or an event callback.
+ *
+ * hw_clock_khz() is the clock rate the cpu is paced at (clock_khz
+ * in the config, or -k), or 0 if it runs flat out.  It is set as
+ * the cpu starts, after the modules load.
+ *
+ * hw_io_add(fd, events, callback, arg) watches a non-blocking fd
+ * on the emulator's one i/o thread, instead of a device running
+ * a reader thread of its own.  Callbacks run on the i/o thread,
+ * so shouldn't block.  hw_io_modify changes the HW_IO_* events
+ * waited for, and hw_io_remove stops watching.
+ */
 typedef struct hw_callbacks_t {
     void (*hw_logger)(int, char *, ...);
+    int *hw_log_level;
     void (*hw_notify)(char *, ...);
     void (*irq_change)(void);
     void (*nmi_change)(void);
+    uint8_t *(*hw_alloc_ram)(uint16_t, uint16_t);
+    void (*hw_register_ram)(uint16_t, uint16_t, uint8_t *);
+    void (*hw_remap)(hw_reg_t *, int, int, int);
+    hw_reg_t *(*hw_find_device)(const char *);
+    int (*hw_bank_add)(hw_reg_t *, hw_reg_t **, int);
+    void (*hw_bank_select)(hw_reg_t *, int);
+    uint64_t (*hw_cycles)(void);
+    int (*hw_schedule)(uint64_t, hw_event_t, void *);
+    void (*hw_unschedule)(int);
+    uint32_t (*hw_clock_khz)(void);
+    int (*hw_io_add)(int, int, hw_io_t, void *);
+    int (*hw_io_modify)(int, int);
+    void (*hw_io_remove)(int);
 } hw_callbacks_t;
 
 
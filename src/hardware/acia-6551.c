@@ -16,7 +16,6 @@
  */
 
 #include <errno.h>
-#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -29,34 +28,40 @@
 #include "acia-6551.h"
 
 #define UART_MAX_BUFFER 16
+#define UART_READ_CHUNK 64
+#define UART_TX_BUFFER  4096
 
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks);
+hw_reg_t *HW_MODULE_INIT(acia_6551)(hw_config_t *config, hw_callbacks_t *callbacks);
 static uint8_t uart_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data);
-static void *listener_proc(void *arg);
+static uint8_t uart_peek(hw_reg_t *hw, uint16_t addr);
+static void uart_io(void *arg, int fd, int events);
 
 typedef struct uart_state_t {
     uint8_t SR;  /* status register */
     uint8_t CMD; /* command register */
     uint8_t CTL; /* ctl register */
 
+    hw_reg_t *hw;
     int pty;
-    int head_buffer_pos;
-    int tail_buffer_pos;
 
-    int buffer[UART_MAX_BUFFER];
-    pthread_t listener_tid;
-    pthread_mutex_t state_lock;
+    /* filled by the i/o thread, emptied by the cpu.  SR_RDRF is
+     * the ring not being empty, and the i/o thread flags
+     * overruns in rx_overrun, until a reset clears SR_OR. */
+    hw_ring_t rx;
+    uint8_t rx_overrun;
+
+    /* filled by the cpu, written to the pty by the i/o thread.
+     * SR_TDRE is room in the ring. */
+    hw_tx_t tx;
 } uart_state_t;
 
-static void lock_state(uart_state_t *state);
-static void unlock_state(uart_state_t *state);
 static void receive_byte(uart_state_t *state, uint8_t byte);
 static void recalculate_irq(uart_state_t *state);
 
 static hw_callbacks_t *hardware_callbacks;
 
 
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
+hw_reg_t *HW_MODULE_INIT(acia_6551)(hw_config_t *config, hw_callbacks_t *callbacks) {
     hw_reg_t *uart_reg;
     uint16_t start;
     uint16_t end;
@@ -71,7 +76,7 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
         exit(1);
     }
 
-    memset(uart_reg, 0, sizeof(uart_reg));
+    memset(uart_reg, 0, sizeof(hw_reg_t));
 
     if(!config_get_uint16(config, "mem_start", &start))
         return NULL;
@@ -80,6 +85,7 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
 
     uart_reg->hw_family = HW_FAMILY_SERIAL;
     uart_reg->memop = uart_memop;
+    uart_reg->peek = uart_peek;
     uart_reg->remapped_regions = 1;
 
     uart_reg->remap[0].mem_start = start;
@@ -93,12 +99,16 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
         exit(1);
     }
 
+    memset(state, 0, sizeof(uart_state_t));
+
     /* init the state */
     uart_reg->state = state;
+    state->hw = uart_reg;
 
     state->CTL = 0;
     state->CMD = 0x02;  /* rx irq disabled */
     state->SR = 0x10;   /* tdr empty */
+    hw_ring_init(&state->rx, UART_MAX_BUFFER);
 
     /* set up the pty */
     state->pty = posix_openpt(O_RDWR);
@@ -123,23 +133,22 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
     INFO("Opened pty for 6551 uart at %s", ptsname(state->pty));
     NOTIFY("Opened pty for 6551 uart at %s", ptsname(state->pty));
 
-    /* now, start up an async listener thread */
-    if(pthread_mutex_init(&state->state_lock, NULL) < 0) {
-        perror("pthread_mutex_init");
+    /* and listen for input on the i/o thread */
+    if(fcntl(state->pty, F_SETFL, fcntl(state->pty, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl");
         return NULL;
     }
 
-    if(pthread_create(&state->listener_tid, NULL, listener_proc, state) < 0) {
-        perror("pthread_create");
+    if(!hardware_callbacks->hw_io_add(state->pty, HW_IO_READ, uart_io, state))
         return NULL;
-    }
+
+    hw_tx_init(&state->tx, hardware_callbacks, state->pty, HW_IO_READ, UART_TX_BUFFER);
 
     return uart_reg;
 }
 
 /**
  * we aren't honoring irq yet
- * caller must be holding state lock.
  *
  * @param state uart state
  */
@@ -147,91 +156,65 @@ void recalculate_irq(uart_state_t *state) {
     /* nothing to see here */
 }
 
-/**
- * Lock the state blob when producing or consuming.  It either
- * succeeds, or we exit.
- *
- * @param state uart state to be locked
- */
-void lock_state(uart_state_t *state) {
-    int res;
-
-    if((res = pthread_mutex_lock(&state->state_lock))) {
-        perror("pthread_mutex_lock");
-        exit(EXIT_FAILURE);
-    }
-}
-
-/**
- * and conversely, unlock the state blob.  Again, if this does
- * not succeed, bad things are afoot and we crash.
- *
- * @param state uart state to be unlocked
- */
-
-void unlock_state(uart_state_t *state) {
-    int res;
-
-    if((res = pthread_mutex_unlock(&state->state_lock))) {
-        perror("pthread_mutex_unlock");
-        exit(EXIT_FAILURE);
-    }
-}
-
 /**
  * do the needful when we receive a new async byte.  This
  * should update the fifo, recalculate whether or not we
- * should be holding irq low, etc.
+ * should be holding irq low, etc.  Runs on the i/o thread,
+ * as the rx ring's only producer.
  *
- * @param state uart state (unlocked)
+ * @param state uart state
  * @param byte data byte received
  */
 void receive_byte(uart_state_t *state, uint8_t byte) {
-    lock_state(state);
-
-    if(((state->head_buffer_pos + 1) % UART_MAX_BUFFER) == state->tail_buffer_pos) {
+    if(!hw_ring_put(&state->rx, byte)) {
         /* we just dropped a char */
-        state->SR |= SR_OR;
+        __atomic_store_n(&state->rx_overrun, 1, __ATOMIC_RELAXED);
         INFO("just dropped byte");
     } else {
-        state->buffer[state->head_buffer_pos] = byte;
-        state->head_buffer_pos = (state->head_buffer_pos + 1) % UART_MAX_BUFFER;
-        /* mark rx available */
-        state->SR |= SR_RDRF;
+        state->hw->stats.rx_bytes++;
     }
 
     recalculate_irq(state);
-
-    unlock_state(state);
 }
 
 
 /**
- * Async listener for pty.  This listens on the pty and
- * any received bytes get passed to the receive_byte function.
+ * the pty is ready, on the i/o thread.  Pending output is
+ * written, and whatever has arrived gets passed to the
+ * receive_byte function.
  *
  * @param arg a void* cast state blob
+ * @param fd the pty
+ * @param events HW_IO_* events that are ready
  */
-void *listener_proc(void *arg) {
+static void uart_io(void *arg, int fd, int events) {
     uart_state_t *state = (uart_state_t*)arg;
-    int res;
-    uint8_t byte;
-
-    while(1) {
-        res = read(state->pty, &byte, sizeof(byte));
-        if(res < 0) {
-            perror("read");
-            exit(EXIT_FAILURE);
-        }
+    uint8_t buffer[UART_READ_CHUNK];
+    ssize_t res;
 
-        if(res == 0) {
-            /* file closed out from end of us */
-            WARN("EOF on pty");
-            exit(EXIT_FAILURE);
-        }
+    if(events & HW_IO_WRITE)
+        hw_tx_drain(&state->tx);
+
+    if(!(events & (HW_IO_READ | HW_IO_HUP)))
+        return;
 
-        receive_byte(state, byte);
-        DEBUG("got byte $%02x", byte);
+    res = read(fd, buffer, sizeof(buffer));
+    if(res < 0) {
+        if((errno == EAGAIN) || (errno == EINTR))
+            return;
+        perror("read");
+        exit(EXIT_FAILURE);
+    }
+
+    if(res == 0) {
+        /* file closed out from end of us */
+        WARN("EOF on pty");
+        exit(EXIT_FAILURE);
+    }
+
+    for(int x = 0; x < res; x++) {
+        receive_byte(state, buffer[x]);
+        DEBUG("got byte $%02x", buffer[x]);
     }
 }
 
@@ -253,40 +236,41 @@ uint8_t uart_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data) {
     switch(addr_offset) {
     case 0: /* tx/rx register */
         if(read) {
-            lock_state(state);
-            if(state->head_buffer_pos == state->tail_buffer_pos) {
+            if(!hw_ring_get(&state->rx, &retval)) {
                 /* nothing in the buffer */
                 retval = 0;
-            } else {
-                retval = state->buffer[state->tail_buffer_pos];
-                state->tail_buffer_pos = (state->tail_buffer_pos + 1) % UART_MAX_BUFFER;
-                if(state->tail_buffer_pos == state->head_buffer_pos) {
-                    /* fifo is empty */
-                    state->SR &= ~SR_RDRF;
-                    recalculate_irq(state);
-                }
+            } else if(!hw_ring_ready(&state->rx)) {
+                /* fifo is empty */
+                recalculate_irq(state);
             }
-            unlock_state(state);
             return retval;
+        } else if(hw_tx_put(&state->tx, data)) {
+            hw->stats.tx_bytes++;
         } else {
-            write(state->pty, &data, 1);
+            WARN("tx overrun, dropped byte");
         }
         break;
 
     case 1: /* SR, PROGRAM RESET */
         if(read) {
-            return state->SR;
+            retval = state->SR & ~SR_TDRE;
+            if(hw_tx_ready(&state->tx))
+                retval |= SR_TDRE;
+            if(hw_ring_ready(&state->rx))
+                retval |= SR_RDRF;
+            if(__atomic_load_n(&state->rx_overrun, __ATOMIC_RELAXED))
+                retval |= SR_OR;
+            return retval;
         } else {
             /* program reset */
             /* reset registers */
             state->CMD &= 0x70;
             state->CMD |= 0x02;
 
-            state->SR &= ~SR_OR;
+            __atomic_store_n(&state->rx_overrun, 0, __ATOMIC_RELAXED);
 
             /* reset the rx/tx fifos */
-            state->head_buffer_pos = 0;
-            state->tail_buffer_pos = 0;
+            hw_ring_flush(&state->rx);
         }
         break;
 
@@ -305,3 +289,22 @@ uint8_t uart_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data) {
 
     return 0;
 }
+
+/**
+ * read a register for the debugger.  Only the data register
+ * has a side effect on read, so look at the next received byte
+ * rather than take it.
+ *
+ * @param addr address to read
+ * @return what a read would return
+ */
+uint8_t uart_peek(hw_reg_t *hw, uint16_t addr) {
+    uart_state_t *state = (uart_state_t*)(hw->state);
+    uint8_t retval = 0;
+
+    if(addr - hw->remap[0].mem_start)
+        return uart_memop(hw, addr, MEMOP_READ, 0);
+
+    hw_ring_first(&state->rx, &retval);
+    return retval;
+}
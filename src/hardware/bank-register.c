@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2013 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A bank register, like the C64 processor port.  Each map is a bank
+ * on the bus (hw_bank_add), and writing the register selects one,
+ * so a banked machine costs nothing extra per access.  The device also
+ * serves the rest of its range as plain ram, so it can take a
+ * whole page and keep that page on the fast path.
+ *
+ * args:
+ *   mem_start, mem_end  range served, including the registers
+ *   register            address of the bank register (mem_start)
+ *   ddr                 address of a data direction register.  Bits
+ *                       set in it are outputs; inputs read as 1.
+ *                       Without one, every bit is an output.
+ *   reset               register value at power on (0xff)
+ *   mask                bits of the register that select a bank (0xff)
+ *   map_<n>             comma separated names of the devices mapped
+ *                       in when the selected bits are n.  Every device
+ *                       named in any map is switched; the rest of the
+ *                       time it is out for reads and writes.  Devices
+ *                       must be loaded before the bank register, and
+ *                       the devices they cover (usually ram) before
+ *                       them.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "hardware.h"
+#include "hw-common.h"
+
+hw_reg_t *HW_MODULE_INIT(bank_register)(hw_config_t *config, hw_callbacks_t *callbacks);
+uint8_t bank_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data);
+
+#define BANK_MAX_DEVICES 16
+
+typedef struct bank_state_t {
+    hw_reg_t *hw;
+    uint8_t *mem;
+    uint16_t reg;
+    uint16_t ddr_reg;
+    int has_ddr;
+    uint8_t port;
+    uint8_t ddr;
+    uint8_t mask;
+    int current;
+    int banks[256];       /* bus bank for each register value */
+} bank_state_t;
+
+static hw_callbacks_t *hardware_callbacks;
+
+/*
+ * private
+ *
+ * add a map_<n> list of device names as a bank on the bus.
+ * Returns the bank, or -1 on error.
+ */
+static int bank_parse_map(bank_state_t *state, char *list) {
+    hw_reg_t *devices[BANK_MAX_DEVICES];
+    char *copy;
+    char *name;
+    char *save;
+    int count = 0;
+
+    copy = strdup(list);
+    if(!copy) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for(name = strtok_r(copy, ", ", &save); name; name = strtok_r(NULL, ", ", &save)) {
+        if(count == BANK_MAX_DEVICES) {
+            ERROR("Too many banked devices");
+            free(copy);
+            return -1;
+        }
+
+        devices[count] = hardware_callbacks->hw_find_device(name);
+        if(!devices[count]) {
+            ERROR("No device %s to bank (it must be loaded first)", name);
+            free(copy);
+            return -1;
+        }
+        count++;
+    }
+
+    free(copy);
+    return hardware_callbacks->hw_bank_add(state->hw, devices, count);
+}
+
+/*
+ * private
+ *
+ * switch to the bank the register selects, if it's changed
+ */
+static void bank_select(bank_state_t *state) {
+    uint8_t value = (state->port & state->ddr) | ~state->ddr;
+    int bank = state->banks[value & state->mask];
+
+    if(bank == state->current)
+        return;
+
+    hardware_callbacks->hw_bank_select(state->hw, bank);
+    state->current = bank;
+}
+
+hw_reg_t *HW_MODULE_INIT(bank_register)(hw_config_t *config, hw_callbacks_t *callbacks) {
+    hw_reg_t *bank_reg;
+    uint16_t start;
+    uint16_t end;
+    uint16_t value;
+    bank_state_t *state;
+    char key[16];
+    char *list;
+    int index;
+    int none = -1;
+
+    hardware_callbacks = callbacks;
+
+    if(!callbacks->hw_bank_add || !callbacks->hw_find_device) {
+        ERROR("Emulator does not support banking");
+        return NULL;
+    }
+
+    bank_reg = malloc(sizeof(hw_reg_t) + sizeof(mem_remap_t));
+    if(!bank_reg) {
+        perror("malloc");
+        exit(1);
+    }
+
+    memset(bank_reg, 0, sizeof(hw_reg_t));
+
+    if(!config_get_uint16(config, "mem_start", &start))
+        return NULL;
+
+    if(!config_get_uint16(config, "mem_end", &end))
+        return NULL;
+
+    bank_reg->hw_family = HW_FAMILY_MEMORY;
+    bank_reg->memop = bank_memop;
+    bank_reg->remapped_regions = 1;
+
+    bank_reg->remap[0].mem_start = start;
+    bank_reg->remap[0].mem_end = end;
+    bank_reg->remap[0].readable = 1;
+    bank_reg->remap[0].writable = 1;
+
+    int size = end - start + 1;
+
+    state = malloc(sizeof(bank_state_t));
+    if(!state) {
+        perror("malloc");
+        exit(1);
+    }
+
+    memset(state, 0, sizeof(bank_state_t));
+    state->hw = bank_reg;
+
+    /* not registered as ram: writes to the registers must come
+     * through bank_memop, even from the debugger */
+    state->mem = malloc(size);
+    if(!state->mem) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(state->mem, 0, size);
+
+    state->reg = start;
+    config_get_uint16(config, "register", &state->reg);
+
+    state->ddr = 0xff;
+    if(config_get_uint16(config, "ddr", &state->ddr_reg)) {
+        state->has_ddr = 1;
+        state->ddr = 0;
+    }
+
+    value = 0xff;
+    config_get_uint16(config, "reset", &value);
+    state->port = value;
+
+    value = 0xff;
+    config_get_uint16(config, "mask", &value);
+    state->mask = value;
+
+    if((state->reg < start) || (state->reg > end) ||
+       (state->has_ddr && ((state->ddr_reg < start) || (state->ddr_reg > end)))) {
+        ERROR("Bank registers must be in $%04x-$%04x", start, end);
+        return NULL;
+    }
+
+    for(index = 0; index <= state->mask; index++) {
+        if((index & state->mask) != index)
+            continue;
+
+        snprintf(key, sizeof(key), "map_%d", index);
+        list = config_get(config, key);
+        if(list) {
+            state->banks[index] = bank_parse_map(state, list);
+        } else {
+            /* values with no map share a bank with nothing in */
+            if(none == -1)
+                none = hardware_callbacks->hw_bank_add(bank_reg, NULL, 0);
+            state->banks[index] = none;
+        }
+
+        if(state->banks[index] == -1)
+            return NULL;
+    }
+
+    /* everything starts out mapped in, so switch to the reset bank */
+    state->current = -1;
+    bank_select(state);
+
+    state->mem[state->reg - start] = (state->port & state->ddr) | ~state->ddr;
+    if(state->has_ddr)
+        state->mem[state->ddr_reg - start] = state->ddr;
+
+    DEBUG("Bank register at $%04x", state->reg);
+
+    bank_reg->state = state;
+    return bank_reg;
+}
+
+/**
+ * Perform a memory operation on a registered memory address
+ *
+ * @param addr address of memory operation
+ * @param memop a memop constant (@see MEMOP_READ, @see MEMOP_WRITE)
+ * @param data byte to write (on MEMOP_WRITE)
+ * @return data item (on MEMOP_READ)
+ */
+uint8_t bank_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data) {
+    bank_state_t *state = (bank_state_t*)(hw->state);
+    uint16_t offset = addr - hw->remap[0].mem_start;
+
+    if(memop == MEMOP_READ)
+        return state->mem[offset];
+
+    if(memop != MEMOP_WRITE)
+        return 0;
+
+    if(addr == state->reg) {
+        state->port = data;
+    } else if(state->has_ddr && (addr == state->ddr_reg)) {
+        state->ddr = data;
+    } else {
+        state->mem[offset] = data;
+        return 1;
+    }
+
+    bank_select(state);
+
+    /* reads give back what the port drives */
+    state->mem[state->reg - hw->remap[0].mem_start] = (state->port & state->ddr) | ~state->ddr;
+    if(state->has_ddr)
+        state->mem[state->ddr_reg - hw->remap[0].mem_start] = state->ddr;
+
+    return 1;
+}
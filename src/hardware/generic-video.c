@@ -101,6 +101,7 @@ static color_t video_colors[] = {
 };
 
 typedef struct video_state_t {
+    hw_reg_t *hw;
     uint8_t mode_register;  /* 4095 */
     uint8_t color_register; /* 4094 */
     int dirty;
@@ -123,17 +124,18 @@ typedef struct video_state_t {
 #endif
 } video_state_t;
 
-hw_callbacks_t *hardware_callbacks;
+static hw_callbacks_t *hardware_callbacks;
 
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks);
+hw_reg_t *HW_MODULE_INIT(generic_video)(hw_config_t *config, hw_callbacks_t *callbacks);
 uint8_t video_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data);
 static uint8_t video_eventloop(void *arg, int blocking);
+static int video_setup(hw_reg_t *hw);
 static void lock_state(video_state_t *state);
 static void unlock_state(video_state_t *state);
 static void set_value_at_position(video_state_t *state, int x,
                                   int y, uint8_t value);
 
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
+hw_reg_t *HW_MODULE_INIT(generic_video)(hw_config_t *config, hw_callbacks_t *callbacks) {
     hw_reg_t *video_reg;
     uint16_t start;
     uint16_t end;
@@ -148,7 +150,7 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
         exit(1);
     }
 
-    memset(video_reg, 0, sizeof(video_reg));
+    memset(video_reg, 0, sizeof(hw_reg_t));
 
     if(!config_get_uint16(config, "mem_start", &start))
         return NULL;
@@ -162,6 +164,10 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
     video_reg->hw_family = HW_FAMILY_IO;
     video_reg->memop = video_memop;
     video_reg->eventloop = video_eventloop;
+    video_reg->setup = video_setup;
+    /* nothing to see until something is drawn, and SDL wants
+     * to be on the thread running its event loop */
+    video_reg->setup_mode = HW_SETUP_LAZY | HW_SETUP_MAIN;
     video_reg->remapped_regions = 1;
 
     video_reg->remap[0].mem_start = start;
@@ -209,7 +215,25 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
         return NULL;
     }
 
+    video_reg->state = state;
+    state->hw = video_reg;
+
+    state->dirty = 0;
     state->mode_register = 0;
+    state->color_register = 0x0F;
+
+    return video_reg;
+}
+
+/**
+ * bring up SDL, the window and the character textures.  This
+ * is slow, so it's deferred until the screen is first used.
+ *
+ * @param hw the video device
+ * @return 1 on success
+ */
+static int video_setup(hw_reg_t *hw) {
+    video_state_t *state = (video_state_t*)(hw->state);
 
     INFO("Initializing SDL");
 
@@ -288,13 +312,7 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
     state->screen = SDL_SetVideoMode(640, 480, 32, SDL_SWSURFACE);
 #endif
 
-    video_reg->state = state;
-
-    state->dirty = 0;
-    state->mode_register = 0;
-    state->color_register = 0x0F;
-
-    return video_reg;
+    return 1;
 }
 
 /**
@@ -441,6 +459,7 @@ static uint8_t video_eventloop(void *arg, int blocking) {
 
         if(state->dirty) {
             INFO("refreshing display");
+            state->hw->stats.refreshes++;
             switch(state->mode_register) {
             case 0:
                 bg_color = &video_colors[state->color_register & 0x0f];
@@ -16,10 +16,12 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 
 #include "hardware.h"
@@ -45,9 +47,9 @@ int config_get_bool(hw_config_t *config, char *key, int *value) {
     if(!str_value)
         return 0;
 
-    if(strcasecmp(key, "true") == 0) {
-        *value = 1;
-    } else if(strcastcmp(key, "yes") == 0) {
+    if((strcasecmp(str_value, "true") == 0) ||
+       (strcasecmp(str_value, "yes") == 0) ||
+       (strcmp(str_value, "1") == 0)) {
         *value = 1;
     } else {
         *value = 0;
@@ -79,3 +81,107 @@ int config_get_uint16(hw_config_t *config, char *key, uint16_t *value) {
 
     exit(1);
 }
+
+/**
+ * set up an empty ring
+ *
+ * @param ring ring to set up
+ * @param size capacity in bytes, a power of two
+ */
+void hw_ring_init(hw_ring_t *ring, uint32_t size) {
+    assert(size && !(size & (size - 1)));
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->mask = size - 1;
+    ring->data = malloc(size);
+    if(!ring->data) {
+        perror("malloc");
+        exit(1);
+    }
+}
+
+/**
+ * set up a transmit path
+ *
+ * @param tx transmit path to set up
+ * @param callbacks the module's hardware callbacks
+ * @param fd non-blocking fd, already watched with hw_io_add
+ * @param events what the fd is watched for when idle
+ * @param size ring size, a power of two
+ */
+void hw_tx_init(hw_tx_t *tx, hw_callbacks_t *callbacks,
+                int fd, int events, uint32_t size) {
+    hw_ring_init(&tx->ring, size);
+    tx->callbacks = callbacks;
+    tx->fd = fd;
+    tx->events = events;
+    tx->armed = 0;
+    tx->failed = 0;
+}
+
+/**
+ * queue a byte to send, and get the i/o thread to write it if it
+ * isn't already waiting to.  Only from the cpu thread, as the
+ * ring's producer.
+ *
+ * @param tx transmit path
+ * @param byte byte to send
+ * @returns 1, or 0 if the ring was full and the byte dropped
+ */
+int hw_tx_put(hw_tx_t *tx, uint8_t byte) {
+    if(!hw_ring_put(&tx->ring, byte))
+        return 0;
+
+    if(!__atomic_exchange_n(&tx->armed, 1, __ATOMIC_SEQ_CST))
+        tx->callbacks->hw_io_modify(tx->fd, tx->events | HW_IO_WRITE);
+
+    return 1;
+}
+
+/**
+ * the fd is writable: write out as much of the ring as it will
+ * take, and once the ring is empty, stop waiting for it to be
+ * writable.  Only from the i/o thread.
+ *
+ * @param tx transmit path
+ */
+void hw_tx_drain(hw_tx_t *tx) {
+    hw_callbacks_t *hardware_callbacks = tx->callbacks;
+    uint8_t *data;
+    uint32_t len;
+    ssize_t res;
+
+    while(1) {
+        data = hw_ring_peek(&tx->ring, &len);
+        if(!len)
+            break;
+
+        res = write(tx->fd, data, len);
+        if(res < 0) {
+            if((errno == EAGAIN) || (errno == EINTR))
+                return;
+
+            /* nobody to send to: drop it rather than spin */
+            if(!tx->failed)
+                ERROR("write: %s, dropping output", strerror(errno));
+            tx->failed = 1;
+            hw_ring_flush(&tx->ring);
+            break;
+        }
+
+        tx->failed = 0;
+        hw_ring_consume(&tx->ring, res);
+    }
+
+    /* disarm before clearing armed, so a put that sees it clear
+     * always re-arms after us */
+    tx->callbacks->hw_io_modify(tx->fd, tx->events);
+    __atomic_store_n(&tx->armed, 0, __ATOMIC_SEQ_CST);
+
+    /* the cpu may have added more after the last peek, and seen
+     * armed still set */
+    if(hw_ring_count(&tx->ring) &&
+       !__atomic_exchange_n(&tx->armed, 1, __ATOMIC_SEQ_CST))
+        tx->callbacks->hw_io_modify(tx->fd, tx->events | HW_IO_WRITE);
+}
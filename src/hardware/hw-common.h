@@ -22,6 +22,127 @@ extern char *config_get(hw_config_t *config, char *key);
 extern int config_get_uint16(hw_config_t *config, char *key, uint16_t *value);
 extern int config_get_bool(hw_config_t *config, char *key, int *value);
 
+/* a single producer, single consumer byte ring, for passing bytes
+ * between the i/o thread and the cpu thread without a lock.  head
+ * is only written by the producer and tail by the consumer, each
+ * on its own cache line, and a release store of either index
+ * publishes the bytes (or space) before it.  Indexes run free and
+ * are masked, so size must be a power of two.
+ */
+typedef struct hw_ring_t {
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t mask __attribute__((aligned(64)));
+    uint8_t *data;
+} hw_ring_t;
+
+extern void hw_ring_init(hw_ring_t *ring, uint32_t size);
+
+/* producer: add a byte, or return 0 if the ring is full */
+static inline int hw_ring_put(hw_ring_t *ring, uint8_t byte) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask)
+        return 0;
+
+    ring->data[head & ring->mask] = byte;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* consumer: take a byte, or return 0 if the ring is empty */
+static inline int hw_ring_get(hw_ring_t *ring, uint8_t *byte) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+        return 0;
+
+    *byte = ring->data[tail & ring->mask];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* consumer: is there anything to take? */
+static inline int hw_ring_ready(hw_ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) !=
+        __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+/* either side: bytes in the ring */
+static inline uint32_t hw_ring_count(hw_ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* any thread: the byte hw_ring_get would return next, without
+ * taking it, or return 0 if the ring is empty */
+static inline int hw_ring_first(hw_ring_t *ring, uint8_t *byte) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+        return 0;
+
+    *byte = __atomic_load_n(&ring->data[tail & ring->mask], __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* consumer: the bytes waiting that are contiguous in the ring,
+ * for writing out in one go.  Follow with hw_ring_consume. */
+static inline uint8_t *hw_ring_peek(hw_ring_t *ring, uint32_t *len) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t count = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    uint32_t offset = tail & ring->mask;
+
+    *len = (count < ring->mask + 1 - offset) ? count : ring->mask + 1 - offset;
+    return ring->data + offset;
+}
+
+/* consumer: drop len bytes that hw_ring_peek returned */
+static inline void hw_ring_consume(hw_ring_t *ring, uint32_t len) {
+    __atomic_store_n(&ring->tail, __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) + len,
+                     __ATOMIC_RELEASE);
+}
+
+/* consumer: throw away whatever is waiting */
+static inline void hw_ring_flush(hw_ring_t *ring) {
+    __atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+}
+
+/* a buffered transmit path to a non-blocking fd watched on the
+ * i/o thread.  The cpu thread puts bytes in the ring, and the first
+ * one arms the fd for writability; the i/o thread drains the ring
+ * in as few writes as it can, then disarms.  armed is set while the
+ * i/o thread is waiting to write.  events are what the fd is
+ * watched for the rest of the time.  If a write fails (the far
+ * end of a pty closed, say) what's buffered is thrown away, like
+ * a line with nothing on it; failed keeps that to one log message
+ * until a write works again.
+ */
+typedef struct hw_tx_t {
+    hw_ring_t ring;
+    hw_callbacks_t *callbacks;
+    int fd;
+    int events;
+    uint8_t armed;
+    uint8_t failed;
+} hw_tx_t;
+
+extern void hw_tx_init(hw_tx_t *tx, hw_callbacks_t *callbacks,
+                       int fd, int events, uint32_t size);
+extern int hw_tx_put(hw_tx_t *tx, uint8_t byte);
+extern void hw_tx_drain(hw_tx_t *tx);
+
+/* bytes the i/o thread hasn't written yet */
+static inline uint32_t hw_tx_pending(hw_tx_t *tx) {
+    return hw_ring_count(&tx->ring);
+}
+
+/* is there room for another byte? */
+static inline int hw_tx_ready(hw_tx_t *tx) {
+    return hw_ring_count(&tx->ring) <= tx->ring.mask;
+}
+
 #define DBG_FATAL 0
 #define DBG_ERROR 1
 #define DBG_WARN  2
@@ -30,20 +151,28 @@ extern int config_get_bool(hw_config_t *config, char *key, int *value);
 
 #define NOTIFY(format, args...) hardware_callbacks->hw_notify(format, ##args)
 
+/* check the level before evaluating arguments.  The emulator
+ * formats messages later, so formats must be string literals
+ */
+#define HW_LOG(level, format, args...) do { \
+        if(*hardware_callbacks->hw_log_level >= (level)) \
+            hardware_callbacks->hw_logger(level, format, ##args); \
+    } while(0)
+
 #if defined(NDEBUG)
 #define DEBUG(format, args...)
 #define INFO(format, args...)
 #define WARN(format, args...)
-#define ERROR(format, args...) hardware_callbacks->hw_logger(DBG_ERROR, "Error: " format "\n", ##args)
-#define FATAL(format, args...) hardware_callbacks->hw_logger(DBG_FATAL, "Fatal: " format "\n", ##args)
+#define ERROR(format, args...) HW_LOG(DBG_ERROR, "Error: " format "\n", ##args)
+#define FATAL(format, args...) HW_LOG(DBG_FATAL, "Fatal: " format "\n", ##args)
 # define DPRINTF(level, format, args...);
 #else
-#define DEBUG(format, args...) hardware_callbacks->hw_logger(DBG_DEBUG, "[DEBUG] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define INFO(format, args...) hardware_callbacks->hw_logger(DBG_INFO, "[INFO] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define WARN(format, args...) hardware_callbacks->hw_logger(DBG_WARN, "[WARN] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define ERROR(format, args...) hardware_callbacks->hw_logger(DBG_ERROR, "[ERROR] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define FATAL(format, args...) hardware_callbacks->hw_logger(DBG_FATAL, "[FATAL] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define DPRINTF(level, format, args...)  hardware_callbacks->hw_logger(level, "[%s] %s:%d (%s): " format "\n", #level, __FILE__, __LINE__, __FUNCTION__, ##args)
+#define DEBUG(format, args...) HW_LOG(DBG_DEBUG, "[DEBUG] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
+#define INFO(format, args...) HW_LOG(DBG_INFO, "[INFO] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
+#define WARN(format, args...) HW_LOG(DBG_WARN, "[WARN] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
+#define ERROR(format, args...) HW_LOG(DBG_ERROR, "[ERROR] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
+#define FATAL(format, args...) HW_LOG(DBG_FATAL, "[FATAL] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
+#define DPRINTF(level, format, args...)  HW_LOG(level, "[%s] %s:%d (%s): " format "\n", #level, __FILE__, __LINE__, __FUNCTION__, ##args)
 #endif /* NDEBUG */
 
 
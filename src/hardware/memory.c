@@ -16,15 +16,19 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "hardware.h"
 #include "hw-common.h"
 
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks);
+hw_reg_t *HW_MODULE_INIT(memory)(hw_config_t *config, hw_callbacks_t *callbacks);
 uint8_t mem_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data);
 
 typedef struct mem_state_t {
@@ -33,7 +37,55 @@ typedef struct mem_state_t {
 
 static hw_callbacks_t *hardware_callbacks;
 
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
+/*
+ * private
+ *
+ * map a backing file as a region's storage.  A rom is mapped
+ * private, so identical images share pages with every other
+ * emulator until the debugger writes one.  Persistent ram is
+ * mapped shared, so writes land in the file, which is created or
+ * grown to fit.  Returns NULL if a rom image is too short to map.
+ */
+static uint8_t *mem_map_file(char *path, int size, int persistent) {
+    struct stat sb;
+    void *mem;
+    int fd;
+
+    fd = open(path, persistent ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if(fd == -1) {
+        perror("open");
+        exit(1);
+    }
+
+    if(fstat(fd, &sb) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+
+    if(sb.st_size < size) {
+        if(!persistent) {
+            close(fd);
+            return NULL;
+        }
+
+        if(ftruncate(fd, size) == -1) {
+            perror("ftruncate");
+            exit(1);
+        }
+    }
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               persistent ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if(mem == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    close(fd);
+    return (uint8_t*)mem;
+}
+
+hw_reg_t *HW_MODULE_INIT(memory)(hw_config_t *config, hw_callbacks_t *callbacks) {
     hw_reg_t *mem_reg;
     uint16_t start;
     uint16_t end;
@@ -41,6 +93,8 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
     char *is_rom;
     char *backing_file;
     uint8_t writable = 1;
+    int persistent = 0;
+    struct stat sb;
 
     hardware_callbacks = callbacks;
 
@@ -68,6 +122,12 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
     }
 
     backing_file = config_get(config, "backing_file");
+    config_get_bool(config, "persistent", &persistent);
+
+    if(persistent && (!backing_file || !writable)) {
+        ERROR("persistent memory needs a backing_file, and can't be rom");
+        return NULL;
+    }
 
     mem_reg->hw_family = HW_FAMILY_MEMORY;
     mem_reg->memop = mem_memop;
@@ -85,20 +145,38 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
         exit(1);
     }
 
-    state->mem = malloc(size);
+    state->mem = NULL;
+    if(backing_file && (persistent || !writable))
+        state->mem = mem_map_file(backing_file, size, persistent);
+
+    if(state->mem) {
+        DEBUG("Mapped %s at $%04x-$%04x", backing_file, start, end);
+        if(callbacks->hw_register_ram)
+            callbacks->hw_register_ram(start, end, state->mem);
+        mem_reg->state = state;
+        return mem_reg;
+    }
+
+    /* storage from the shared view, if there is one */
+    state->mem = callbacks->hw_alloc_ram ? callbacks->hw_alloc_ram(start, end) : NULL;
+    if(!state->mem)
+        state->mem = malloc(size);
     if(!state->mem) {
         perror("malloc");
         exit(1);
     }
 
     if(backing_file) {
-        /* FIXME: check file size is same as mem size */
         FILE *fd = fopen(backing_file, "r");
         if(!fd) {
             perror("fopen");
             exit(1);
         }
 
+        if((fstat(fileno(fd), &sb) == 0) && (sb.st_size != size))
+            WARN("%s is %d bytes, for a %d byte region",
+                 backing_file, (int)sb.st_size, size);
+
         fread(state->mem, 1, size, fd);
         fclose(fd);
     }
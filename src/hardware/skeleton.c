@@ -24,7 +24,7 @@
 #include "hardware.h"
 #include "hw-common.h"
 
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks);
+hw_reg_t *HW_MODULE_INIT(skeleton)(hw_config_t *config, hw_callbacks_t *callbacks);
 uint8_t skeleton_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data);
 
 typedef struct skeleton_state_t {
@@ -32,7 +32,7 @@ typedef struct skeleton_state_t {
 
 static hw_callbacks_t *hardware_callbacks;
 
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
+hw_reg_t *HW_MODULE_INIT(skeleton)(hw_config_t *config, hw_callbacks_t *callbacks) {
     hw_reg_t *skeleton_reg;
     uint16_t start;
     uint16_t end;
@@ -46,7 +46,7 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
         exit(1);
     }
 
-    memset(skeleton_reg, 0, sizeof(skeleton_reg));
+    memset(skeleton_reg, 0, sizeof(hw_reg_t));
 
     if(!config_get_uint16(config, "mem_start", &start))
         return NULL;
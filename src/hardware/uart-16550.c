@@ -17,7 +17,6 @@
 
 #include <errno.h>
 #include <fcntl.h>
-#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -30,10 +29,16 @@
 #include "uart-16550.h"
 
 #define UART_MAX_BUFFER 16
+#define UART_READ_CHUNK 64
+#define UART_TX_BUFFER  4096
 
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks);
+#define UART_DEFAULT_XTAL    1843200
+#define UART_NOMINAL_KHZ     1000   /* for pacing an unpaced cpu */
+
+hw_reg_t *HW_MODULE_INIT(uart_16550)(hw_config_t *config, hw_callbacks_t *callbacks);
 static uint8_t uart_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data);
-static void *listener_proc(void *arg);
+static uint8_t uart_peek(hw_reg_t *hw, uint16_t addr);
+static void uart_io(void *arg, int fd, int events);
 
 typedef struct uart_state_t {
     uint8_t RBR; /* register buffer receiver (r/o) */
@@ -48,29 +53,49 @@ typedef struct uart_state_t {
     uint8_t DLL; /* divisor latch (lsb) */
     uint8_t DLM; /* divisor latch (msb) */
 
+    hw_reg_t *hw;
     int pty;
-    int head_buffer_pos;
-    int tail_buffer_pos;
 
-    int buffer[UART_MAX_BUFFER];
-    pthread_t listener_tid;
-    pthread_mutex_t state_lock;
+    /* filled by the i/o thread, emptied by the cpu.  LSR_DR is
+     * the ring not being empty, and the i/o thread flags
+     * overruns in rx_overrun for the next LSR read. */
+    hw_ring_t rx;
+    uint8_t rx_overrun;
+
+    /* filled by the cpu, written to the pty by the i/o thread */
+    hw_tx_t tx;
+    uint8_t thre_acked; /* THRE interrupt seen in IIR since the last THR write */
+
+    /* baud pacing, in cpu cycles: the guest sees THRE and TEMT
+     * as if each character took as long as the divisor says.
+     * Only the cpu thread looks at the cycle count; it keeps
+     * paced_lsr up to date from scheduler events, and that is
+     * all the i/o thread reads. */
+    int paced;
+    uint32_t xtal;
+    uint8_t paced_lsr;  /* LSR_THRE and LSR_TEMT the shift register allows */
+    uint64_t tx_done;   /* cycle the last character finishes */
+    uint64_t char_cycles;
+    int thre_event;
+    int temt_event;
 } uart_state_t;
 
-static void lock_state(uart_state_t *state);
-static void unlock_state(uart_state_t *state);
 static void receive_byte(uart_state_t *state, uint8_t byte);
 static void recalculate_irq(uart_state_t *state);
+static void transmit_byte(uart_state_t *state, uint8_t byte);
+static uint8_t uart_lsr_tx(uart_state_t *state);
 
 static hw_callbacks_t *hardware_callbacks;
 
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
+hw_reg_t *HW_MODULE_INIT(uart_16550)(hw_config_t *config, hw_callbacks_t *callbacks) {
     hw_reg_t *uart_reg;
     uint16_t start;
     uint16_t end;
     uart_state_t *state;
     int ret;
     int raw;
+    int paced;
+    char *xtal;
     struct termios pty_termios;
 
     hardware_callbacks = callbacks;
@@ -81,7 +106,7 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
         exit(1);
     }
 
-    memset(uart_reg, 0, sizeof(uart_reg));
+    memset(uart_reg, 0, sizeof(hw_reg_t));
 
     if(!config_get_uint16(config, "mem_start", &start))
         return NULL;
@@ -89,10 +114,14 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
     if(!config_get_bool(config, "raw", &raw))
         raw = 1;
 
+    if(!config_get_bool(config, "baud_pacing", &paced))
+        paced = 0;
+
     end = start + 8;
 
     uart_reg->hw_family = HW_FAMILY_SERIAL;
     uart_reg->memop = uart_memop;
+    uart_reg->peek = uart_peek;
     uart_reg->remapped_regions = 1;
 
     uart_reg->remap[0].mem_start = start;
@@ -110,8 +139,19 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
 
     /* init the state */
     state->LSR = LSR_TEMT | LSR_THRE;
+    state->IIR = IIR_PENDING;
+    hw_ring_init(&state->rx, UART_MAX_BUFFER);
+
+    state->paced = paced;
+    state->xtal = UART_DEFAULT_XTAL;
+    if((xtal = config_get(config, "xtal")))
+        state->xtal = (uint32_t)strtoul(xtal, NULL, 0);
+    state->paced_lsr = LSR_THRE | LSR_TEMT;
+    state->thre_event = -1;
+    state->temt_event = -1;
 
     uart_reg->state = state;
+    state->hw = uart_reg;
 
     /* set up the pty */
     state->pty = posix_openpt(O_RDWR);
@@ -144,115 +184,261 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
     INFO("Opened pty for 16550 uart at %s", uart_reg->descr);
     NOTIFY("Opened pty for 16550 uart at %s", uart_reg->descr);
 
-    /* now, start up an async listener thread */
-    if(pthread_mutex_init(&state->state_lock, NULL) < 0) {
-        perror("pthread_mutex_init");
+    /* and listen for input on the i/o thread */
+    if(fcntl(state->pty, F_SETFL, fcntl(state->pty, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl");
         return NULL;
     }
 
-    if(pthread_create(&state->listener_tid, NULL, listener_proc, state) < 0) {
-        perror("pthread_create");
+    if(!hardware_callbacks->hw_io_add(state->pty, HW_IO_READ, uart_io, state))
         return NULL;
-    }
+
+    hw_tx_init(&state->tx, hardware_callbacks, state->pty, HW_IO_READ, UART_TX_BUFFER);
 
     return uart_reg;
 }
 
+/*
+ * private
+ *
+ * the interrupt identification: received data, then the
+ * transmit holding register empty, if enabled.  IIR_PENDING is
+ * set when there is nothing pending.  The i/o thread gets here
+ * too, so the registers the cpu writes are loaded atomically.
+ *
+ * @param state uart state
+ */
+static uint8_t uart_iir(uart_state_t *state) {
+    uint8_t ier = __atomic_load_n(&state->IER, __ATOMIC_RELAXED);
+    uint8_t fifos = (__atomic_load_n(&state->FCR, __ATOMIC_RELAXED) & FCR_FIFO_ENABLE) ?
+        (IIR_FIFOS_ENABLED1 | IIR_FIFOS_ENABLED2) : 0;
+
+    if((ier & IER_ERBFI) && hw_ring_ready(&state->rx))
+        return IIR_RDA | fifos;
+
+    if((ier & IER_ETBEI) && !__atomic_load_n(&state->thre_acked, __ATOMIC_RELAXED) &&
+       (uart_lsr_tx(state) & LSR_THRE))
+        return IIR_THRE | fifos;
+
+    return IIR_PENDING | fifos;
+}
+
 /**
- * we aren't honoring irq yet
- * caller must be holding state lock.
+ * work out whether we should be holding irq low, and tell the
+ * bus if that changed.  Called from either thread.
  *
  * @param state uart state
  */
 void recalculate_irq(uart_state_t *state) {
-    /* nothing to see here */
+    int asserted = !(uart_iir(state) & IIR_PENDING);
+
+    if(__atomic_exchange_n(&state->hw->irq_asserted, asserted,
+                           __ATOMIC_RELAXED) != asserted)
+        hardware_callbacks->irq_change();
 }
 
-/**
- * Lock the state blob when producing or consuming.  It either
- * succeeds, or we exit.
+/*
+ * private
  *
- * @param state uart state to be locked
+ * the transmit half of LSR.  Unpaced, THRE is room in the tx
+ * ring and TEMT is everything handed to the pty.  Paced, they
+ * also follow the emulated shift register in paced_lsr: THRE
+ * once only the last character is still going out, TEMT once
+ * that's done too.  Safe from either thread.
+ *
+ * @param state uart state
  */
-void lock_state(uart_state_t *state) {
-    int res;
+static uint8_t uart_lsr_tx(uart_state_t *state) {
+    uint8_t lsr = 0;
 
-    if((res = pthread_mutex_lock(&state->state_lock))) {
-        perror("pthread_mutex_lock");
-        exit(EXIT_FAILURE);
-    }
+    if(hw_tx_ready(&state->tx))
+        lsr |= LSR_THRE;
+    if(!hw_tx_pending(&state->tx))
+        lsr |= LSR_TEMT;
+
+    if(state->paced)
+        lsr &= __atomic_load_n(&state->paced_lsr, __ATOMIC_RELAXED);
+
+    return lsr;
+}
+
+/*
+ * private
+ *
+ * LSR as a read would see it, without clearing anything
+ *
+ * @param state uart state
+ */
+static uint8_t uart_lsr(uart_state_t *state) {
+    uint8_t lsr = (state->LSR & ~(LSR_THRE | LSR_TEMT)) | uart_lsr_tx(state);
+
+    if(hw_ring_ready(&state->rx))
+        lsr |= LSR_DR;
+    if(__atomic_load_n(&state->rx_overrun, __ATOMIC_RELAXED))
+        lsr |= LSR_OE;
+
+    return lsr;
+}
+
+/*
+ * private
+ *
+ * cpu cycles to send a character at the programmed divisor and
+ * line settings: a start bit, the data bits, parity and stops.
+ * Cycles are at the clock the cpu is paced at, or 1MHz if it
+ * isn't.
+ */
+static uint64_t uart_char_cycles(uart_state_t *state) {
+    uint32_t divisor = (state->DLM << 8) | state->DLL;
+    uint32_t khz = hardware_callbacks->hw_clock_khz();
+    int bits = 1 + 5 + (state->LCR & (LCR_WLS0 | LCR_WLS1));
+
+    if(state->LCR & LCR_PEN)
+        bits++;
+    bits += (state->LCR & LCR_STB) ? 2 : 1;
+
+    if(!divisor)
+        divisor = 1;
+    if(!khz)
+        khz = UART_NOMINAL_KHZ;
+
+    return ((uint64_t)khz * 1000 * bits * 16 * divisor) / state->xtal;
+}
+
+/*
+ * private
+ *
+ * scheduler event: a paced transmit has got down to its last
+ * character, so THRE is set now
+ */
+static void uart_thre_event(void *arg, uint64_t cycle) {
+    uart_state_t *state = (uart_state_t*)arg;
+
+    state->thre_event = -1;
+    __atomic_or_fetch(&state->paced_lsr, LSR_THRE, __ATOMIC_RELAXED);
+    recalculate_irq(state);
+}
+
+/*
+ * private
+ *
+ * scheduler event: the last paced character is out of the
+ * shift register, so TEMT is set now too
+ */
+static void uart_temt_event(void *arg, uint64_t cycle) {
+    uart_state_t *state = (uart_state_t*)arg;
+
+    state->temt_event = -1;
+    __atomic_store_n(&state->paced_lsr, LSR_THRE | LSR_TEMT, __ATOMIC_RELAXED);
+    recalculate_irq(state);
 }
 
 /**
- * and conversely, unlock the state blob.  Again, if this does
- * not succeed, bad things are afoot and we crash.
+ * send a byte written to THR, through the tx ring.  Runs on
+ * the cpu thread, as the tx ring's only producer.
  *
- * @param state uart state to be unlocked
+ * @param state uart state
+ * @param byte data byte to send
  */
+void transmit_byte(uart_state_t *state, uint8_t byte) {
+    uint64_t now;
 
-void unlock_state(uart_state_t *state) {
-    int res;
+    if(!hw_tx_put(&state->tx, byte)) {
+        WARN("tx overrun, dropped byte");
+        return;
+    }
 
-    if((res = pthread_mutex_unlock(&state->state_lock))) {
-        perror("pthread_mutex_unlock");
-        exit(EXIT_FAILURE);
+    state->hw->stats.tx_bytes++;
+    __atomic_store_n(&state->thre_acked, 0, __ATOMIC_RELAXED);
+
+    if(state->paced) {
+        now = hardware_callbacks->hw_cycles();
+        state->char_cycles = uart_char_cycles(state);
+        if(state->tx_done < now)
+            state->tx_done = now;
+        state->tx_done += state->char_cycles;
+
+        /* THRE holds while more than one character is queued */
+        hardware_callbacks->hw_unschedule(state->thre_event);
+        hardware_callbacks->hw_unschedule(state->temt_event);
+        state->thre_event = -1;
+
+        if(now + state->char_cycles < state->tx_done) {
+            __atomic_store_n(&state->paced_lsr, 0, __ATOMIC_RELAXED);
+            state->thre_event = hardware_callbacks->hw_schedule(
+                state->tx_done - state->char_cycles, uart_thre_event, state);
+        } else {
+            __atomic_store_n(&state->paced_lsr, LSR_THRE, __ATOMIC_RELAXED);
+        }
+
+        state->temt_event = hardware_callbacks->hw_schedule(
+            state->tx_done, uart_temt_event, state);
     }
+
+    recalculate_irq(state);
 }
 
 /**
  * do the needful when we receive a new async byte.  This
  * should update the fifo, recalculate whether or not we
- * should be holding irq low, etc.
+ * should be holding irq low, etc.  Runs on the i/o thread,
+ * as the rx ring's only producer.
  *
- * @param state uart state (unlocked)
+ * @param state uart state
  * @param byte data byte received
  */
 void receive_byte(uart_state_t *state, uint8_t byte) {
-    lock_state(state);
-
-    if(((state->head_buffer_pos + 1) % UART_MAX_BUFFER) == state->tail_buffer_pos) {
+    if(!hw_ring_put(&state->rx, byte)) {
         /* we just dropped a char */
-        state->LSR = state->LSR | LSR_OE;
+        __atomic_store_n(&state->rx_overrun, 1, __ATOMIC_RELAXED);
         WARN("just dropped byte");
     } else {
-        state->buffer[state->head_buffer_pos] = byte;
-        state->head_buffer_pos = (state->head_buffer_pos + 1) % UART_MAX_BUFFER;
-        /* mark rx available */
-        state->LSR = state->LSR | LSR_DR;
+        state->hw->stats.rx_bytes++;
     }
 
     recalculate_irq(state);
-
-    unlock_state(state);
 }
 
 
 /**
- * Async listener for pty.  This listens on the pty and
- * any received bytes get passed to the receive_byte function.
+ * the pty is ready, on the i/o thread.  Pending output is
+ * written, and whatever has arrived gets passed to the
+ * receive_byte function.
  *
  * @param arg a void* cast state blob
+ * @param fd the pty
+ * @param events HW_IO_* events that are ready
  */
-void *listener_proc(void *arg) {
+static void uart_io(void *arg, int fd, int events) {
     uart_state_t *state = (uart_state_t*)arg;
-    int res;
-    uint8_t byte;
-
-    while(1) {
-        res = read(state->pty, &byte, sizeof(byte));
-        if(res < 0) {
-            perror("read");
-            exit(EXIT_FAILURE);
-        }
+    uint8_t buffer[UART_READ_CHUNK];
+    ssize_t res;
 
-        if(res == 0) {
-            /* file closed out from end of us */
-            WARN("EOF on pty");
-            exit(EXIT_FAILURE);
-        }
+    if(events & HW_IO_WRITE) {
+        hw_tx_drain(&state->tx);
+        recalculate_irq(state);
+    }
+
+    if(!(events & (HW_IO_READ | HW_IO_HUP)))
+        return;
 
-        receive_byte(state, byte);
-        DEBUG("got byte $%02x", byte);
+    res = read(fd, buffer, sizeof(buffer));
+    if(res < 0) {
+        if((errno == EAGAIN) || (errno == EINTR))
+            return;
+        perror("read");
+        exit(EXIT_FAILURE);
+    }
+
+    if(res == 0) {
+        /* file closed out from end of us */
+        WARN("EOF on pty");
+        exit(EXIT_FAILURE);
+    }
+
+    for(int x = 0; x < res; x++) {
+        receive_byte(state, buffer[x]);
+        DEBUG("got byte $%02x", buffer[x]);
     }
 }
 
@@ -281,29 +467,22 @@ uint8_t uart_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data) {
         } else {
             if(read) {
                 /* pull something out of the receive buffer */
-                lock_state(state);
-                if(state->head_buffer_pos == state->tail_buffer_pos) {
+                if(!hw_ring_get(&state->rx, &retval)) {
                     /* nothing in the buffer */
                     retval = 0;
                     DEBUG("read on empty fifo");
-                } else {
-                    retval = state->buffer[state->tail_buffer_pos];
-                    state->tail_buffer_pos = (state->tail_buffer_pos + 1) % UART_MAX_BUFFER;
-                    if(state->tail_buffer_pos == state->head_buffer_pos) {
-                        /* fifo is empty */
-                        state->LSR &= ~LSR_DR;
-                        recalculate_irq(state);
-                    }
+                } else if(!hw_ring_ready(&state->rx)) {
+                    /* fifo is empty */
+                    recalculate_irq(state);
                 }
 
-                unlock_state(state);
                 return retval;
             }
 
-            /* write to THR -- drop the byte out the pts */
+            /* write to THR -- queue the byte for the pts */
             DEBUG("Writing byte %02X to pty", data);
 
-            write(state->pty, &data, 1);
+            transmit_byte(state, data);
         }
         break;
 
@@ -315,14 +494,22 @@ uint8_t uart_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data) {
         } else {
             if(read)
                 return state->IER;
-            state->IER = data;
+            __atomic_store_n(&state->IER, data, __ATOMIC_RELAXED);
+            recalculate_irq(state);
         }
         break;
 
     case REG_IIR: /* IIR, FCR */
-        if(read)
+        if(read) {
+            /* reading a THRE interrupt here acknowledges it */
+            state->IIR = uart_iir(state);
+            if((state->IIR & IIR_INTERRUPT_MASK) == IIR_THRE) {
+                __atomic_store_n(&state->thre_acked, 1, __ATOMIC_RELAXED);
+                recalculate_irq(state);
+            }
             return state->IIR;
-        state->FCR = data;
+        }
+        __atomic_store_n(&state->FCR, data, __ATOMIC_RELAXED);
         break;
 
     case REG_LCR:
@@ -340,10 +527,11 @@ uint8_t uart_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data) {
     case REG_LSR:
         if(read) {
             /* error flags reset on read */
-            lock_state(state);
-            retval = state->LSR;
+            retval = uart_lsr(state) & ~LSR_OE;
+            if(__atomic_load_n(&state->rx_overrun, __ATOMIC_RELAXED) &&
+               __atomic_exchange_n(&state->rx_overrun, 0, __ATOMIC_RELAXED))
+                retval |= LSR_OE;
             state->LSR &= ~(LSR_OE | LSR_PE | LSR_FE | LSR_BI | LSR_ERF);
-            unlock_state(state);
             return retval;
         }
         /* can't write LSR */
@@ -351,11 +539,9 @@ uint8_t uart_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data) {
 
     case 6:
         if(read) {
-            lock_state(state);
             retval = state->MSR;
             /* we clear the delta states on msr read */
             state->MSR &= ~(MSR_DCTS | MSR_DDSR | MSR_DDCD | MSR_TERI);
-            unlock_state(state);
             return retval;
 
         }
@@ -381,3 +567,35 @@ uint8_t uart_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data) {
 
     return 0;
 }
+
+/**
+ * read a register for the debugger, as uart_memop would but
+ * without taking a received byte, acknowledging a THRE
+ * interrupt or clearing status bits
+ *
+ * @param addr address to read
+ * @return what a read would return
+ */
+uint8_t uart_peek(hw_reg_t *hw, uint16_t addr) {
+    uart_state_t *state = (uart_state_t*)(hw->state);
+    uint8_t retval = 0;
+
+    switch(addr - hw->remap[0].mem_start) {
+    case 0: /* RBR, DLL */
+        if(state->LCR & LCR_DLAB)
+            return state->DLL;
+        hw_ring_first(&state->rx, &retval);
+        return retval;
+
+    case REG_IIR:
+        return uart_iir(state);
+
+    case REG_LSR:
+        return uart_lsr(state);
+
+    case 6:
+        return state->MSR;
+    }
+
+    return uart_memop(hw, addr, MEMOP_READ, 0);
+}
@@ -25,6 +25,8 @@
 
 #define IIR_PENDING        0x01
 #define IIR_INTERRUPT_MASK 0x0E
+#define IIR_THRE           0x02 /* transmit holding reg empty */
+#define IIR_RDA            0x04 /* received data available */
 #define IIR_FIFOS_ENABLED1 0x40
 #define IIR_FIFOS_ENABLED2 0x80
 
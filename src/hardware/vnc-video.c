@@ -38,7 +38,7 @@
  * generic video driver, except using vnc as an
  * output mechanism rather than sdl
  */
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks);
+hw_reg_t *HW_MODULE_INIT(vnc_video)(hw_config_t *config, hw_callbacks_t *callbacks);
 uint8_t vnc_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data);
 
 typedef struct color_t {
@@ -67,6 +67,7 @@ static color_t video_colors[] = {
 };
 
 typedef struct vnc_state_t {
+    hw_reg_t *hw;
     uint8_t mode_register;  /* 4095 */
     uint8_t color_register; /* 4094 */
 
@@ -92,8 +93,9 @@ static void vnc_info_log(const char *format, ...);
 static void set_value_at_position(vnc_state_t *state,
                                   int x, int y, uint8_t value);
 static void update_screen(vnc_state_t *state);
+static int vnc_setup(hw_reg_t *hw);
 
-hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
+hw_reg_t *HW_MODULE_INIT(vnc_video)(hw_config_t *config, hw_callbacks_t *callbacks) {
     hw_reg_t *vnc_reg;
     uint16_t start;
     uint16_t end;
@@ -108,7 +110,7 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
         exit(1);
     }
 
-    memset(vnc_reg, 0, sizeof(vnc_reg));
+    memset(vnc_reg, 0, sizeof(hw_reg_t));
 
     if(!config_get_uint16(config, "mem_start", &start))
         return NULL;
@@ -121,6 +123,8 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
 
     vnc_reg->hw_family = HW_FAMILY_VIDEO;
     vnc_reg->memop = vnc_memop;
+    vnc_reg->setup = vnc_setup;
+    vnc_reg->setup_mode = HW_SETUP_THREAD;
     vnc_reg->remapped_regions = 1;
 
     vnc_reg->remap[0].mem_start = start;
@@ -166,10 +170,25 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
         return NULL;
     }
 
+    state->hw = vnc_reg;
     state->mode_register = 0;
     state->color_register = 0x0F;  /* gray on black */
     state->dirty = 0;
 
+    vnc_reg->state = state;
+    return vnc_reg;
+}
+
+/**
+ * start the vnc server, on a worker thread while the cpu gets
+ * going.  The port is announced once it's known.
+ *
+ * @param hw the video device
+ * @return 1 on success
+ */
+static int vnc_setup(hw_reg_t *hw) {
+    vnc_state_t *state = (vnc_state_t*)(hw->state);
+
     /* init the fb */
     rfbLog = (rfbLogProc)vnc_info_log;
     rfbErr = (rfbLogProc)vnc_error_log;
@@ -187,19 +206,18 @@ hw_reg_t *init(hw_config_t *config, hw_callbacks_t *callbacks) {
     state->screen->autoPort = TRUE;
     rfbInitServer(state->screen);
 
-    asprintf(&vnc_reg->descr, "port %d", state->screen->port);
+    asprintf(&hw->descr, "port %d", state->screen->port);
 
-    NOTIFY("Starting vnc server on %s", vnc_reg->descr);
-    INFO("Starting vnc server on %s", vnc_reg->descr);
+    NOTIFY("Starting vnc server on %s", hw->descr);
+    INFO("Starting vnc server on %s", hw->descr);
 
     /* and we'll kick off the event loop */
     if(pthread_create(&state->event_tid, NULL, rfb_proc, state) < 0) {
         perror("pthread_create");
-        return NULL;
+        return 0;
     }
 
-    vnc_reg->state = state;
-    return vnc_reg;
+    return 1;
 }
 
 /**
@@ -218,6 +236,7 @@ static void update_screen(vnc_state_t *state) {
     }
 
     rfbMarkRectAsModified(state->screen, 0, 0, 640, 480);
+    state->hw->stats.refreshes++;
 }
 
 
@@ -364,6 +383,7 @@ uint8_t vnc_memop(hw_reg_t *hw, uint16_t addr, uint8_t memop, uint8_t data) {
                                       y * CHARMAP_HEIGHT * 2,
                                       (x + 1) * CHARMAP_WIDTH,
                                       (y + 1) * CHARMAP_HEIGHT * 2);
+                state->hw->stats.refreshes++;
 
             }
             if(offset == 4095) {
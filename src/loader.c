@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <ctype.h>
+#include <glob.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#define DBG_MODULE DBG_MOD_BUS
+#include "debug.h"
+#include "memory.h"
+#include "loader.h"
+
+#define LOADER_HEX_LINE 600
+
+/*
+ * private
+ *
+ * the load address in a split binary name (name.XXXX.bin)
+ *
+ * @returns 1 if path is a split binary, 0 otherwise
+ */
+static int loader_split_addr(const char *path, uint16_t *addr) {
+    size_t len = strlen(path);
+    char digits[5];
+    char *end;
+
+    if((len < 9) || (strcmp(path + len - 4, ".bin") != 0) ||
+       (path[len - 9] != '.'))
+        return 0;
+
+    memcpy(digits, path + len - 8, 4);
+    digits[4] = '\0';
+
+    *addr = (uint16_t)strtoul(digits, &end, 16);
+    return (*end == '\0');
+}
+
+/*
+ * private
+ *
+ * load a raw binary at addr
+ */
+static int loader_load_bin(const char *path, uint16_t addr,
+                           loader_result_t *result) {
+    FILE *fh;
+    struct stat sb;
+    uint8_t *data;
+
+    if(!(fh = fopen(path, "rb")))
+        return LOADER_E_OPEN;
+
+    if((fstat(fileno(fh), &sb) == -1) || (sb.st_size > 0x10000 - addr)) {
+        fclose(fh);
+        return LOADER_E_RANGE;
+    }
+
+    data = (uint8_t*)malloc(sb.st_size ? sb.st_size : 1);
+    if(!data) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if(fread(data, 1, sb.st_size, fh) != (size_t)sb.st_size) {
+        free(data);
+        fclose(fh);
+        return LOADER_E_OPEN;
+    }
+    fclose(fh);
+
+    DEBUG("Loading %ld bytes from %s at $%04x", (long)sb.st_size, path, addr);
+    memory_poke_block(addr, data, sb.st_size, 1);
+    free(data);
+
+    if(!result->bytes)
+        result->entry = addr;
+    result->bytes += sb.st_size;
+    return LOADER_OK;
+}
+
+/*
+ * private
+ *
+ * parse hex digit pairs from an intel hex line
+ *
+ * @returns number of bytes, or -1 on a bad digit
+ */
+static int loader_hex_bytes(const char *line, uint8_t *bytes, int max) {
+    unsigned int byte;
+    int count = 0;
+
+    while(isxdigit((unsigned char)line[0]) && isxdigit((unsigned char)line[1])) {
+        if(count == max)
+            return -1;
+        sscanf(line, "%2x", &byte);
+        bytes[count++] = byte;
+        line += 2;
+    }
+
+    if(*line && (*line != '\r') && (*line != '\n'))
+        return -1;
+
+    return count;
+}
+
+/*
+ * private
+ *
+ * load an intel hex file.  Only 16 bit addresses make sense, so
+ * extended address records must be zero.
+ */
+static int loader_load_hex(const char *path, loader_result_t *result) {
+    FILE *fh;
+    char line[LOADER_HEX_LINE];
+    uint8_t bytes[LOADER_HEX_LINE / 2];
+    uint8_t checksum;
+    uint16_t addr;
+    int count;
+    int index;
+    int have_entry = 0;
+    int retval = LOADER_OK;
+
+    if(!(fh = fopen(path, "r")))
+        return LOADER_E_OPEN;
+
+    while(fgets(line, sizeof(line), fh)) {
+        if((line[0] == '\r') || (line[0] == '\n') || !line[0])
+            continue;
+
+        count = (line[0] == ':') ? loader_hex_bytes(line + 1, bytes, sizeof(bytes)) : -1;
+        if((count < 5) || (count != bytes[0] + 5)) {
+            retval = LOADER_E_FORMAT;
+            break;
+        }
+
+        for(checksum = 0, index = 0; index < count; index++)
+            checksum += bytes[index];
+        if(checksum) {
+            ERROR("Bad checksum in %s", path);
+            retval = LOADER_E_FORMAT;
+            break;
+        }
+
+        addr = (bytes[1] << 8) | bytes[2];
+
+        switch(bytes[3]) {
+        case 0x00: /* data */
+            if(addr + bytes[0] > 0x10000) {
+                retval = LOADER_E_RANGE;
+                break;
+            }
+
+            memory_poke_block(addr, &bytes[4], bytes[0], 1);
+            if(!result->bytes && !have_entry)
+                result->entry = addr;
+            result->bytes += bytes[0];
+            break;
+
+        case 0x01: /* end of file */
+            fclose(fh);
+            return LOADER_OK;
+
+        case 0x02: /* extended segment address */
+        case 0x04: /* extended linear address */
+            if((bytes[0] != 2) || bytes[4] || bytes[5])
+                retval = LOADER_E_RANGE;
+            break;
+
+        case 0x03: /* start segment address, cs:ip */
+        case 0x05: /* start linear address */
+            if(bytes[0] != 4) {
+                retval = LOADER_E_FORMAT;
+                break;
+            }
+
+            result->entry = (bytes[6] << 8) | bytes[7];
+            have_entry = 1;
+            break;
+
+        default:
+            retval = LOADER_E_FORMAT;
+            break;
+        }
+
+        if(retval != LOADER_OK)
+            break;
+    }
+
+    fclose(fh);
+    return retval;
+}
+
+/**
+ * load a program into memory.  Storage is written directly
+ * where it can be, so roms can be loaded too.
+ *
+ * @param path file to load (see loader.h)
+ * @param addr where to load a raw binary
+ * @param result filled with the bytes loaded and the entry point
+ * @returns LOADER_OK, or a LOADER_E_* error
+ */
+int loader_load(const char *path, uint16_t addr, loader_result_t *result) {
+    struct stat sb;
+    glob_t matches;
+    char *pattern;
+    size_t len = strlen(path);
+    int retval;
+
+    memset(result, 0, sizeof(loader_result_t));
+
+    if(stat(path, &sb) == -1) {
+        /* maybe the base name of a split build */
+        if(asprintf(&pattern, "%s.[0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f].bin",
+                    path) == -1) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        retval = glob(pattern, 0, NULL, &matches);
+        free(pattern);
+        if(retval)
+            return LOADER_E_OPEN;
+
+        /* glob sorts, so the lowest address goes first */
+        retval = LOADER_OK;
+        for(size_t index = 0; (index < matches.gl_pathc) && (retval == LOADER_OK); index++) {
+            loader_split_addr(matches.gl_pathv[index], &addr);
+            retval = loader_load_bin(matches.gl_pathv[index], addr, result);
+        }
+
+        globfree(&matches);
+        return retval;
+    }
+
+    if((len > 4) && (strcasecmp(path + len - 4, ".hex") == 0))
+        return loader_load_hex(path, result);
+
+    loader_split_addr(path, &addr);
+    return loader_load_bin(path, addr, result);
+}
+
+/**
+ * describe a loader error
+ *
+ * @param error LOADER_E_* error
+ * @returns static string
+ */
+const char *loader_error(int error) {
+    switch(error) {
+    case LOADER_OK:
+        return "Success";
+    case LOADER_E_OPEN:
+        return "Cannot open file";
+    case LOADER_E_FORMAT:
+        return "Bad file format";
+    case LOADER_E_RANGE:
+        return "File does not fit in memory";
+    }
+
+    return "Unknown error";
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _LOADER_H_
+#define _LOADER_H_
+
+#include <stdint.h>
+
+/* program loading, for CMD_LOAD and the preload config section.
+ * A path can name a raw binary, one of the split binaries rp65asm
+ * writes (name.XXXX.bin, loaded at $XXXX), an intel hex file
+ * (name.hex), or the base name of a set of split binaries.
+ */
+#define LOADER_OK       0
+#define LOADER_E_OPEN   1
+#define LOADER_E_FORMAT 2
+#define LOADER_E_RANGE  3
+
+typedef struct loader_result_t {
+    uint32_t bytes;
+    uint16_t entry;   /* hex start address, else first address loaded */
+} loader_result_t;
+
+extern int loader_load(const char *path, uint16_t addr, loader_result_t *result);
+extern const char *loader_error(int error);
+
+#endif /* _LOADER_H_ */
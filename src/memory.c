@@ -22,14 +22,28 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
+#define DBG_MODULE DBG_MOD_BUS
 #include "debug.h"
+#include "builtin.h"
 #include "emulator.h"
 #include "memory.h"
+#include "reactor.h"
+#include "scheduler.h"
+#include "shmview.h"
+#include "throttle.h"
 #include "stepwise.h" // what if we aren't running stepwise? - notifications
 
+/* where a device is with its setup */
+#define SETUP_DONE     0
+#define SETUP_WAITING  1  /* lazy, and not touched yet */
+#define SETUP_QUEUED   2  /* for the main thread */
+#define SETUP_RUNNING  3
+
 typedef struct memory_list_t {
     hw_reg_t *hw_reg;
+    int setup_state;
     struct memory_list_t *pnext;
 } memory_list_t;
 
@@ -45,11 +59,119 @@ typedef struct module_list_t {
 
 module_list_t memory_modules;
 
+/* watchpoints: one bit per address per type, and a count of
+ * watched addresses per page, so only accesses to watched
+ * pages ever look at the bitmaps.
+ */
+#define WATCH_MAP_READ   0
+#define WATCH_MAP_WRITE  1
+#define WATCH_MAP_CHANGE 2
+
+#define WATCH_ISSET(map, addr) (watch_map[map][(addr) >> 3] & (1 << ((addr) & 7)))
+#define WATCH_SET(map, addr) watch_map[map][(addr) >> 3] |= (1 << ((addr) & 7))
+#define WATCH_CLR(map, addr) watch_map[map][(addr) >> 3] &= ~(1 << ((addr) & 7))
+#define WATCH_ANY(addr) (WATCH_ISSET(WATCH_MAP_READ, addr) || \
+                         WATCH_ISSET(WATCH_MAP_WRITE, addr) || \
+                         WATCH_ISSET(WATCH_MAP_CHANGE, addr))
+
+static uint8_t watch_map[3][65536 / 8];
+static uint16_t watch_pages[256];
+static uint8_t watch_shadow[65536];
+static mem_watch_t watch_last;
+int memory_watch_pending = 0;
+
+/* a device access.  With the modules built in, plain memory's
+ * memop is called directly, so the compiler can inline it. */
+#ifdef HW_BUILTIN
+#define MEMOP(hw, addr, op, value) (((hw)->memop == mem_memop) ?    \
+        mem_memop(hw, addr, op, value) : (hw)->memop(hw, addr, op, value))
+#else
+#define MEMOP(hw, addr, op, value) (hw)->memop(hw, addr, op, value)
+#endif
+
+/* the device that has all of a page, for reads [0] and
+ * writes [1], or NULL if it is split or unmapped */
+static hw_reg_t *page_owner[2][256];
+
+/* dirty page tracking.  Writes only set memory_dirty; when a
+ * client asks what changed, dirty pages are stamped with a new
+ * generation, so each client can track its own "since". */
+static uint8_t memory_dirty[256];
+static uint32_t memory_page_gen[256];
+static uint32_t memory_generation = 0;
+static pthread_mutex_t memory_gen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* storage handed to devices through hw_alloc_ram, or that they
+ * mapped themselves and registered, by page, and the device that
+ * got it.  Pages a device owns outright with storage
+ * of its own can be loaded with a memcpy. */
+static uint8_t *page_storage[256];
+static hw_reg_t *page_storage_owner[256];
+static uint8_t page_storage_pending[256];
+
+/* likewise the device whose storage for a page is in the shared
+ * view's image.  Pages banked under a rom keep theirs, so the
+ * view can flag them live again when the rom goes away. */
+static hw_reg_t *page_shared_owner[256];
+static uint8_t page_shared_pending[256];
+
+/* the shared view's page flags are brought up to date when the
+ * cpu state is published, rather than on every change */
+static int memory_shared_stale = 1;
+
+/* bank controllers.  A bank is the set of switched devices mapped
+ * in while it is selected.  Each bank's page table entries, for the
+ * pages its controller's devices cover, are worked out ahead of
+ * time, so selecting one is a copy.  memory_map_gen is bumped
+ * before and after anything else rebuilds the page table (odd
+ * while that's going on); a select that sees it move rebuilds the
+ * banks' entries under memory_setup_lock instead. */
+#define MEMORY_BANK_DEVICES 16
+#define MEMORY_MAX_BANKS    256
+
+typedef struct memory_bank_t {
+    uint32_t map;               /* switched devices mapped in */
+    hw_reg_t *owner[2][256];
+} memory_bank_t;
+
+typedef struct memory_banks_t {
+    hw_reg_t *controller;
+    int devices;
+    hw_reg_t *device[MEMORY_BANK_DEVICES];
+    mem_remap_t *remap[MEMORY_BANK_DEVICES];  /* as the device set them up */
+    int first;                  /* pages the devices cover */
+    int last;
+    int banks;
+    memory_bank_t *bank[MEMORY_MAX_BANKS];
+    int built;
+    uint32_t gen;               /* memory_map_gen the entries are for */
+    struct memory_banks_t *pnext;
+} memory_banks_t;
+
+static memory_banks_t *memory_banks = NULL;
+static uint32_t memory_map_gen = 0;
+
+/* device setup state, and the page table, are changed under
+ * memory_setup_lock.  Devices that aren't set up own no pages, so
+ * accesses to them take the slow path, and wait there. */
+static pthread_mutex_t memory_setup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t memory_setup_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t memory_main_thread;
+static int memory_setup_queued = 0;
+static int memory_wake = 0;
+
 /*
  * forwards
  */
 void memory_irq_change(void);
 void memory_nmi_change(void);
+static uint8_t *memory_alloc_ram(uint16_t start, uint16_t end);
+static void memory_register_ram(uint16_t start, uint16_t end, uint8_t *mem);
+static void memory_remap(hw_reg_t *hw, int region, int readable, int writable);
+static int memory_bank_add(hw_reg_t *controller, hw_reg_t **devices, int count);
+static void memory_bank_select(hw_reg_t *controller, int bank);
+static hw_reg_t *memory_find_device(const char *name);
+static void memory_setup_wait(memory_list_t *entry);
 
 module_list_t *get_load_module(const char *module) {
     module_list_t *pentry = memory_modules.pnext;
@@ -70,15 +192,25 @@ module_list_t *get_load_module(const char *module) {
         }
 
         pentry->module_name = strdup(module);
-        pentry->handle = dlopen(module, RTLD_LAZY | RTLD_LOCAL);
-        if(!pentry->handle) {
-            perror(module);
-            exit(1);
-        }
+        pentry->handle = NULL;
 
-        pentry->init = dlsym(pentry->handle, "init");
-        if(!pentry->init) {
-            exit(1);
+        if(strncmp(module, BUILTIN_PREFIX, strlen(BUILTIN_PREFIX)) == 0) {
+            pentry->init = builtin_find(module + strlen(BUILTIN_PREFIX));
+            if(!pentry->init) {
+                FATAL("Module %s is not built in", module);
+                exit(1);
+            }
+        } else {
+            pentry->handle = dlopen(module, RTLD_LAZY | RTLD_LOCAL);
+            if(!pentry->handle) {
+                perror(module);
+                exit(1);
+            }
+
+            pentry->init = dlsym(pentry->handle, "init");
+            if(!pentry->init) {
+                exit(1);
+            }
         }
 
         pentry->pnext = memory_modules.pnext;
@@ -94,9 +226,27 @@ int memory_init(void) {
     memory_modules.pnext = NULL;
 
     callbacks.hw_logger = debug_printf;
+    callbacks.hw_log_level = &debug_levels[DBG_MOD_HW];
     callbacks.hw_notify = stepwise_notification;
     callbacks.irq_change = memory_irq_change;
     callbacks.nmi_change = memory_nmi_change;
+    callbacks.hw_alloc_ram = memory_alloc_ram;
+    callbacks.hw_register_ram = memory_register_ram;
+    callbacks.hw_remap = memory_remap;
+    callbacks.hw_bank_add = memory_bank_add;
+    callbacks.hw_bank_select = memory_bank_select;
+    callbacks.hw_find_device = memory_find_device;
+    callbacks.hw_cycles = sched_cycles;
+    callbacks.hw_schedule = sched_add;
+    callbacks.hw_unschedule = sched_cancel;
+    callbacks.hw_clock_khz = throttle_clock_khz;
+    callbacks.hw_io_add = reactor_add;
+    callbacks.hw_io_modify = reactor_modify;
+    callbacks.hw_io_remove = reactor_remove;
+
+    reactor_init();
+
+    memory_main_thread = pthread_self();
 
     /* now we are free to load any memory modules from disk */
     return E_MEM_SUCCESS;
@@ -111,50 +261,882 @@ void memory_deinit(void) {
     }
 }
 
-uint8_t memory_read(uint16_t addr) {
+/*
+ * private
+ *
+ * find the device mapped at an address by walking the device list
+ *
+ * @param addr address to look up
+ * @param write look for a writable mapping rather than readable
+ * @returns hw_reg of the device, or NULL
+ */
+static hw_reg_t *memory_find_slow(uint16_t addr, int write) {
     memory_list_t *current = memory_list.pnext;
+    mem_remap_t *remap;
 
     while(current) {
         /* find the module associated with
            this memory range */
         for(int x=0; x < current->hw_reg->remapped_regions; x++) {
-            if((current->hw_reg->remap[x].mem_start <= addr) &&
-               (current->hw_reg->remap[x].mem_end >= addr) &&
-               (current->hw_reg->remap[x].readable == 1)) {
-                return current->hw_reg->memop(current->hw_reg, addr,
-                                              MEMOP_READ, 0);
+            remap = &current->hw_reg->remap[x];
+            if((remap->mem_start <= addr) &&
+               (remap->mem_end >= addr) &&
+               ((write ? remap->writable : remap->readable) == 1)) {
+                if(__atomic_load_n(&current->setup_state, __ATOMIC_ACQUIRE) != SETUP_DONE)
+                    memory_setup_wait(current);
+                return current->hw_reg;
             }
         }
 
         current = current->pnext;
     }
 
-    ERROR("No readable memory at addr %x", addr);
-    return 0;
+    return NULL;
 }
 
-void memory_write(uint16_t addr, uint8_t value) {
+/*
+ * private
+ *
+ * whether a device region is mapped for reads or writes.  With
+ * banks, a device they switch is taken as in the bank map says,
+ * rather than as it is now.
+ */
+static int memory_region_mapped(hw_reg_t *hw, int region, int write,
+                                memory_banks_t *banks, uint32_t map) {
+    mem_remap_t *remap = &hw->remap[region];
+
+    for(int index = 0; banks && (index < banks->devices); index++) {
+        if(banks->device[index] != hw)
+            continue;
+        if(!(map & (1 << index)))
+            return 0;
+        remap = &banks->remap[index][region];
+        break;
+    }
+
+    return (write ? remap->writable : remap->readable) == 1;
+}
+
+/*
+ * private
+ *
+ * the device that has all of a page, or NULL.  Lookups find the
+ * first device mapping an address, so the first device mapping
+ * any of the page has to map all of it, and be set up.  banks and
+ * map are as for memory_region_mapped.
+ */
+static hw_reg_t *memory_page_owner(int page, int write,
+                                   memory_banks_t *banks, uint32_t map) {
     memory_list_t *current = memory_list.pnext;
+    mem_remap_t *remap;
+    uint16_t first = page << 8;
+    uint16_t last = first | 0xff;
 
     while(current) {
-        /* find the module associated with
-           this memory range */
         for(int x=0; x < current->hw_reg->remapped_regions; x++) {
-            if((current->hw_reg->remap[x].mem_start <= addr) &&
-               (current->hw_reg->remap[x].mem_end >= addr) &&
-               (current->hw_reg->remap[x].writable == 1)) {
-                current->hw_reg->memop(current->hw_reg, addr,
-                                       MEMOP_WRITE, value);
-                return;
+            remap = &current->hw_reg->remap[x];
+            if(!memory_region_mapped(current->hw_reg, x, write, banks, map) ||
+               (remap->mem_end < first) || (remap->mem_start > last))
+                continue;
+
+            if((remap->mem_start <= first) && (remap->mem_end >= last) &&
+               (current->setup_state == SETUP_DONE))
+                return current->hw_reg;
+            return NULL;
+        }
+
+        current = current->pnext;
+    }
+
+    return NULL;
+}
+
+/*
+ * private
+ *
+ * rebuild the page owner cache for some pages after the memory
+ * map changes.  A page only gets an owner if one device has all
+ * of it.  The shared view's live pages follow the owners, the
+ * next time it's published.  Banks' entries are stale after this.
+ *
+ * @param first first page to rebuild
+ * @param last last page to rebuild
+ */
+static void memory_build_pages(int first, int last) {
+    pthread_mutex_lock(&memory_setup_lock);
+    __atomic_add_fetch(&memory_map_gen, 1, __ATOMIC_SEQ_CST);
+    for(int page = first; page <= last; page++) {
+        page_owner[0][page] = memory_page_owner(page, 0, NULL, 0);
+        page_owner[1][page] = memory_page_owner(page, 1, NULL, 0);
+    }
+    __atomic_add_fetch(&memory_map_gen, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&memory_shared_stale, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&memory_setup_lock);
+}
+
+/*
+ * private
+ *
+ * hw_remap for devices: switch a region in or out, and fix up
+ * just the pages it covers
+ */
+static void memory_remap(hw_reg_t *hw, int region, int readable, int writable) {
+    mem_remap_t *remap;
+
+    if((region < 0) || (region >= hw->remapped_regions))
+        return;
+
+    remap = &hw->remap[region];
+    if((remap->readable == readable) && (remap->writable == writable))
+        return;
+
+    remap->readable = readable;
+    remap->writable = writable;
+    memory_build_pages(remap->mem_start >> 8, remap->mem_end >> 8);
+}
+
+/*
+ * private
+ *
+ * hw_bank_add for bank controllers: a new bank with these devices
+ * mapped in.  Only from the controller's init.  Returns the bank
+ * number, or -1 if there are too many banks or devices.
+ */
+static int memory_bank_add(hw_reg_t *controller, hw_reg_t **devices, int count) {
+    memory_banks_t *banks;
+    memory_bank_t *bank;
+    mem_remap_t *remap;
+    int index;
+
+    for(banks = memory_banks; banks; banks = banks->pnext) {
+        if(banks->controller == controller)
+            break;
+    }
+
+    if(!banks) {
+        banks = malloc(sizeof(memory_banks_t));
+        if(!banks) {
+            perror("malloc");
+            exit(1);
+        }
+
+        memset(banks, 0, sizeof(memory_banks_t));
+        banks->controller = controller;
+        banks->first = 255;
+        banks->pnext = memory_banks;
+        memory_banks = banks;
+    }
+
+    if(banks->banks == MEMORY_MAX_BANKS) {
+        ERROR("Too many banks");
+        return -1;
+    }
+
+    bank = malloc(sizeof(memory_bank_t));
+    if(!bank) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(bank, 0, sizeof(memory_bank_t));
+
+    for(int x = 0; x < count; x++) {
+        for(index = 0; index < banks->devices; index++) {
+            if(banks->device[index] == devices[x])
+                break;
+        }
+
+        if(index == banks->devices) {
+            if(index == MEMORY_BANK_DEVICES) {
+                ERROR("Too many banked devices");
+                free(bank);
+                return -1;
+            }
+
+            remap = malloc(devices[x]->remapped_regions * sizeof(mem_remap_t));
+            if(!remap) {
+                perror("malloc");
+                exit(1);
+            }
+            memcpy(remap, devices[x]->remap,
+                   devices[x]->remapped_regions * sizeof(mem_remap_t));
+
+            for(int region = 0; region < devices[x]->remapped_regions; region++) {
+                if((remap[region].mem_start >> 8) < banks->first)
+                    banks->first = remap[region].mem_start >> 8;
+                if((remap[region].mem_end >> 8) > banks->last)
+                    banks->last = remap[region].mem_end >> 8;
             }
+
+            banks->device[index] = devices[x];
+            banks->remap[index] = remap;
+            banks->devices++;
+        }
+
+        bank->map |= (1 << index);
+    }
+
+    banks->bank[banks->banks] = bank;
+    banks->built = 0;
+    return banks->banks++;
+}
+
+/*
+ * private
+ *
+ * work out every bank's page table entries.  Called with
+ * memory_setup_lock held, so the map can't change under it.
+ */
+static void memory_bank_build(memory_banks_t *banks) {
+    memory_bank_t *bank;
+
+    for(int index = 0; index < banks->banks; index++) {
+        bank = banks->bank[index];
+        for(int page = banks->first; page <= banks->last; page++) {
+            bank->owner[0][page] = memory_page_owner(page, 0, banks, bank->map);
+            bank->owner[1][page] = memory_page_owner(page, 1, banks, bank->map);
+        }
+    }
+
+    banks->gen = __atomic_load_n(&memory_map_gen, __ATOMIC_RELAXED);
+    banks->built = 1;
+}
+
+/*
+ * private
+ *
+ * switch a bank's devices in and out, and copy in its page table
+ * entries
+ */
+static void memory_bank_apply(memory_banks_t *banks, memory_bank_t *bank) {
+    mem_remap_t *remap;
+    hw_reg_t *hw;
+    int in;
+
+    for(int index = 0; index < banks->devices; index++) {
+        hw = banks->device[index];
+        in = (bank->map & (1 << index)) != 0;
+        for(int x = 0; x < hw->remapped_regions; x++) {
+            remap = &banks->remap[index][x];
+            hw->remap[x].readable = in ? remap->readable : 0;
+            hw->remap[x].writable = in ? remap->writable : 0;
+        }
+    }
+
+    memcpy(&page_owner[0][banks->first], &bank->owner[0][banks->first],
+           (banks->last - banks->first + 1) * sizeof(hw_reg_t *));
+    memcpy(&page_owner[1][banks->first], &bank->owner[1][banks->first],
+           (banks->last - banks->first + 1) * sizeof(hw_reg_t *));
+    __atomic_store_n(&memory_shared_stale, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * private
+ *
+ * hw_bank_select for bank controllers: map in one of its banks.
+ * Normally a copy of the bank's page table entries, with no lock.
+ * If the map changed some other way since they were worked out,
+ * or changes while they're copied, they're rebuilt under the lock.
+ */
+static void memory_bank_select(hw_reg_t *controller, int index) {
+    memory_banks_t *banks;
+    memory_bank_t *bank;
+    uint32_t gen;
+
+    for(banks = memory_banks; banks; banks = banks->pnext) {
+        if(banks->controller == controller)
+            break;
+    }
+
+    if(!banks || (index < 0) || (index >= banks->banks))
+        return;
+
+    bank = banks->bank[index];
+    gen = __atomic_load_n(&memory_map_gen, __ATOMIC_ACQUIRE);
+    if(banks->built && !(gen & 1) && (gen == banks->gen)) {
+        memory_bank_apply(banks, bank);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&memory_map_gen, __ATOMIC_RELAXED) == gen)
+            return;
+    }
+
+    pthread_mutex_lock(&memory_setup_lock);
+    memory_bank_build(banks);
+    memory_bank_apply(banks, bank);
+    pthread_mutex_unlock(&memory_setup_lock);
+}
+
+/**
+ * publish the cpu state to the shared view, first flagging its
+ * live pages again if the page table has changed since.  Only
+ * call from the thread running the cpu.
+ */
+void memory_publish(void) {
+    hw_reg_t *hw;
+
+    if(__atomic_exchange_n(&memory_shared_stale, 0, __ATOMIC_RELAXED)) {
+        for(int page = 0; page < 256; page++) {
+            hw = page_owner[0][page];
+            shmview_map_page(page, hw && (page_shared_owner[page] == hw));
         }
+    }
 
+    shmview_publish();
+}
+
+/*
+ * private
+ *
+ * hw_find_device for devices: a loaded device by config name
+ */
+static hw_reg_t *memory_find_device(const char *name) {
+    memory_list_t *current = memory_list.pnext;
+
+    while(current) {
+        if(current->hw_reg->name && (strcmp(current->hw_reg->name, name) == 0))
+            return current->hw_reg;
         current = current->pnext;
     }
-    ERROR("No writable memory at addr %x", addr);
+
+    return NULL;
+}
+
+/*
+ * private
+ *
+ * find the device mapped at an address
+ *
+ * @param addr address to look up
+ * @param write look for a writable mapping rather than readable
+ * @returns hw_reg of the device, or NULL
+ */
+static hw_reg_t *memory_find(uint16_t addr, int write) {
+    hw_reg_t *hw = page_owner[write ? 1 : 0][addr >> 8];
+
+    if(hw)
+        return hw;
+
+    return memory_find_slow(addr, write);
+}
+
+/*
+ * private
+ *
+ * slow path for accesses to pages holding watchpoints.
+ * Records the first hit until memory_watch_hit collects it.
+ */
+static void memory_watch_check(uint16_t addr, uint8_t value, int memop) {
+    uint8_t old = watch_shadow[addr];
+    uint8_t type = 0;
+
+    if(memop == MEMOP_READ) {
+        if(WATCH_ISSET(WATCH_MAP_READ, addr)) {
+            type = WATCH_READ;
+            old = value;
+        }
+    } else {
+        if(WATCH_ISSET(WATCH_MAP_WRITE, addr))
+            type = WATCH_WRITE;
+        else if(WATCH_ISSET(WATCH_MAP_CHANGE, addr) && (old != value))
+            type = WATCH_CHANGE;
+
+        watch_shadow[addr] = value;
+    }
+
+    if(type && !memory_watch_pending) {
+        watch_last.addr = addr;
+        watch_last.old_value = old;
+        watch_last.new_value = value;
+        watch_last.type = type;
+        memory_watch_pending = 1;
+    }
+}
+
+uint8_t memory_read(uint16_t addr) {
+    hw_reg_t *hw = memory_find(addr, 0);
+    uint8_t value;
+
+    if(!hw) {
+        ERROR("No readable memory at addr %x", addr);
+        return 0;
+    }
+
+    hw->stats.reads++;
+    value = MEMOP(hw, addr, MEMOP_READ, 0);
+
+    if(watch_pages[addr >> 8])
+        memory_watch_check(addr, value, MEMOP_READ);
+
+    return value;
+}
+
+void memory_write(uint16_t addr, uint8_t value) {
+    hw_reg_t *hw = memory_find(addr, 1);
+
+    if(!hw) {
+        ERROR("No writable memory at addr %x", addr);
+        return;
+    }
+
+    if(watch_pages[addr >> 8])
+        memory_watch_check(addr, value, MEMOP_WRITE);
+
+    __atomic_store_n(&memory_dirty[addr >> 8], 1, __ATOMIC_RELAXED);
+    hw->stats.writes++;
+    MEMOP(hw, addr, MEMOP_WRITE, value);
+}
+
+/**
+ * read memory on behalf of the debugger, without
+ * triggering watchpoints or counting the access
+ *
+ * @param addr address to read
+ * @returns value at addr
+ */
+uint8_t memory_peek(uint16_t addr) {
+    hw_reg_t *hw = memory_find(addr, 0);
+
+    if(!hw)
+        return 0;
+
+    if(hw->peek)
+        return hw->peek(hw, addr);
+
+    return hw->memop(hw, addr, MEMOP_READ, 0);
+}
+
+/**
+ * write memory on behalf of the debugger, without
+ * triggering watchpoints or counting the access
+ *
+ * @param addr address to write
+ * @param value value to write
+ */
+void memory_poke(uint16_t addr, uint8_t value) {
+    hw_reg_t *hw = memory_find(addr, 1);
+
+    if(!hw)
+        return;
+
+    watch_shadow[addr] = value;
+    __atomic_store_n(&memory_dirty[addr >> 8], 1, __ATOMIC_RELAXED);
+    hw->memop(hw, addr, MEMOP_WRITE, value);
+}
+
+/**
+ * read a block of memory on behalf of the debugger.  Pages with
+ * storage of their own are copied straight out, other devices
+ * are looked up once per page where possible.
+ *
+ * @param addr first address to read
+ * @param buffer where to put len bytes
+ * @param len bytes to read, not wrapping past $ffff
+ */
+void memory_peek_block(uint16_t addr, uint8_t *buffer, uint32_t len) {
+    uint32_t current = addr;
+    uint32_t end = addr + len;
+    uint32_t page_end;
+    hw_reg_t *hw;
+    int page;
+
+    while(current < end) {
+        page = current >> 8;
+        page_end = (current | 0xff) + 1;
+        if(page_end > end)
+            page_end = end;
+
+        hw = page_owner[0][page];
+        if(hw && page_storage[page] && (page_storage_owner[page] == hw)) {
+            memcpy(buffer, page_storage[page] + (current & 0xff), page_end - current);
+            buffer += page_end - current;
+            current = page_end;
+        } else if(hw && hw->peek) {
+            for(; current < page_end; current++)
+                *buffer++ = hw->peek(hw, current);
+        } else if(hw) {
+            for(; current < page_end; current++)
+                *buffer++ = hw->memop(hw, current, MEMOP_READ, 0);
+        } else {
+            for(; current < page_end; current++)
+                *buffer++ = memory_peek(current);
+        }
+    }
+}
+
+/**
+ * write a block of memory on behalf of the debugger or loader.
+ * Pages with storage of their own are copied straight in, the
+ * rest are poked a byte at a time.
+ *
+ * @param addr first address to write
+ * @param buffer len bytes to write
+ * @param len bytes to write, not wrapping past $ffff
+ * @param rom write rom pages too, like a programmer would
+ */
+void memory_poke_block(uint16_t addr, uint8_t *buffer, uint32_t len, int rom) {
+    uint32_t current = addr;
+    uint32_t end = addr + len;
+    uint32_t page_end;
+    int page;
+
+    while(current < end) {
+        page = current >> 8;
+        page_end = (current | 0xff) + 1;
+        if(page_end > end)
+            page_end = end;
+
+        if(page_storage[page] && (page_storage_owner[page] == page_owner[0][page]) &&
+           (rom || (page_storage_owner[page] == page_owner[1][page]))) {
+            memcpy(page_storage[page] + (current & 0xff), buffer, page_end - current);
+            memcpy(&watch_shadow[current], buffer, page_end - current);
+            __atomic_store_n(&memory_dirty[page], 1, __ATOMIC_RELAXED);
+            buffer += page_end - current;
+            current = page_end;
+        } else {
+            for(; current < page_end; current++)
+                memory_poke(current, *buffer++);
+        }
+    }
+}
+
+/*
+ * private
+ *
+ * first masked match of pattern in [pos, end), or NULL
+ */
+static uint8_t *memory_match_masked(uint8_t *pos, uint8_t *end, const uint8_t *pattern,
+                                    const uint8_t *mask, uint32_t len) {
+    uint32_t index;
+
+    for(; (uint32_t)(end - pos) >= len; pos++) {
+        for(index = 0; index < len; index++) {
+            if((pos[index] ^ pattern[index]) & mask[index])
+                break;
+        }
+        if(index == len)
+            return pos;
+    }
+
+    return NULL;
+}
+
+/**
+ * search memory for a byte pattern on behalf of the debugger.
+ * The range is read as for memory_peek_block, so ram pages are
+ * copied rather than read through their device, and then searched
+ * with memmem.  Overlapping matches are all counted.
+ *
+ * @param addr first address to search
+ * @param len bytes to search, not wrapping past $ffff
+ * @param pattern bytes to look for
+ * @param mask bits of each pattern byte that must match, or NULL
+ *        to match them all
+ * @param pattern_len length of pattern (and mask)
+ * @param matches where to put the first max match addresses
+ * @param max size of matches
+ * @returns number of matches, which may be more than max
+ */
+int memory_search(uint16_t addr, uint32_t len, const uint8_t *pattern, const uint8_t *mask,
+                  uint32_t pattern_len, uint16_t *matches, int max) {
+    static uint8_t image[0x10000];
+    uint8_t *pos = image;
+    uint8_t *end = image + len;
+    uint8_t *hit;
+    int count = 0;
+
+    if(!pattern_len || (pattern_len > len))
+        return 0;
+
+    memory_peek_block(addr, image, len);
+
+    while((uint32_t)(end - pos) >= pattern_len) {
+        if(mask)
+            hit = memory_match_masked(pos, end, pattern, mask, pattern_len);
+        else
+            hit = memmem(pos, end - pos, pattern, pattern_len);
+
+        if(!hit)
+            break;
+
+        if(count < max)
+            matches[count] = addr + (hit - image);
+        count++;
+        pos = hit + 1;
+    }
+
+    return count;
+}
+
+/*
+ * private
+ *
+ * hw_alloc_ram for devices: storage from the shared view if there
+ * is one, else the heap.
+ */
+static uint8_t *memory_alloc_ram(uint16_t start, uint16_t end) {
+    uint8_t *mem;
+    int page;
+
+    mem = shmview_alloc(start, end);
+    if(mem) {
+        for(page = (start + 0xff) >> 8; (page << 8) + 0xff <= end; page++)
+            page_shared_pending[page] = 1;
+    } else {
+        mem = malloc(end - start + 1);
+    }
+    if(!mem) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    memory_register_ram(start, end, mem);
+    return mem;
+}
+
+/*
+ * private
+ *
+ * hw_register_ram for devices: remember the whole pages of a
+ * device's storage for the block copies.  Devices get it called
+ * for them by hw_alloc_ram; one that maps its own storage calls it
+ * directly.  The device it belongs to is filled in when its init
+ * returns.
+ */
+static void memory_register_ram(uint16_t start, uint16_t end, uint8_t *mem) {
+    int page;
+
+    for(page = (start + 0xff) >> 8; (page << 8) + 0xff <= end; page++) {
+        page_storage[page] = mem + (page << 8) - start;
+        page_storage_pending[page] = 1;
+    }
+}
+
+/**
+ * find the pages written since a generation.  Safe to call
+ * from a thread other than the one running the cpu.
+ *
+ * @param since generation the caller last saw, 0 for all pages.
+ *        Updated to the current generation.
+ * @param bitmap 32 bytes, bit n set if page n was written
+ * @returns number of pages set in bitmap
+ */
+int memory_dirty_since(uint32_t *since, uint8_t *bitmap) {
+    int count = 0;
+    uint32_t gen;
+
+    memset(bitmap, 0, 256 / 8);
+
+    pthread_mutex_lock(&memory_gen_lock);
+    gen = ++memory_generation;
+    for(int page = 0; page < 256; page++) {
+        if(__atomic_exchange_n(&memory_dirty[page], 0, __ATOMIC_RELAXED))
+            memory_page_gen[page] = gen;
+
+        if(!*since || (memory_page_gen[page] > *since)) {
+            bitmap[page >> 3] |= (1 << (page & 7));
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&memory_gen_lock);
+
+    *since = gen;
+    return count;
+}
+
+/**
+ * add watchpoint types to an address.  Watches for write or
+ * change take a snapshot of the current value with memory_peek.
+ *
+ * @param addr address to watch
+ * @param types WATCH_READ, WATCH_WRITE and/or WATCH_CHANGE
+ */
+void memory_watch_set(uint16_t addr, uint8_t types) {
+    int was_watched = WATCH_ANY(addr);
+
+    if(types & WATCH_READ)
+        WATCH_SET(WATCH_MAP_READ, addr);
+    if(types & WATCH_WRITE)
+        WATCH_SET(WATCH_MAP_WRITE, addr);
+    if(types & WATCH_CHANGE)
+        WATCH_SET(WATCH_MAP_CHANGE, addr);
+
+    if(types & (WATCH_WRITE | WATCH_CHANGE))
+        watch_shadow[addr] = memory_peek(addr);
+
+    if(!was_watched && WATCH_ANY(addr))
+        watch_pages[addr >> 8]++;
+}
+
+/**
+ * remove watchpoint types from an address
+ *
+ * @param addr address to stop watching
+ * @param types WATCH_* types to remove, or 0 for all
+ */
+void memory_watch_clear(uint16_t addr, uint8_t types) {
+    int was_watched = WATCH_ANY(addr);
+
+    if(!types)
+        types = WATCH_READ | WATCH_WRITE | WATCH_CHANGE;
+
+    if(types & WATCH_READ)
+        WATCH_CLR(WATCH_MAP_READ, addr);
+    if(types & WATCH_WRITE)
+        WATCH_CLR(WATCH_MAP_WRITE, addr);
+    if(types & WATCH_CHANGE)
+        WATCH_CLR(WATCH_MAP_CHANGE, addr);
+
+    if(was_watched && !WATCH_ANY(addr))
+        watch_pages[addr >> 8]--;
+}
+
+/**
+ * collect (and clear) a pending watchpoint hit
+ *
+ * @param hit filled with the hit details
+ * @returns 1 if a watchpoint was hit, 0 otherwise
+ */
+int memory_watch_hit(mem_watch_t *hit) {
+    if(!memory_watch_pending)
+        return 0;
+
+    *hit = watch_last;
+    memory_watch_pending = 0;
+    return 1;
+}
+
+/*
+ * private
+ *
+ * tell debugger clients about a device, once it has something
+ * to say (the vnc port, etc)
+ */
+static void memory_notify(hw_reg_t *hw) {
+    if(hw->descr) {
+        step_send_async(ASYNC_HWNOTIFY, hw->hw_family,
+                        0, strlen(hw->descr) + 1,
+                        (uint8_t*)hw->descr);
+    }
+}
+
+/*
+ * private
+ *
+ * run a device's setup on this thread, then map it in and wake
+ * anything waiting on it.  The caller has already marked it
+ * SETUP_RUNNING.
+ */
+static void memory_setup_run(memory_list_t *entry) {
+    hw_reg_t *hw = entry->hw_reg;
+
+    DEBUG("Setting up %s", hw->name);
+    if(!hw->setup(hw)) {
+        FATAL("Setup of %s failed", hw->name);
+        exit(1);
+    }
+
+    pthread_mutex_lock(&memory_setup_lock);
+    __atomic_store_n(&entry->setup_state, SETUP_DONE, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&memory_setup_cond);
+    pthread_mutex_unlock(&memory_setup_lock);
+
+    memory_build_pages(0, 255);
+    memory_notify(hw);
+    DEBUG("%s is set up", hw->name);
+}
+
+/*
+ * private
+ *
+ * thread proc for HW_SETUP_THREAD devices
+ */
+static void *memory_setup_proc(void *arg) {
+    memory_setup_run((memory_list_t *)arg);
+    return NULL;
 }
 
-int memory_load(const char *name, const char *module, hw_config_t *config) {
+/*
+ * private
+ *
+ * an access to a device that isn't set up yet.  If nobody has
+ * started its setup, run it here (or hand it to the main thread,
+ * for HW_SETUP_MAIN), then wait for it to finish.
+ */
+static void memory_setup_wait(memory_list_t *entry) {
+    int main_thread = pthread_equal(pthread_self(), memory_main_thread);
+    int run = 0;
+
+    pthread_mutex_lock(&memory_setup_lock);
+    if((entry->setup_state == SETUP_WAITING) &&
+       (entry->hw_reg->setup_mode & HW_SETUP_MAIN) && !main_thread) {
+        entry->setup_state = SETUP_QUEUED;
+        memory_setup_queued++;
+        pthread_cond_broadcast(&memory_setup_cond);
+    } else if((entry->setup_state == SETUP_WAITING) ||
+              ((entry->setup_state == SETUP_QUEUED) && main_thread)) {
+        if(entry->setup_state == SETUP_QUEUED)
+            memory_setup_queued--;
+        entry->setup_state = SETUP_RUNNING;
+        run = 1;
+    }
+
+    if(!run) {
+        while(entry->setup_state != SETUP_DONE)
+            pthread_cond_wait(&memory_setup_cond, &memory_setup_lock);
+    }
+    pthread_mutex_unlock(&memory_setup_lock);
+
+    if(run)
+        memory_setup_run(entry);
+}
+
+/*
+ * private
+ *
+ * start (or defer) setup of a newly loaded device, according to
+ * its setup_mode, or the config's override of it
+ *
+ * @param entry newly loaded device
+ * @param setup "now", "thread" or "lazy" from the config, or NULL
+ */
+static void memory_setup_start(memory_list_t *entry, const char *setup) {
+    hw_reg_t *hw = entry->hw_reg;
+    int mode = hw->setup_mode;
+    pthread_t tid;
+
+    if(setup) {
+        mode &= HW_SETUP_MAIN;
+        if(strcmp(setup, "thread") == 0) {
+            mode |= HW_SETUP_THREAD;
+        } else if(strcmp(setup, "lazy") == 0) {
+            mode |= HW_SETUP_LAZY;
+        } else if(strcmp(setup, "now") != 0) {
+            FATAL("Bad setup mode for %s: %s", hw->name, setup);
+            exit(1);
+        }
+    }
+
+    if(mode & HW_SETUP_LAZY) {
+        entry->setup_state = SETUP_WAITING;
+    } else if((mode & HW_SETUP_THREAD) && (mode & HW_SETUP_MAIN)) {
+        pthread_mutex_lock(&memory_setup_lock);
+        entry->setup_state = SETUP_QUEUED;
+        memory_setup_queued++;
+        pthread_mutex_unlock(&memory_setup_lock);
+    } else if(mode & HW_SETUP_THREAD) {
+        entry->setup_state = SETUP_RUNNING;
+        if(pthread_create(&tid, NULL, memory_setup_proc, entry) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(tid);
+    } else {
+        entry->setup_state = SETUP_RUNNING;
+        memory_setup_run(entry);
+    }
+}
+
+int memory_load(const char *name, const char *module, hw_config_t *config,
+                const char *setup) {
     memory_list_t *modentry = NULL;
     module_list_t *pmodule = NULL;
 
@@ -166,7 +1148,7 @@ int memory_load(const char *name, const char *module, hw_config_t *config) {
         exit(1);
     }
 
-    memset(modentry, 0x00, sizeof(modentry));
+    memset(modentry, 0x00, sizeof(memory_list_t));
     pmodule = get_load_module(module);
 
     modentry->hw_reg = pmodule->init(config, &callbacks);
@@ -186,19 +1168,56 @@ int memory_load(const char *name, const char *module, hw_config_t *config) {
 
     modentry->hw_reg->name = strdup(name);
 
+    /* storage allocated during init belongs to this device */
+    for(int page = 0; page < 256; page++) {
+        if(page_storage_pending[page]) {
+            page_storage_owner[page] = modentry->hw_reg;
+            page_storage_pending[page] = 0;
+        }
+        if(page_shared_pending[page]) {
+            page_shared_owner[page] = modentry->hw_reg;
+            page_shared_pending[page] = 0;
+        }
+    }
+
+    /* not mapped in until it's set up */
+    modentry->setup_state = modentry->hw_reg->setup ? SETUP_WAITING : SETUP_DONE;
+
+    pthread_mutex_lock(&memory_setup_lock);
     modentry->pnext = memory_list.pnext;
     memory_list.pnext = modentry;
+    pthread_mutex_unlock(&memory_setup_lock);
+    memory_build_pages(0, 255);
 
-    /* we should pop out a notify at this point */
-    if(modentry->hw_reg->descr) {
-        step_send_async(ASYNC_HWNOTIFY, modentry->hw_reg->hw_family,
-                        0, strlen(modentry->hw_reg->descr) + 1,
-                        modentry->hw_reg->descr);
+    if(modentry->hw_reg->setup) {
+        memory_setup_start(modentry, setup);
+    } else {
+        /* we should pop out a notify at this point */
+        memory_notify(modentry->hw_reg);
     }
 
     return E_MEM_SUCCESS;
 }
 
+/**
+ * get a loaded device by index, for walking the device list
+ * from outside the bus (stats, etc)
+ *
+ * @param index zero based device index
+ * @returns hw_reg of the device, or NULL if past the end
+ */
+hw_reg_t *memory_device(int index) {
+    memory_list_t *current = memory_list.pnext;
+
+    while(current && index--)
+        current = current->pnext;
+
+    if(!current)
+        return NULL;
+
+    return current->hw_reg;
+}
+
 /**
  * set irq from a module
  *
@@ -217,13 +1236,14 @@ void memory_nmi_change(void) {
 
 /**
  * see if there are any event loops on any of the registered
- * memory devices
+ * memory devices that are set up
  */
 int memory_has_eventloop(void) {
     int count = 0;
     memory_list_t *current = memory_list.pnext;
     while(current) {
-        if(current->hw_reg->eventloop)
+        if(current->hw_reg->eventloop &&
+           (__atomic_load_n(&current->setup_state, __ATOMIC_ACQUIRE) == SETUP_DONE))
             count++;
         current = current->pnext;
     }
@@ -232,18 +1252,72 @@ int memory_has_eventloop(void) {
 }
 
 /**
- * run the event loops
+ * make memory_run_eventloop return, if it's waiting with no
+ * event loops to run (so the main thread can see it's done)
+ */
+void memory_wake_eventloop(void) {
+    pthread_mutex_lock(&memory_setup_lock);
+    memory_wake = 1;
+    pthread_cond_broadcast(&memory_setup_cond);
+    pthread_mutex_unlock(&memory_setup_lock);
+}
+
+/*
+ * private
+ *
+ * run any setups queued for the main thread
+ *
+ * @returns number of setups run
+ */
+static int memory_run_queued(void) {
+    memory_list_t *current;
+    int count = 0;
+
+    do {
+        pthread_mutex_lock(&memory_setup_lock);
+        for(current = memory_list.pnext; current; current = current->pnext) {
+            if(current->setup_state == SETUP_QUEUED) {
+                current->setup_state = SETUP_RUNNING;
+                memory_setup_queued--;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&memory_setup_lock);
+
+        if(current) {
+            memory_setup_run(current);
+            count++;
+        }
+    } while(current);
+
+    return count;
+}
+
+/**
+ * run the event loops, and any device setup that has to
+ * happen on the main thread
  */
 void memory_run_eventloop(void) {
-    int count = memory_has_eventloop();
+    int count;
     memory_list_t *current = memory_list.pnext;
 
+    memory_run_queued();
+    count = memory_has_eventloop();
+
     if(!count) {
-        sleep(1);
+        /* nothing to pump, so just wait for setup requests, or
+         * memory_wake_eventloop */
+        pthread_mutex_lock(&memory_setup_lock);
+        if(!memory_setup_queued && !memory_wake)
+            pthread_cond_wait(&memory_setup_cond, &memory_setup_lock);
+        memory_wake = 0;
+        pthread_mutex_unlock(&memory_setup_lock);
+        return;
     }
 
     while(current) {
-        if(current->hw_reg->eventloop) {
+        if(current->hw_reg->eventloop &&
+           (__atomic_load_n(&current->setup_state, __ATOMIC_ACQUIRE) == SETUP_DONE)) {
             current->hw_reg->eventloop(current->hw_reg->state, count > 1);
         }
         current = current->pnext;
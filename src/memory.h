@@ -28,12 +28,39 @@
 #define E_MEM_ALLOC   1
 #define E_MEM_FOPEN   2
 
+/* a watchpoint hit.  type is one of the WATCH_* types
+ * from stepwise.h
+ */
+typedef struct mem_watch_t {
+    uint16_t addr;
+    uint8_t old_value;
+    uint8_t new_value;
+    uint8_t type;
+} mem_watch_t;
+
 extern int memory_init(void);
 extern void memory_deinit(void);
 
 extern uint8_t memory_read(uint16_t addr);
 extern void memory_write(uint16_t addr, uint8_t data);
-extern int memory_load(const char *name, const char *module, hw_config_t *config);
+extern uint8_t memory_peek(uint16_t addr);
+extern void memory_poke(uint16_t addr, uint8_t data);
+extern void memory_watch_set(uint16_t addr, uint8_t types);
+extern void memory_watch_clear(uint16_t addr, uint8_t types);
+extern int memory_watch_hit(mem_watch_t *hit);
+extern void memory_peek_block(uint16_t addr, uint8_t *buffer, uint32_t len);
+extern void memory_poke_block(uint16_t addr, uint8_t *buffer, uint32_t len, int rom);
+extern int memory_dirty_since(uint32_t *since, uint8_t *bitmap);
+extern int memory_search(uint16_t addr, uint32_t len, const uint8_t *pattern,
+                         const uint8_t *mask, uint32_t pattern_len, uint16_t *matches, int max);
+
+/* set when a watchpoint has been hit and not yet collected */
+extern int memory_watch_pending;
+extern int memory_load(const char *name, const char *module, hw_config_t *config,
+                       const char *setup);
 extern void memory_run_eventloop(void);
+extern void memory_wake_eventloop(void);
+extern hw_reg_t *memory_device(int index);
+extern void memory_publish(void);
 
 #endif /* _MEMORY_H_ */
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "memory.h"
+#include "stepwise.h"
+
+metrics_t metrics;
+
+#if defined(ALLOC_STATS)
+uint64_t metrics_debugger_allocs = 0;
+
+/* set on the debugger thread, so the wrappers know to count */
+static __thread int metrics_count_allocs = 0;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t count, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+
+/*
+ * private
+ *
+ * count an allocation, if it's on the debugger thread
+ */
+static void metrics_count_alloc(void) {
+    if(metrics_count_allocs)
+        __atomic_add_fetch(&metrics_debugger_allocs, 1, __ATOMIC_RELAXED);
+}
+
+void *__wrap_malloc(size_t size) {
+    metrics_count_alloc();
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    metrics_count_alloc();
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    metrics_count_alloc();
+    return __real_realloc(ptr, size);
+}
+#else
+uint64_t metrics_debugger_allocs = METRICS_NO_ALLOCS;
+#endif /* ALLOC_STATS */
+
+/**
+ * reset the counters and note the start time
+ */
+void metrics_init(void) {
+    memset((void*)&metrics, 0, sizeof(metrics));
+    clock_gettime(CLOCK_MONOTONIC, &metrics.start);
+}
+
+/**
+ * register the calling thread as the one running the cpu, so
+ * we can report host cpu time for it from any other thread
+ */
+void metrics_cpu_thread(void) {
+    metrics.cpu_thread = pthread_self();
+    metrics.cpu_thread_valid = 1;
+}
+
+/**
+ * register the calling thread as the debugger thread, and start
+ * counting its heap allocations in metrics_debugger_allocs
+ */
+void metrics_debugger_thread(void) {
+#if defined(ALLOC_STATS)
+    metrics_count_allocs = 1;
+#endif
+}
+
+/*
+ * private
+ *
+ * microseconds of wall time since metrics_init
+ */
+static uint64_t metrics_wall_usec(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)(now.tv_sec - metrics.start.tv_sec) * 1000000) +
+        ((now.tv_nsec - metrics.start.tv_nsec) / 1000);
+}
+
+/*
+ * private
+ *
+ * microseconds of host cpu time used by the cpu thread
+ */
+static uint64_t metrics_cpu_usec(void) {
+    clockid_t cid;
+    struct timespec ts;
+
+    if(!metrics.cpu_thread_valid)
+        return 0;
+
+    if(pthread_getcpuclockid(metrics.cpu_thread, &cid))
+        return 0;
+
+    if(clock_gettime(cid, &ts))
+        return 0;
+
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/**
+ * build a CMD_STATS payload: a dbg_stats_t followed by one
+ * dbg_stats_device_t per loaded device, as many as fit.
+ *
+ * @param buffer where to build the payload
+ * @param size size of buffer
+ * @returns the length of the payload
+ */
+uint16_t metrics_snapshot(uint8_t *buffer, uint16_t size) {
+    dbg_stats_t *stats;
+    dbg_stats_device_t *device;
+    hw_reg_t *hw;
+    uint64_t wall;
+    int count = 0;
+    uint16_t len;
+
+    while(memory_device(count) &&
+          (sizeof(dbg_stats_t) + ((count + 1) * sizeof(dbg_stats_device_t)) <= size))
+        count++;
+
+    len = sizeof(dbg_stats_t) + (count * sizeof(dbg_stats_device_t));
+    memset(buffer, 0, len);
+
+    wall = metrics_wall_usec();
+
+    stats = (dbg_stats_t*)buffer;
+    stats->instructions = metrics.instructions;
+    stats->cycles = metrics.cycles;
+    stats->irqs = metrics.irqs;
+    stats->wall_usec = wall;
+    stats->cpu_usec = metrics_cpu_usec();
+    stats->khz = wall ? (uint32_t)((metrics.cycles * 1000) / wall) : 0;
+    stats->allocs = __atomic_load_n(&metrics_debugger_allocs, __ATOMIC_RELAXED);
+    stats->target_khz = metrics.target_khz;
+    stats->drift_usec = metrics.drift_nsec / 1000;
+    stats->late_slices = metrics.late_slices;
+    stats->resyncs = metrics.resyncs;
+    stats->devices = count;
+
+    device = (dbg_stats_device_t*)(buffer + sizeof(dbg_stats_t));
+    for(int x = 0; x < count; x++) {
+        hw = memory_device(x);
+        if(hw->name)
+            strncpy(device[x].name, hw->name, STATS_NAME_LEN - 1);
+        device[x].hw_family = hw->hw_family;
+        device[x].reads = hw->stats.reads;
+        device[x].writes = hw->stats.writes;
+        device[x].rx_bytes = hw->stats.rx_bytes;
+        device[x].tx_bytes = hw->stats.tx_bytes;
+        device[x].refreshes = hw->stats.refreshes;
+    }
+
+    return len;
+}
+
+/**
+ * write the csv column names for metrics_csv_line
+ *
+ * @param out where to write it
+ */
+void metrics_csv_header(FILE *out) {
+    hw_reg_t *hw;
+    int index = 0;
+
+    fprintf(out, "elapsed,instructions,cycles,mhz,irqs,cpu_time,"
+            "drift_usec,late_slices,resyncs");
+    while((hw = memory_device(index++))) {
+        fprintf(out, ",%s.reads,%s.writes,%s.rx,%s.tx,%s.refreshes",
+                hw->name, hw->name, hw->name, hw->name, hw->name);
+    }
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+/**
+ * write the current counters as a csv line.  Times are
+ * in (fractional) seconds.
+ *
+ * @param out where to write it
+ */
+void metrics_csv_line(FILE *out) {
+    hw_reg_t *hw;
+    int index = 0;
+    uint64_t wall = metrics_wall_usec();
+
+    fprintf(out, "%.3f,%llu,%llu,%.3f,%llu,%.3f,%lld,%llu,%llu",
+            wall / 1000000.0,
+            (unsigned long long)metrics.instructions,
+            (unsigned long long)metrics.cycles,
+            wall ? (double)metrics.cycles / wall : 0.0,
+            (unsigned long long)metrics.irqs,
+            metrics_cpu_usec() / 1000000.0,
+            (long long)metrics.drift_nsec / 1000,
+            (unsigned long long)metrics.late_slices,
+            (unsigned long long)metrics.resyncs);
+
+    while((hw = memory_device(index++))) {
+        fprintf(out, ",%llu,%llu,%llu,%llu,%llu",
+                (unsigned long long)hw->stats.reads,
+                (unsigned long long)hw->stats.writes,
+                (unsigned long long)hw->stats.rx_bytes,
+                (unsigned long long)hw->stats.tx_bytes,
+                (unsigned long long)hw->stats.refreshes);
+    }
+    fprintf(out, "\n");
+    fflush(out);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+/* counters owned by the cpu thread.  Other threads only ever
+ * read these, so a slightly stale value is fine.
+ */
+typedef struct metrics_t {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t irqs;
+
+    /* pacing (throttle.c): target rate, how far behind the wall
+     * clock the last slice ended, slices that ended late, and
+     * times it fell too far behind and started over */
+    uint32_t target_khz;
+    int64_t drift_nsec;
+    uint64_t late_slices;
+    uint64_t resyncs;
+
+    struct timespec start;
+    pthread_t cpu_thread;
+    int cpu_thread_valid;
+} metrics_t;
+
+extern metrics_t metrics;
+
+/* heap allocations made on the debugger thread, from when it
+ * calls metrics_debugger_thread.  Configured with
+ * --enable-alloc-stats, rp65emu is linked with --wrap for malloc,
+ * calloc and realloc, so this counts every call made from the
+ * emulator's own code (not from inside libc or plugin modules).
+ * Read from other threads, so bumped atomically.  Otherwise it
+ * stays at METRICS_NO_ALLOCS. */
+#define METRICS_NO_ALLOCS UINT64_MAX
+
+extern uint64_t metrics_debugger_allocs;
+
+extern void metrics_init(void);
+extern void metrics_cpu_thread(void);
+extern void metrics_debugger_thread(void);
+extern uint16_t metrics_snapshot(uint8_t *buffer, uint16_t size);
+extern void metrics_csv_header(FILE *out);
+extern void metrics_csv_line(FILE *out);
+
+#endif /* _METRICS_H_ */
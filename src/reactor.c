@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#include "debug.h"
+#include "reactor.h"
+
+/* a watched fd.  Entries are never freed, only marked unused
+ * (fd -1), so an event already collected for a removed fd
+ * can't touch freed memory. */
+typedef struct reactor_entry_t {
+    int fd;
+    hw_io_t callback;
+    void *arg;
+} reactor_entry_t;
+
+static reactor_entry_t reactor_entries[REACTOR_MAX_FDS];
+static pthread_mutex_t reactor_lock = PTHREAD_MUTEX_INITIALIZER;
+static int reactor_epoll = -1;
+static pthread_t reactor_tid;
+
+/*
+ * private
+ *
+ * HW_IO_* to epoll events
+ */
+static uint32_t reactor_epoll_events(int events) {
+    uint32_t result = 0;
+
+    if(events & HW_IO_READ)
+        result |= EPOLLIN;
+    if(events & HW_IO_WRITE)
+        result |= EPOLLOUT;
+
+    return result;
+}
+
+/*
+ * private
+ *
+ * the registration for an fd.  Caller holds reactor_lock.
+ */
+static reactor_entry_t *reactor_find(int fd) {
+    for(int x = 0; x < REACTOR_MAX_FDS; x++) {
+        if(reactor_entries[x].fd == fd)
+            return &reactor_entries[x];
+    }
+
+    return NULL;
+}
+
+/*
+ * private
+ *
+ * the i/o thread: wait for fds to be ready, and call back
+ * whoever registered them
+ */
+static void *reactor_proc(void *arg) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    reactor_entry_t *entry;
+    hw_io_t callback;
+    void *callback_arg;
+    int count;
+    int fd;
+    int ready;
+
+    while(1) {
+        count = epoll_wait(reactor_epoll, events, REACTOR_MAX_EVENTS, -1);
+        if(count < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for(int x = 0; x < count; x++) {
+            entry = (reactor_entry_t *)events[x].data.ptr;
+
+            pthread_mutex_lock(&reactor_lock);
+            fd = entry->fd;
+            callback = entry->callback;
+            callback_arg = entry->arg;
+            pthread_mutex_unlock(&reactor_lock);
+
+            if(fd == -1)
+                continue;
+
+            ready = 0;
+            if(events[x].events & EPOLLIN)
+                ready |= HW_IO_READ;
+            if(events[x].events & EPOLLOUT)
+                ready |= HW_IO_WRITE;
+            if(events[x].events & (EPOLLHUP | EPOLLERR))
+                ready |= HW_IO_HUP;
+
+            callback(callback_arg, fd, ready);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * start the i/o thread, before any devices are loaded
+ */
+void reactor_init(void) {
+    for(int x = 0; x < REACTOR_MAX_FDS; x++)
+        reactor_entries[x].fd = -1;
+
+    reactor_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(reactor_epoll < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    if(pthread_create(&reactor_tid, NULL, reactor_proc, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * watch an fd on the i/o thread.  The fd should be non-blocking.
+ *
+ * @param fd fd to watch
+ * @param events HW_IO_READ and/or HW_IO_WRITE
+ * @param callback called on the i/o thread with arg, the fd, and
+ *                 the HW_IO_* events that are ready
+ * @param arg passed to callback
+ * @returns 1 on success, 0 on failure
+ */
+int reactor_add(int fd, int events, hw_io_t callback, void *arg) {
+    reactor_entry_t *entry;
+    struct epoll_event event;
+
+    pthread_mutex_lock(&reactor_lock);
+    entry = reactor_find(-1);
+    if(!entry) {
+        pthread_mutex_unlock(&reactor_lock);
+        ERROR("Too many fds for the i/o thread");
+        return 0;
+    }
+
+    entry->callback = callback;
+    entry->arg = arg;
+
+    memset(&event, 0, sizeof(event));
+    event.events = reactor_epoll_events(events);
+    event.data.ptr = entry;
+
+    if(epoll_ctl(reactor_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        pthread_mutex_unlock(&reactor_lock);
+        ERROR("epoll_ctl: %s", strerror(errno));
+        return 0;
+    }
+
+    entry->fd = fd;
+    pthread_mutex_unlock(&reactor_lock);
+    return 1;
+}
+
+/**
+ * change the events a watched fd is waiting on, eg to wait for
+ * it to be writable only while there is something to write
+ *
+ * @param fd fd registered with reactor_add
+ * @param events HW_IO_READ and/or HW_IO_WRITE
+ * @returns 1 on success, 0 on failure
+ */
+int reactor_modify(int fd, int events) {
+    reactor_entry_t *entry;
+    struct epoll_event event;
+    int result = 0;
+
+    if(fd < 0)
+        return 0;
+
+    pthread_mutex_lock(&reactor_lock);
+    if((entry = reactor_find(fd))) {
+        memset(&event, 0, sizeof(event));
+        event.events = reactor_epoll_events(events);
+        event.data.ptr = entry;
+        result = (epoll_ctl(reactor_epoll, EPOLL_CTL_MOD, fd, &event) == 0);
+    }
+    pthread_mutex_unlock(&reactor_lock);
+
+    return result;
+}
+
+/**
+ * stop watching an fd.  Once this returns, the fd's callback
+ * won't be started again.
+ *
+ * @param fd fd registered with reactor_add
+ */
+void reactor_remove(int fd) {
+    reactor_entry_t *entry;
+
+    if(fd < 0)
+        return;
+
+    pthread_mutex_lock(&reactor_lock);
+    if((entry = reactor_find(fd))) {
+        epoll_ctl(reactor_epoll, EPOLL_CTL_DEL, fd, NULL);
+        entry->fd = -1;
+    }
+    pthread_mutex_unlock(&reactor_lock);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include "hardware.h"
+
+/* the i/o thread.  Devices register file descriptors with it
+ * (hw_io_add), and get called back on it when they are ready,
+ * rather than each running blocking reads on threads of their
+ * own.  One epoll set covers every device.
+ */
+#define REACTOR_MAX_FDS    256
+#define REACTOR_MAX_EVENTS 64
+
+extern void reactor_init(void);
+extern int reactor_add(int fd, int events, hw_io_t callback, void *arg);
+extern int reactor_modify(int fd, int events);
+extern void reactor_remove(int fd);
+
+#endif /* _REACTOR_H_ */
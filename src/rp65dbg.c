@@ -17,6 +17,7 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,8 +27,12 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/un.h>
 
 #include "emulator.h"
 #include "libtui.h"
@@ -35,6 +40,7 @@
 #include "6502.h"
 #include "debuginfo.h"
 #include "redblack.h"
+#include "shmview.h"
 
 #define _INCLUDE_OPCODE_MAP
 #include "opcodes.h"
@@ -60,6 +66,13 @@ int stepif_emu_pid = 0;
 #define PIPE_READ_FD   0
 #define PIPE_WRITE_FD  1
 
+/* how often to refresh registers while the emulator free-runs */
+#define STEPIF_RUN_POLL_MS 100
+
+/* most instructions over/out/until will run before giving back
+ * control, since the emulator can't be stopped while they run */
+#define STEPIF_STEP_LIMIT 10000000
+
 cpu_t stepif_state;
 int stepif_display_mode;
 int stepif_display_track;
@@ -71,6 +84,37 @@ uint16_t stepif_watch_addr;
 uint16_t stepif_remote_caps = 0;
 
 int stepif_follow_on_run=1;
+int stepif_remote_running = 0;
+int stepif_subscribed = 0;
+
+/* local copy of emulator memory and registers, so one window
+ * refresh costs one round trip.  A set bit in stepif_shadow_valid
+ * means the byte is current. */
+#define STEPIF_MAX_RANGES 64
+
+uint8_t stepif_shadow[0x10000];
+uint8_t stepif_shadow_valid[0x10000 / 8];
+int stepif_shadow_regs_valid = 0;
+
+/* the emulator's shared memory view, if it has one */
+shm_header_t *stepif_shm = NULL;
+
+/* on the socket, commands, responses and async events are framed
+ * and share one fd.  Async events that turn up while waiting for a
+ * response are queued until stepif_process_message asks for them.
+ */
+#define STEPIF_CONNECT_TRIES 20
+
+typedef struct stepif_async_t {
+    dbg_command_t cmd;
+    uint8_t *extra;
+    struct stepif_async_t *pnext;
+} stepif_async_t;
+
+int stepif_framed = 0;
+uint16_t stepif_tag = 0;
+stepif_async_t *stepif_async_head = NULL;
+stepif_async_t *stepif_async_tail = NULL;
 
 #define D_FATAL 0
 #define D_ERROR 1
@@ -102,6 +146,11 @@ struct rbtree *stepif_watches = NULL;
 #define TOK_DI         10
 #define TOK_WATCH      11
 #define TOK_RADIX      12
+#define TOK_STATS      13
+#define TOK_OVER       14
+#define TOK_OUT        15
+#define TOK_UNTIL      16
+#define TOK_FIND       17
 #define TOK_UNKNOWN   100
 #define TOK_AMBIGUOUS 101
 
@@ -119,6 +168,11 @@ char *tokens[] = {
     "di",
     "watch",
     "radix",
+    "stats",
+    "over",
+    "out",
+    "until",
+    "find",
     NULL
 };
 
@@ -130,6 +184,9 @@ typedef struct emu_hardware_t {
 emu_hardware_t hwinfo = { NULL, NULL };
 
 int stepif_command(dbg_command_t *command, uint8_t *out_data, dbg_response_t *retval, uint8_t **in_data);
+void stepif_refresh_state(void);
+void stepif_shadow_invalidate(void);
+void stepif_subscribe(int live);
 
 /**
  * malloc and exit on error
@@ -210,6 +267,8 @@ int stepif_simple_command(uint8_t cmd, uint16_t param1,
     return stepif_command(&command, data, &response, NULL);
 }
 
+int breakpoint_is_set(uint16_t addr);
+
 void breakpoint_add(uint16_t addr) {
     uint16_t *paddr = error_malloc(sizeof(uint16_t));
 
@@ -223,6 +282,41 @@ void breakpoint_add(uint16_t addr) {
         stepif_simple_command(CMD_BP, PARAM_BP_SET, addr, NULL, 0);
 }
 
+/**
+ * add a breakpoint that only stops when a condition holds,
+ * and/or after a number of hits.  The emulator evaluates it.
+ *
+ * @param addr breakpoint address
+ * @param count stop on the count'th time the condition holds
+ * @param code compiled condition, or NULL
+ * @param len length of code
+ * @returns RESPONSE_OK on success
+ */
+int breakpoint_add_condition(uint16_t addr, uint16_t count,
+                             uint8_t *code, int len) {
+    uint8_t buffer[sizeof(dbg_bp_cond_t) + BC_MAX_LEN];
+    dbg_bp_cond_t *cond = (dbg_bp_cond_t*)buffer;
+    uint16_t *paddr;
+
+    cond->count = count;
+    if(code)
+        memcpy(cond->code, code, len);
+    else
+        len = 0;
+
+    if(stepif_simple_command(CMD_BP, PARAM_BP_SET, addr, buffer,
+                             sizeof(dbg_bp_cond_t) + len) != RESPONSE_OK)
+        return RESPONSE_ERROR;
+
+    if(!breakpoint_is_set(addr)) {
+        paddr = error_malloc(sizeof(uint16_t));
+        *paddr = addr;
+        rbsearch((void*)paddr, stepif_breakpoints);
+    }
+
+    return RESPONSE_OK;
+}
+
 void breakpoint_remove(uint16_t addr) {
     rbdelete((void*)&addr, stepif_breakpoints);
 
@@ -292,22 +386,139 @@ void fd_blocking(int fd, int blocking) {
     fcntl(fd, F_SETFL, flags);
 }
 
+/**
+ * read a whole block, waiting for it even if the fd is
+ * non-blocking
+ *
+ * @returns bytes read, short on error or end of file
+ */
+ssize_t stepif_read_all(int fd, void *buf, size_t len) {
+    struct pollfd pfd;
+    ssize_t bytes_read;
+    size_t total = 0;
+
+    while(total < len) {
+        bytes_read = read(fd, (uint8_t*)buf + total, len - total);
+        if(bytes_read == -1 && errno == EAGAIN) {
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            poll(&pfd, 1, -1);
+            continue;
+        }
+
+        if(bytes_read == -1 && errno == EINTR)
+            continue;
+
+        if(bytes_read <= 0)
+            break;
+
+        total += bytes_read;
+    }
+
+    return total;
+}
+
+/**
+ * read the body of an async frame from the socket, and queue it
+ *
+ * @returns 1 on success, 0 on a short read
+ */
+int stepif_queue_async(void) {
+    stepif_async_t *pending;
+
+    pending = (stepif_async_t*)error_malloc(sizeof(stepif_async_t));
+    pending->extra = NULL;
+    pending->pnext = NULL;
+
+    if(stepif_read_all(stepif_asy_fd, &pending->cmd, sizeof(dbg_command_t)) !=
+       sizeof(dbg_command_t)) {
+        free(pending);
+        return 0;
+    }
+
+    if(pending->cmd.extra_len) {
+        pending->extra = (uint8_t*)error_malloc(pending->cmd.extra_len);
+        if(stepif_read_all(stepif_asy_fd, pending->extra, pending->cmd.extra_len) !=
+           pending->cmd.extra_len) {
+            free(pending->extra);
+            free(pending);
+            return 0;
+        }
+    }
+
+    if(stepif_async_tail)
+        stepif_async_tail->pnext = pending;
+    else
+        stepif_async_head = pending;
+    stepif_async_tail = pending;
+
+    return 1;
+}
+
+/**
+ * get the next async message from the socket, either one queued
+ * while waiting on a response or one waiting to be read.  Does not
+ * wait if there isn't one.
+ *
+ * @returns 1 if there was a message, 0 otherwise
+ */
+int stepif_next_async(dbg_command_t *cmd, uint8_t **extra) {
+    stepif_async_t *pending;
+    struct pollfd pfd;
+    dbg_frame_t frame;
+
+    if(!stepif_async_head) {
+        pfd.fd = stepif_asy_fd;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, 0) <= 0)
+            return 0;
+
+        if(stepif_read_all(stepif_asy_fd, &frame, sizeof(frame)) != sizeof(frame))
+            return 0;
+
+        if(frame.type != FRAME_ASYNC) {
+            stepif_debug(D_DEBUG, "Unexpected frame type: %d\n", frame.type);
+            return 0;
+        }
+
+        if(!stepif_queue_async())
+            return 0;
+    }
+
+    pending = stepif_async_head;
+    stepif_async_head = pending->pnext;
+    if(!stepif_async_head)
+        stepif_async_tail = NULL;
+
+    *cmd = pending->cmd;
+    *extra = pending->extra;
+    free(pending);
+    return 1;
+}
+
 /**
  * read an async message
  */
 int stepif_process_message(int fd) {
     dbg_command_t cmd;
+    dbg_watch_t *watch;
     ssize_t bytes_read;
     uint8_t *extra_data = NULL;
+    int page;
 
-    bytes_read = read(fd, (char *)&cmd, sizeof(dbg_command_t));
-    if(bytes_read != sizeof(dbg_command_t)) {
-        stepif_debug(D_DEBUG, "Expecting to read %d bytes, read %d\n",
-                     sizeof(dbg_command_t), bytes_read);
-        return RESPONSE_ERROR;
+    if(stepif_framed) {
+        if(!stepif_next_async(&cmd, &extra_data))
+            return RESPONSE_ERROR;
+    } else {
+        bytes_read = read(fd, (char *)&cmd, sizeof(dbg_command_t));
+        if(bytes_read != sizeof(dbg_command_t)) {
+            stepif_debug(D_DEBUG, "Expecting to read %d bytes, read %d\n",
+                         sizeof(dbg_command_t), bytes_read);
+            return RESPONSE_ERROR;
+        }
     }
 
-    if(cmd.extra_len) {
+    if(cmd.extra_len && !stepif_framed) {
         extra_data = malloc(cmd.extra_len);
         if(!extra_data) {
             perror("malloc");
@@ -340,6 +551,60 @@ int stepif_process_message(int fd) {
 
         tui_refresh(tui_getstatusbar());
         break;
+    case ASYNC_STOPPED:
+        stepif_shadow_invalidate();
+        if(cmd.extra_len == sizeof(cpu_t))
+            memcpy((void*)&stepif_state, extra_data, sizeof(cpu_t));
+
+        if(stepif_remote_running) {
+            stepif_remote_running = 0;
+            stepif_running = 0;
+            if(stepif_subscribed)
+                stepif_subscribe(0);
+
+            switch(cmd.param1) {
+            case STOP_BREAK:
+                tui_putstring(pcommand, " Breakpoint $%04x reached\n", cmd.param2);
+                break;
+            case STOP_WATCH:
+                break;
+            default:
+                tui_putstring(pcommand, " Stopped at $%04x\n", cmd.param2);
+                break;
+            }
+
+            stepif_refresh_state();
+        }
+        break;
+    case ASYNC_DIRTY:
+        if(cmd.extra_len == DIRTY_BITMAP_LEN) {
+            for(page = 0; page < 256; page++) {
+                if(extra_data[page >> 3] & (1 << (page & 7)))
+                    memset(&stepif_shadow_valid[page * 32], 0, 32);
+            }
+        }
+        break;
+    case ASYNC_REGS:
+        /* a late frame from before the stop is older than what
+         * we already have */
+        if(stepif_remote_running && (cmd.extra_len == sizeof(cpu_t))) {
+            memcpy((void*)&stepif_state, extra_data, sizeof(cpu_t));
+            stepif_shadow_regs_valid = 1;
+            if(stepif_follow_on_run)
+                stepif_refresh_state();
+        }
+        break;
+    case ASYNC_WATCH:
+        stepif_shadow_invalidate();
+        if(cmd.extra_len == sizeof(dbg_watch_t)) {
+            watch = (dbg_watch_t*)extra_data;
+            tui_putstring(pcommand, " Watch $%04x %s at $%04x: $%02x -> $%02x\n",
+                          watch->addr,
+                          watch->type == WATCH_READ ? "read" :
+                          watch->type == WATCH_WRITE ? "write" : "change",
+                          watch->pc, watch->old_value, watch->new_value);
+        }
+        break;
     default:
         stepif_debug(D_DEBUG, "Bad async command: %d\n",
                      cmd.cmd);
@@ -393,6 +658,200 @@ int stepif_eval(char *string, uint16_t *value) {
 }
 
 
+/*
+ * breakpoint condition compiler.  Turns expressions like
+ * "A==$0D && mem[$20]>5" into BC_* bytecode for the emulator.
+ *
+ * Precedence, loosest first: ||, &&, comparisons, |, &, + and -,
+ * then unary !.  Registers are A, X, Y, P, SP and PC; anything
+ * else is a number or symbol, as for stepif_eval.
+ */
+typedef struct cond_parser_t {
+    char *pos;
+    uint8_t code[BC_MAX_LEN];
+    int len;
+    int error;
+} cond_parser_t;
+
+static void cond_or(cond_parser_t *p);
+
+static void cond_emit(cond_parser_t *p, uint8_t byte) {
+    if(p->len >= BC_MAX_LEN) {
+        p->error = 1;
+        return;
+    }
+    p->code[p->len++] = byte;
+}
+
+static void cond_skip(cond_parser_t *p) {
+    while(*p->pos == ' ' || *p->pos == '\t')
+        p->pos++;
+}
+
+/* consume op if it is next (and not the start of a longer op) */
+static int cond_match(cond_parser_t *p, char *op, char *not_followed) {
+    cond_skip(p);
+    if(strncmp(p->pos, op, strlen(op)) != 0)
+        return 0;
+    if(not_followed && p->pos[strlen(op)] &&
+       strchr(not_followed, p->pos[strlen(op)]))
+        return 0;
+    p->pos += strlen(op);
+    return 1;
+}
+
+static void cond_primary(cond_parser_t *p) {
+    char token[64];
+    int len = 0;
+    uint16_t value;
+    char *regs[] = { "a", "x", "y", "p", "sp", "pc", NULL };
+    uint8_t reg_params[] = { PARAM_A, PARAM_X, PARAM_Y, PARAM_P, PARAM_SP, PARAM_IP };
+
+    cond_skip(p);
+
+    if(cond_match(p, "(", NULL)) {
+        cond_or(p);
+        if(!cond_match(p, ")", NULL))
+            p->error = 1;
+        return;
+    }
+
+    if(strncasecmp(p->pos, "mem[", 4) == 0) {
+        p->pos += 4;
+        cond_or(p);
+        if(!cond_match(p, "]", NULL))
+            p->error = 1;
+        cond_emit(p, BC_MEM);
+        return;
+    }
+
+    while(*p->pos && (isalnum(*p->pos) || strchr("_$%#.", *p->pos)) &&
+          (len < (int)sizeof(token) - 1))
+        token[len++] = *p->pos++;
+    token[len] = '\0';
+
+    if(!len) {
+        p->error = 1;
+        return;
+    }
+
+    for(int x = 0; regs[x]; x++) {
+        if(strcasecmp(token, regs[x]) == 0) {
+            cond_emit(p, BC_REG);
+            cond_emit(p, reg_params[x]);
+            return;
+        }
+    }
+
+    if(!stepif_eval(token, &value)) {
+        stepif_debug(D_ERROR, "Unknown value: %s\n", token);
+        p->error = 1;
+        return;
+    }
+
+    cond_emit(p, BC_PUSH);
+    cond_emit(p, value & 0xFF);
+    cond_emit(p, value >> 8);
+}
+
+static void cond_unary(cond_parser_t *p) {
+    if(cond_match(p, "!", "=")) {
+        cond_unary(p);
+        cond_emit(p, BC_NOT);
+        return;
+    }
+    cond_primary(p);
+}
+
+static void cond_sum(cond_parser_t *p) {
+    cond_unary(p);
+    while(!p->error) {
+        if(cond_match(p, "+", NULL)) {
+            cond_unary(p);
+            cond_emit(p, BC_ADD);
+        } else if(cond_match(p, "-", NULL)) {
+            cond_unary(p);
+            cond_emit(p, BC_SUB);
+        } else {
+            break;
+        }
+    }
+}
+
+static void cond_bitand(cond_parser_t *p) {
+    cond_sum(p);
+    while(!p->error && cond_match(p, "&", "&")) {
+        cond_sum(p);
+        cond_emit(p, BC_AND);
+    }
+}
+
+static void cond_bitor(cond_parser_t *p) {
+    cond_bitand(p);
+    while(!p->error && cond_match(p, "|", "|")) {
+        cond_bitand(p);
+        cond_emit(p, BC_OR);
+    }
+}
+
+static void cond_compare(cond_parser_t *p) {
+    char *ops[] = { "==", "!=", "<=", ">=", "<", ">", NULL };
+    uint8_t opcodes[] = { BC_EQ, BC_NE, BC_LE, BC_GE, BC_LT, BC_GT };
+
+    cond_bitor(p);
+    for(int x = 0; ops[x] && !p->error; x++) {
+        if(cond_match(p, ops[x], NULL)) {
+            cond_bitor(p);
+            cond_emit(p, opcodes[x]);
+            break;
+        }
+    }
+}
+
+static void cond_and(cond_parser_t *p) {
+    cond_compare(p);
+    while(!p->error && cond_match(p, "&&", NULL)) {
+        cond_compare(p);
+        cond_emit(p, BC_LAND);
+    }
+}
+
+static void cond_or(cond_parser_t *p) {
+    cond_and(p);
+    while(!p->error && cond_match(p, "||", NULL)) {
+        cond_and(p);
+        cond_emit(p, BC_LOR);
+    }
+}
+
+/**
+ * compile a breakpoint condition
+ *
+ * @param expr expression to compile
+ * @param code buffer of at least BC_MAX_LEN bytes
+ * @returns length of the bytecode, or -1 on syntax error
+ */
+int stepif_compile_condition(char *expr, uint8_t *code) {
+    cond_parser_t parser;
+
+    memset((void*)&parser, 0, sizeof(parser));
+    parser.pos = expr;
+
+    cond_or(&parser);
+    cond_skip(&parser);
+    if(*parser.pos)
+        parser.error = 1;
+
+    cond_emit(&parser, BC_END);
+
+    if(parser.error)
+        return -1;
+
+    memcpy(code, parser.code, parser.len);
+    return parser.len;
+}
+
+
 int get_token(char *string) {
     int token = 0;
     int found = 0;
@@ -419,23 +878,66 @@ int get_token(char *string) {
 
 int stepif_command(dbg_command_t *command, uint8_t *out_data, dbg_response_t *retval, uint8_t **in_data) {
     ssize_t bytes_read;
-    ssize_t bytes_written;
+    ssize_t bytes_written = 0;
+    ssize_t total;
+    uint8_t *extra;
+    dbg_frame_t frame;
+
+    if(stepif_framed) {
+        frame.type = FRAME_COMMAND;
+        frame.tag = ++stepif_tag;
+        bytes_written = write(stepif_cmd_fd, (char *)&frame, sizeof(frame));
+    }
 
     stepif_debug(D_DEBUG, "Writing command of type %02x (size %d)\n", command->cmd, sizeof(dbg_command_t));
-    bytes_written = write(stepif_cmd_fd, (char *)command, sizeof(dbg_command_t));
+    bytes_written += write(stepif_cmd_fd, (char *)command, sizeof(dbg_command_t));
 
     if(command->extra_len) {
         bytes_written += write(stepif_cmd_fd, (char *)out_data, command->extra_len);
     }
 
+    switch(command->cmd) {
+    case CMD_NOP:
+    case CMD_VER:
+    case CMD_REGS:
+    case CMD_READMEM:
+    case CMD_READMULTI:
+    case CMD_CAPS:
+    case CMD_STATS:
+    case CMD_SUBSCRIBE:
+        break;
+    default:
+        stepif_shadow_invalidate();
+        break;
+    }
+
     stepif_debug(D_DEBUG, "Wrote %d bytes\n", bytes_written);
 
+    /* async events can be ahead of the response on the socket */
+    while(stepif_framed) {
+        if(stepif_read_all(stepif_rsp_fd, &frame, sizeof(frame)) != sizeof(frame) ||
+           (frame.type == FRAME_ASYNC && !stepif_queue_async())) {
+            stepif_debug(D_DEBUG, "Lost connection to emulator\n");
+            if(in_data)
+                *in_data = NULL;
+            return RESPONSE_ERROR;
+        }
+
+        if(frame.type == FRAME_RESPONSE) {
+            if(frame.tag != stepif_tag)
+                stepif_debug(D_DEBUG, "Response tag %d, expecting %d\n",
+                             frame.tag, stepif_tag);
+            break;
+        }
+    }
+
     /* read the result and return it */
-    bytes_read = read(stepif_rsp_fd, (char *)retval, sizeof(dbg_response_t));
+    bytes_read = stepif_read_all(stepif_rsp_fd, (char *)retval, sizeof(dbg_response_t));
     if(bytes_read != sizeof(dbg_response_t)) {
         stepif_debug(D_DEBUG, "Expecting to read %d bytes, read %d\n",
                      sizeof(dbg_response_t), bytes_read);
-        *in_data = (uint8_t*)"Bad read";
+        if(in_data)
+            *in_data = NULL;
         return RESPONSE_ERROR;
     }
 
@@ -443,15 +945,24 @@ int stepif_command(dbg_command_t *command, uint8_t *out_data, dbg_response_t *re
                  retval->response_status ? "Failure" : "Success",
                  retval->extra_len, bytes_read);
 
-    if(retval->response_status == RESPONSE_OK && retval->extra_len) {
-        *in_data = (uint8_t*)malloc(retval->extra_len);
-        if(!*in_data) {
+    /* always drain the extra data, even on error or if the
+       caller doesn't want it, or the next response is garbage */
+    if(retval->extra_len) {
+        extra = (uint8_t*)malloc(retval->extra_len);
+        if(!extra) {
             perror("malloc");
             exit(EXIT_FAILURE);
         }
 
         stepif_debug(D_DEBUG, "Attempting to read %d bytes\n", retval->extra_len);
-        read(stepif_rsp_fd, *in_data, retval->extra_len);
+        total = stepif_read_all(stepif_rsp_fd, extra, retval->extra_len);
+        if(total != retval->extra_len)
+            stepif_debug(D_DEBUG, "Short read of extra data: %d\n", total);
+
+        if(in_data)
+            *in_data = extra;
+        else
+            free(extra);
     }
 
     return retval->response_status;
@@ -616,54 +1127,603 @@ int fixup_line(uint16_t addr, char **line) {
         }
         src++;
     }
-    *dst = '\0';
-
-    newline = (char*)error_malloc(line_size);
-    memset(newline, 0, line_size);
+    *dst = '\0';
+
+    newline = (char*)error_malloc(line_size);
+    memset(newline, 0, line_size);
+
+    start = *line;
+    token = strsep(&start, "\t ");
+    if(!token) {
+        *line = newline;
+        return 0;
+    }
+
+    if(debuginfo_lookup_addr(addr, &label)) {
+        sprintf(newline, "%-14s", label);
+        if(is_opcode(token)) {
+            strcat(newline, token);
+        } else {
+            if((strcasecmp(label, token) == 0) ||
+               ((strlen(token) == strlen(label) + 1) &&
+                (strncasecmp(label, token, strlen(token)) == 0))) {
+                /* token is the label... ignore it */
+            } else {
+                /* token is something else... .db directive, etc */
+                snprintf(&newline[strlen(newline)], line_size - strlen(newline), "%s", token);
+            }
+        }
+    } else {
+        sprintf(newline, "              %s", token);
+    }
+
+    while((token = strsep(&start, " ")) != NULL) {
+        strncat(newline, " ", line_size - strlen(newline));
+        strncat(newline, token, line_size - strlen(newline));
+    }
+
+    /* append the comments at 28 */
+    while(strlen(newline) < 35) {
+        strcat(newline, " ");
+    }
+
+    /* snprintf(&newline[strlen(newline)], line_size - strlen(newline), "%*s", (int)30 - strlen(newline), ""); */
+    if(comment) {
+        strncat(newline, ";", line_size - strlen(newline));
+        strncat(newline, comment, line_size - strlen(newline));
+    }
+
+    *line = newline;
+    return 1;
+}
+
+/**
+ * forget the shadow copy of emulator state, so the next window
+ * refresh fetches it again
+ */
+void stepif_shadow_invalidate(void) {
+    memset(stepif_shadow_valid, 0, sizeof(stepif_shadow_valid));
+    stepif_shadow_regs_valid = 0;
+}
+
+/*
+ * private
+ *
+ * add a range to a range list, merging it with the last one if
+ * they touch.  Ranges are clipped at $ffff.
+ */
+static int stepif_shadow_add(dbg_range_t *ranges, int count,
+                             uint16_t addr, uint32_t len) {
+    dbg_range_t *last = count ? &ranges[count - 1] : NULL;
+
+    if(len > 0x10000 - addr)
+        len = 0x10000 - addr;
+
+    if(!len)
+        return count;
+
+    if(last && ((uint32_t)last->addr + last->len == addr) &&
+       ((uint32_t)last->len + len <= 0xffff)) {
+        last->len += len;
+        return count;
+    }
+
+    if(count == STEPIF_MAX_RANGES)
+        return count;
+
+    ranges[count].addr = addr;
+    ranges[count].len = len;
+    return count + 1;
+}
+
+/*
+ * private
+ *
+ * the memory the windows are currently showing
+ */
+static int stepif_shadow_ranges(dbg_range_t *ranges) {
+    int count = 0;
+    int line;
+    uint16_t addr;
+    const void *addrp;
+
+    count = stepif_shadow_add(ranges, count, 0x0100, 256);
+
+    switch(stepif_display_mode) {
+    case DISPLAY_MODE_DUMP:
+        count = stepif_shadow_add(ranges, count, stepif_dump_addr,
+                                  16 * (pdisplay->height - 2));
+        break;
+    case DISPLAY_MODE_DISASM:
+        count = stepif_shadow_add(ranges, count, stepif_disassemble_addr,
+                                  3 * (pdisplay->height - 2));
+        break;
+    case DISPLAY_MODE_WATCH:
+        addr = stepif_watch_addr;
+        for(line = 0; line < pdisplay->height - 2; line++) {
+            addrp = rblookup(RB_LUGTEQ, (void*)&addr, stepif_watches);
+            if(!addrp)
+                break;
+            addr = *(uint16_t*)addrp;
+            count = stepif_shadow_add(ranges, count, addr, 1);
+            addr++;
+        }
+        break;
+    }
+
+    return count;
+}
+
+/**
+ * map the emulator's shared memory view, if it has one, so
+ * RAM and registers can be read without asking
+ */
+void stepif_shm_attach(void) {
+    dbg_command_t command;
+    dbg_response_t response;
+    uint8_t *data = NULL;
+    void *segment;
+    int fd;
+
+    if(!(stepif_remote_caps & CAP_SHM))
+        return;
+
+    memset((void*)&command, 0, sizeof(command));
+    command.cmd = CMD_SHM;
+    if(stepif_command(&command, NULL, &response, &data) != RESPONSE_OK) {
+        if(data)
+            free(data);
+        return;
+    }
+
+    fd = shm_open((char*)data, O_RDONLY, 0);
+    if(fd == -1) {
+        tui_putstring(pcommand, " Can't open shared memory %s\n", (char*)data);
+        free(data);
+        return;
+    }
+
+    segment = mmap(NULL, SHM_HEADER_SIZE + SHM_IMAGE_SIZE, PROT_READ,
+                   MAP_SHARED, fd, 0);
+    close(fd);
+
+    if((segment == MAP_FAILED) ||
+       (((shm_header_t*)segment)->magic != SHM_MAGIC) ||
+       (((shm_header_t*)segment)->version != SHM_VERSION)) {
+        tui_putstring(pcommand, " Can't use shared memory %s\n", (char*)data);
+        if(segment != MAP_FAILED)
+            munmap(segment, SHM_HEADER_SIZE + SHM_IMAGE_SIZE);
+        free(data);
+        return;
+    }
+
+    stepif_shm = (shm_header_t*)segment;
+    tui_putstring(pcommand, " Using shared memory %s\n", (char*)data);
+    free(data);
+}
+
+/*
+ * private
+ *
+ * fill the shadow from the shared view: shared pages in the
+ * ranges, and the registers if they can be read consistently
+ */
+static void stepif_shadow_from_shm(dbg_range_t *ranges, int count) {
+    uint32_t seq;
+    cpu_t cpu;
+    uint32_t page;
+    int x;
+
+    for(x = 0; x < count; x++) {
+        for(page = ranges[x].addr >> 8;
+            page <= (((uint32_t)ranges[x].addr + ranges[x].len - 1) >> 8); page++) {
+            if(!(stepif_shm->page_flags[page] & SHM_PAGE_RAM))
+                continue;
+            memcpy(&stepif_shadow[page << 8], SHM_IMAGE(stepif_shm) + (page << 8), 256);
+            memset(&stepif_shadow_valid[page * 32], 0xff, 32);
+        }
+    }
+
+    for(x = 0; x < 4; x++) {
+        seq = __atomic_load_n(&stepif_shm->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1)
+            continue;
+        memcpy(&cpu, (void*)&stepif_shm->cpu, sizeof(cpu_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&stepif_shm->seq, __ATOMIC_RELAXED) == seq) {
+            memcpy((void*)&stepif_state, &cpu, sizeof(cpu_t));
+            stepif_shadow_regs_valid = 1;
+            return;
+        }
+    }
+}
+
+/*
+ * private
+ *
+ * fetch registers and ranges one command at a time, for
+ * emulators without CMD_READMULTI
+ */
+static int stepif_shadow_fetch_each(dbg_range_t *ranges, int count) {
+    dbg_command_t command;
+    dbg_response_t response;
+    uint8_t *data = NULL;
+    int x;
+
+    memset((void*)&command, 0, sizeof(command));
+    command.cmd = CMD_REGS;
+    if(stepif_command(&command, NULL, &response, &data) != RESPONSE_OK) {
+        if(data)
+            free(data);
+        return RESPONSE_ERROR;
+    }
+
+    memcpy((void*)&stepif_state, (void*)data, sizeof(cpu_t));
+    free(data);
+
+    for(x = 0; x < count; x++) {
+        data = NULL;
+        command.cmd = CMD_READMEM;
+        command.param1 = ranges[x].addr;
+        command.param2 = ranges[x].len;
+        if(stepif_command(&command, NULL, &response, &data) != RESPONSE_OK) {
+            if(data)
+                free(data);
+            return RESPONSE_ERROR;
+        }
+
+        memcpy(&stepif_shadow[ranges[x].addr], data, ranges[x].len);
+        free(data);
+    }
+
+    return RESPONSE_OK;
+}
+
+/**
+ * make sure the shadow copy has the registers and everything
+ * the windows show, fetching it in one CMD_READMULTI if not
+ *
+ * @returns RESPONSE_OK, or RESPONSE_ERROR if the fetch failed
+ */
+int stepif_shadow_sync(void) {
+    dbg_range_t ranges[STEPIF_MAX_RANGES];
+    dbg_command_t command;
+    dbg_response_t response;
+    uint8_t *data = NULL;
+    uint8_t *in;
+    int count;
+    int stale;
+    int result;
+    int x;
+    uint32_t addr;
+
+    count = stepif_shadow_ranges(ranges);
+    if(stepif_shm)
+        stepif_shadow_from_shm(ranges, count);
+    stale = !stepif_shadow_regs_valid;
+
+    for(x = 0; (x < count) && !stale; x++) {
+        for(addr = ranges[x].addr; addr < (uint32_t)ranges[x].addr + ranges[x].len; addr++) {
+            if(!(stepif_shadow_valid[addr >> 3] & (1 << (addr & 7)))) {
+                stale = 1;
+                break;
+            }
+        }
+    }
+
+    if(!stale)
+        return RESPONSE_OK;
+
+    result = RESPONSE_ERROR;
+    if(stepif_remote_caps & CAP_READMULTI) {
+        memset((void*)&command, 0, sizeof(command));
+        command.cmd = CMD_READMULTI;
+        command.param1 = READMULTI_REGS;
+        command.param2 = count;
+        command.extra_len = count * sizeof(dbg_range_t);
+
+        result = stepif_command(&command, (uint8_t*)ranges, &response, &data);
+        if(result == RESPONSE_OK) {
+            in = data;
+            memcpy((void*)&stepif_state, in, sizeof(cpu_t));
+            in += sizeof(cpu_t);
+            for(x = 0; x < count; x++) {
+                memcpy(&stepif_shadow[ranges[x].addr], in, ranges[x].len);
+                in += ranges[x].len;
+            }
+        }
+
+        if(data)
+            free(data);
+    }
+
+    if(result != RESPONSE_OK)
+        result = stepif_shadow_fetch_each(ranges, count);
+
+    if(result != RESPONSE_OK)
+        return result;
+
+    stepif_shadow_regs_valid = 1;
+    for(x = 0; x < count; x++) {
+        for(addr = ranges[x].addr; addr < (uint32_t)ranges[x].addr + ranges[x].len; addr++)
+            stepif_shadow_valid[addr >> 3] |= (1 << (addr & 7));
+    }
+
+    return RESPONSE_OK;
+}
+
+/**
+ * refresh the windows that track cpu state
+ */
+void stepif_refresh_state(void) {
+    tui_refresh(pregisters);
+    tui_refresh(pstack);
+    if((stepif_display_mode == DISPLAY_MODE_DISASM) && (stepif_display_track)) {
+        stepif_disassemble_addr = stepif_state.ip;
+        tui_refresh(pdisplay);
+    }
+}
+
+/**
+ * read any pending async messages, without blocking
+ */
+void stepif_drain_async(void) {
+    fd_blocking(stepif_asy_fd, 0);
+    while(stepif_process_message(stepif_asy_fd) == RESPONSE_OK);
+    fd_blocking(stepif_asy_fd, 1);
+}
+
+/**
+ * ask for (or stop) live register and dirty page events
+ * from the emulator, at the rate we'd otherwise poll
+ *
+ * @param live 1 while free-running with follow on, 0 otherwise
+ */
+void stepif_subscribe(int live) {
+    dbg_command_t command;
+    dbg_response_t response;
+
+    if(!(stepif_remote_caps & CAP_SUBSCRIBE))
+        return;
+
+    memset((void*)&command, 0, sizeof(command));
+    command.cmd = CMD_SUBSCRIBE;
+    command.param1 = SUB_STOPPED | SUB_WATCH;
+    if(live)
+        command.param1 |= SUB_REGS | SUB_DIRTY;
+    command.param2 = 1000 / STEPIF_RUN_POLL_MS;
+
+    if(stepif_command(&command, NULL, &response, NULL) == RESPONSE_OK)
+        stepif_subscribed = live;
+}
+
+/**
+ * halt an emulator-side free run
+ */
+void stepif_halt(void) {
+    dbg_command_t command;
+    dbg_response_t response;
+    uint8_t *data = NULL;
+
+    memset((void*)&command, 0, sizeof(command));
+    command.cmd = CMD_STEP;
+
+    if(stepif_command(&command, NULL, &response, &data) == RESPONSE_OK && data) {
+        memcpy((void*)&stepif_state, (void*)data, sizeof(cpu_t));
+    }
+
+    if(data)
+        free(data);
+
+    /* the stop notification is already queued */
+    stepif_drain_async();
+    stepif_remote_running = 0;
+    if(stepif_subscribed)
+        stepif_subscribe(0);
+    stepif_refresh_state();
+}
+
+/**
+ * wait for async messages (the stop notification, mostly) while
+ * the emulator free-runs, refreshing registers now and then
+ */
+void stepif_wait_running(void) {
+    fd_set readset;
+    struct timeval timeout;
+
+    /* queued behind a response, select won't see them */
+    if(stepif_async_head) {
+        stepif_drain_async();
+        return;
+    }
+
+    FD_ZERO(&readset);
+    FD_SET(stepif_asy_fd, &readset);
+    FD_SET(STDIN_FILENO, &readset);
+
+    timeout.tv_sec = 0;
+    timeout.tv_usec = STEPIF_RUN_POLL_MS * 1000;
+
+    if(select(stepif_asy_fd + 1, &readset, NULL, NULL, &timeout) <= 0) {
+        /* subscribed clients get pushed frames instead */
+        if(!stepif_follow_on_run || stepif_subscribed)
+            return;
+
+        stepif_shadow_invalidate();
+        stepif_refresh_state();
+        return;
+    }
+
+    if(FD_ISSET(stepif_asy_fd, &readset))
+        stepif_drain_async();
+}
+
+/**
+ * run one of the emulator-side stepping commands, and update
+ * the display once with where it stopped
+ *
+ * @param cmd CMD_STEPN, CMD_STEPOVER, CMD_STEPOUT or CMD_RUNUNTIL
+ * @param param1 command param1
+ * @param param2 command param2
+ * @param extra extra data, or NULL
+ * @param len length of extra data
+ */
+void stepif_step_remote(uint8_t cmd, uint16_t param1, uint16_t param2,
+                        uint8_t *extra, uint16_t len) {
+    dbg_command_t command;
+    dbg_response_t response;
+    uint8_t *data = NULL;
+
+    memset((void*)&command, 0, sizeof(command));
+    command.cmd = cmd;
+    command.param1 = param1;
+    command.param2 = param2;
+    command.extra_len = len;
+
+    if(stepif_command(&command, extra, &response, &data) != RESPONSE_OK) {
+        tui_putstring(pcommand, " Step failed: %s\n", data ? (char*)data : "");
+        if(data)
+            free(data);
+        return;
+    }
+
+    if(data && (response.extra_len == sizeof(cpu_t)))
+        memcpy((void*)&stepif_state, (void*)data, sizeof(cpu_t));
+    if(data)
+        free(data);
+
+    if(response.extra_len != sizeof(cpu_t)) {
+        /* too long to wait for: it runs until ASYNC_STOPPED */
+        if(stepif_follow_on_run)
+            stepif_subscribe(1);
+        stepif_remote_running = 1;
+        stepif_running = 1;
+        tui_window_nodelay(pcommand);
+        tui_putstring(pcommand, " Running: <ENTER> to stop\n");
+        return;
+    }
+
+    switch(response.response_value) {
+    case STOP_WATCH:
+        stepif_drain_async();
+        break;
+    case STOP_BREAK:
+        tui_putstring(pcommand, " Breakpoint $%04x reached\n", stepif_state.ip);
+        break;
+    case STOP_LIMIT:
+        if(cmd != CMD_STEPN)
+            tui_putstring(pcommand, " Gave up at $%04x\n", stepif_state.ip);
+        break;
+    }
+
+    stepif_refresh_state();
+}
+
+/**
+ * search emulator memory, for "find <$start> <$end> <item>...".
+ * Each item is a "string" (no spaces), w:<$value> for a 16 bit
+ * value, ?? for any byte, or a byte value.
+ *
+ * @param argc number of args, including "find"
+ * @param argv args
+ */
+void stepif_find(int argc, char **argv) {
+    dbg_command_t command;
+    dbg_response_t response;
+    uint8_t *data = NULL;
+    uint8_t extra[sizeof(dbg_search_t) + 512];
+    uint8_t pattern[256];
+    uint8_t mask[256];
+    dbg_search_t *search = (dbg_search_t*)extra;
+    uint16_t start, end, value;
+    uint16_t *matches;
+    int len = 0;
+    int masked = 0;
+    int arg;
+    int index;
+    char *item;
+
+    if(!(stepif_remote_caps & CAP_SEARCH)) {
+        stepif_debug(D_ERROR, "Emulator does not support find\n");
+        return;
+    }
 
-    start = *line;
-    token = strsep(&start, "\t ");
-    if(!token) {
-        *line = newline;
-        return 0;
+    if((argc < 4) || !stepif_eval(argv[1], &start) || !stepif_eval(argv[2], &end)) {
+        stepif_debug(D_ERROR, "Usage: find <$start> <$end> <\"str\"|w:$val|??|$byte>...\n");
+        return;
     }
 
-    if(debuginfo_lookup_addr(addr, &label)) {
-        sprintf(newline, "%-14s", label);
-        if(is_opcode(token)) {
-            strcat(newline, token);
-        } else {
-            if((strcasecmp(label, token) == 0) ||
-               ((strlen(token) == strlen(label) + 1) &&
-                (strncasecmp(label, token, strlen(token)) == 0))) {
-                /* token is the label... ignore it */
-            } else {
-                /* token is something else... .db directive, etc */
-                snprintf(&newline[strlen(newline)], line_size - strlen(newline), "%s", token);
+    for(arg = 3; arg < argc; arg++) {
+        item = argv[arg];
+        if(item[0] == '"') {
+            for(index = 1; item[index] && (item[index] != '"') && (len < sizeof(pattern)); index++) {
+                pattern[len] = item[index];
+                mask[len++] = 0xff;
             }
+        } else if(strcmp(item, "??") == 0) {
+            if(len < sizeof(pattern)) {
+                pattern[len] = 0;
+                mask[len++] = 0;
+                masked = 1;
+            }
+        } else if((strncasecmp(item, "w:", 2) == 0) && stepif_eval(&item[2], &value)) {
+            if(len + 2 <= sizeof(pattern)) {
+                pattern[len] = value & 0xff;
+                mask[len++] = 0xff;
+                pattern[len] = value >> 8;
+                mask[len++] = 0xff;
+            }
+        } else if(stepif_eval(item, &value)) {
+            if(len < sizeof(pattern)) {
+                pattern[len] = value & 0xff;
+                mask[len++] = 0xff;
+            }
+        } else {
+            stepif_debug(D_ERROR, "Invalid search item: %s\n", item);
+            return;
         }
-    } else {
-        sprintf(newline, "              %s", token);
     }
 
-    while((token = strsep(&start, " ")) != NULL) {
-        strncat(newline, " ", line_size - strlen(newline));
-        strncat(newline, token, line_size - strlen(newline));
+    if(!len) {
+        stepif_debug(D_ERROR, "Empty search pattern\n");
+        return;
     }
 
-    /* append the comments at 28 */
-    while(strlen(newline) < 35) {
-        strcat(newline, " ");
+    search->flags = masked ? SEARCH_MASK : 0;
+    search->len = len;
+    memcpy(extra + sizeof(dbg_search_t), pattern, len);
+    if(masked)
+        memcpy(extra + sizeof(dbg_search_t) + len, mask, len);
+
+    memset((void*)&command, 0, sizeof(command));
+    command.cmd = CMD_SEARCH;
+    command.param1 = start;
+    command.param2 = end;
+    command.extra_len = sizeof(dbg_search_t) + (masked ? len * 2 : len);
+
+    if(stepif_command(&command, extra, &response, &data) != RESPONSE_OK) {
+        tui_putstring(pcommand, " Find failed: %s\n", data ? (char*)data : "");
+        if(data)
+            free(data);
+        return;
     }
 
-    /* snprintf(&newline[strlen(newline)], line_size - strlen(newline), "%*s", (int)30 - strlen(newline), ""); */
-    if(comment) {
-        strncat(newline, ";", line_size - strlen(newline));
-        strncat(newline, comment, line_size - strlen(newline));
+    tui_putstring(pcommand, " %d match%s\n", response.response_value,
+                  response.response_value == 1 ? "" : "es");
+
+    matches = (uint16_t*)data;
+    for(index = 0; index < response.extra_len / sizeof(uint16_t); index++) {
+        tui_putstring(pcommand, " $%04x", matches[index]);
+        if(((index & 7) == 7) || (index == response.extra_len / sizeof(uint16_t) - 1))
+            tui_putstring(pcommand, "\n");
     }
 
-    *line = newline;
-    return 1;
+    if(response.response_value > response.extra_len / sizeof(uint16_t))
+        tui_putstring(pcommand, " (first %d shown)\n",
+                      (int)(response.extra_len / sizeof(uint16_t)));
+
+    if(data)
+        free(data);
 }
 
 /**
@@ -682,6 +1742,14 @@ void process_command(char *cmd) {
     uint16_t temp;
     uint16_t old_ip = stepif_state.ip;
     static int stall_count = 0;
+    dbg_stats_t *stats;
+    dbg_stats_device_t *device;
+    char cond_expr[256];
+    uint8_t cond_code[BC_MAX_LEN];
+    int cond_len;
+    uint16_t cond_count;
+    uint64_t cycles;
+    int x;
 
     memset((void*)&command, 0, sizeof(command));
     memset((void*)&response, 0, sizeof(response));
@@ -696,6 +1764,10 @@ void process_command(char *cmd) {
     stepif_debug(D_DEBUG, "Processing command\n");
     token = get_token(argv[0]);
 
+    /* a free-running emulator changes everything under us */
+    if(stepif_remote_running)
+        stepif_shadow_invalidate();
+
     switch(token) {
     case TOK_VERSION:
         command.cmd = CMD_VER;
@@ -737,22 +1809,52 @@ void process_command(char *cmd) {
         break;
 
     case TOK_LOAD:
-        if(argc != 3) {
-            stepif_debug(D_ERROR, "Usage: load <file> <$addr>\n");
+        if((argc < 2) || (argc > 3) ||
+           ((argc == 2) && !(stepif_remote_caps & CAP_LOAD))) {
+            stepif_debug(D_ERROR, "Usage: load <file> [$addr]\n");
             break;
         }
 
-        if(!stepif_eval(argv[2], &temp)) {
+        temp = 0;
+        if((argc == 3) && !stepif_eval(argv[2], &temp)) {
             stepif_debug(D_ERROR, "Invalid address\n");
             break;
         }
 
-        FILE *infile;
+        FILE *infile = NULL;
         size_t bytes_read;
         uint8_t *extra_data=NULL;
+        char *load_path = NULL;
+
+        if(stepif_remote_caps & CAP_LOAD) {
+            /* the emulator reads it, from its own working directory */
+            if(argv[1][0] == '/') {
+                load_path = strdup(argv[1]);
+            } else {
+                char *cwd = getcwd(NULL, 0);
+                asprintf(&load_path, "%s/%s", cwd ? cwd : ".", argv[1]);
+                free(cwd);
+            }
+
+            command.cmd = CMD_LOAD;
+            command.param1 = temp;
+            command.extra_len = strlen(load_path) + 1;
+            if(stepif_command(&command, (uint8_t*)load_path, &response, &extra_data) == RESPONSE_OK &&
+               extra_data && (response.extra_len == sizeof(dbg_load_t))) {
+                tui_putstring(pcommand, " Loaded %d bytes, entry $%04x\n",
+                              ((dbg_load_t*)extra_data)->bytes,
+                              ((dbg_load_t*)extra_data)->entry);
+            } else {
+                tui_putstring(pcommand, " Error loading: %s\n",
+                              extra_data ? (char*)extra_data : "no response");
+            }
 
-        infile = fopen(argv[1], "r");
-        if(!infile) {
+            free(load_path);
+            if(extra_data) {
+                free(extra_data);
+                extra_data = NULL;
+            }
+        } else if(!(infile = fopen(argv[1], "r"))) {
             tui_putstring(pcommand, " Error loading: %s\n", strerror(errno));
         } else {
             data = malloc(1024);
@@ -839,11 +1941,33 @@ void process_command(char *cmd) {
         break;
 
     case TOK_NEXT:
+        /* next <n> runs all n in the emulator */
+        if((argc > 1) && (stepif_remote_caps & CAP_STEPN)) {
+            x = atoi(argv[1]);
+            if(x < 1) {
+                stepif_debug(D_ERROR, "Usage: next [<count>]\n");
+                break;
+            }
+            stepif_step_remote(CMD_STEPN, x & 0xFFFF, (uint32_t)x >> 16, NULL, 0);
+            break;
+        }
+
         old_ip = stepif_state.ip;
 
         command.cmd = CMD_NEXT;
-        stepif_command(&command, NULL, &response, &data);
-        memcpy((void*)&stepif_state, (void*)data, sizeof(cpu_t));
+        if(stepif_command(&command, NULL, &response, &data) != RESPONSE_OK) {
+            /* e.g. the emulator is running: data is the error */
+            tui_putstring(pcommand, " Step failed: %s\n", data ? (char*)data : "");
+            if(data)
+                free(data);
+            stepif_running = 0;
+            break;
+        }
+
+        if(data && (response.extra_len == sizeof(cpu_t)))
+            memcpy((void*)&stepif_state, (void*)data, sizeof(cpu_t));
+        if(data)
+            free(data);
 
         if ((stepif_state.ip == old_ip) && (stepif_running)) {
             stall_count++;
@@ -864,6 +1988,13 @@ void process_command(char *cmd) {
             }
         }
 
+        if (response.response_value == STOP_WATCH) {
+            stepif_running = 0;
+            stepif_drain_async();
+            tui_refresh(pregisters);
+            tui_refresh(pstack);
+        }
+
         if (breakpoint_is_set(stepif_state.ip) && stepif_running) {
             stepif_running = 0;
             tui_putstring(pcommand, " Breakpoint $%04x reached\n", stepif_state.ip);
@@ -878,21 +2009,62 @@ void process_command(char *cmd) {
 
     case TOK_BREAK:
         /* allow break with no arg to break on current line */
-        if(argc > 2) {
-            stepif_debug(D_ERROR, "Usage: break [<$addr>]\n");
-            break;
-        }
+        temp = stepif_state.ip;
+        cond_count = 0;
+        cond_len = 0;
+        x = 1;
 
-        if(argc == 1) {
-            temp = stepif_state.ip;
-        } else {
+        if((argc > 1) && strcasecmp(argv[1], "if") && strcasecmp(argv[1], "count")) {
             if(!stepif_eval(argv[1], &temp)) {
                 stepif_debug(D_ERROR, "Invalid addr\n");
                 break;
             }
+            x++;
         }
 
-        if (breakpoint_is_set((uint16_t)temp)) {
+        /* break [<$addr>] [if <expr>] [count <n>] */
+        cond_expr[0] = '\0';
+        while(x < argc) {
+            if(strcasecmp(argv[x], "count") == 0 && (x + 1 < argc)) {
+                cond_count = (uint16_t)atoi(argv[x + 1]);
+                x += 2;
+            } else if(strcasecmp(argv[x], "if") == 0) {
+                for(x++; (x < argc) && strcasecmp(argv[x], "count"); x++) {
+                    strncat(cond_expr, argv[x], sizeof(cond_expr) - strlen(cond_expr) - 2);
+                    strcat(cond_expr, " ");
+                }
+            } else {
+                break;
+            }
+        }
+
+        if(x < argc) {
+            stepif_debug(D_ERROR, "Usage: break [<$addr>] [if <expr>] [count <n>]\n");
+            break;
+        }
+
+        if(cond_expr[0]) {
+            cond_len = stepif_compile_condition(cond_expr, cond_code);
+            if(cond_len < 0) {
+                stepif_debug(D_ERROR, "Invalid condition\n");
+                break;
+            }
+        }
+
+        if(cond_len || cond_count) {
+            if(!(stepif_remote_caps & CAP_BP)) {
+                stepif_debug(D_ERROR, "Emulator does not support conditional breakpoints\n");
+                break;
+            }
+
+            if(breakpoint_add_condition((uint16_t)temp, cond_count,
+                                        cond_len ? cond_code : NULL,
+                                        cond_len) != RESPONSE_OK) {
+                stepif_debug(D_ERROR, "Emulator rejected the condition\n");
+                break;
+            }
+            tui_putstring(pcommand, " Conditional breakpoint set\n");
+        } else if (breakpoint_is_set((uint16_t)temp)) {
             breakpoint_remove((uint16_t)temp);
             tui_putstring(pcommand, " Breakpoint unset\n");
         } else {
@@ -907,6 +2079,17 @@ void process_command(char *cmd) {
 
     case TOK_RUN:
         if(stepif_remote_caps & CAP_RUN) {
+            if(stepif_follow_on_run)
+                stepif_subscribe(1);
+
+            command.cmd = CMD_RUN;
+            if(stepif_command(&command, NULL, &response, &data) != RESPONSE_OK) {
+                tui_putstring(pcommand, " Run failed: %s\n", data ? (char*)data : "");
+                if(stepif_subscribed)
+                    stepif_subscribe(0);
+                break;
+            }
+            stepif_remote_running = 1;
         }
 
         stepif_running = 1;
@@ -915,6 +2098,38 @@ void process_command(char *cmd) {
         tui_putstring(pcommand, " Free-running: <ENTER> to stop\n");
         break;
 
+    case TOK_OVER:
+    case TOK_OUT:
+    case TOK_UNTIL:
+        if(!(stepif_remote_caps & CAP_STEPN)) {
+            stepif_debug(D_ERROR, "Emulator does not support %s\n", tokens[token]);
+            break;
+        }
+
+        if(token == TOK_OVER) {
+            stepif_step_remote(CMD_STEPOVER, STEPIF_STEP_LIMIT & 0xFFFF,
+                               STEPIF_STEP_LIMIT >> 16, NULL, 0);
+        } else if(token == TOK_OUT) {
+            stepif_step_remote(CMD_STEPOUT, STEPIF_STEP_LIMIT & 0xFFFF,
+                               STEPIF_STEP_LIMIT >> 16, NULL, 0);
+        } else if((argc == 3) && (strcasecmp(argv[1], "cycles") == 0)) {
+            /* until cycles <n> */
+            cycles = strtoull(argv[2], NULL, 0);
+            if(!cycles) {
+                stepif_debug(D_ERROR, "Invalid cycle count\n");
+                break;
+            }
+            stepif_step_remote(CMD_RUNUNTIL, PARAM_UNTIL_CYCLES, 0,
+                               (uint8_t*)&cycles, sizeof(cycles));
+        } else if((argc == 2) && stepif_eval(argv[1], &temp)) {
+            cycles = STEPIF_STEP_LIMIT * 8;
+            stepif_step_remote(CMD_RUNUNTIL, PARAM_UNTIL_ADDR | PARAM_UNTIL_CYCLES,
+                               temp, (uint8_t*)&cycles, sizeof(cycles));
+        } else {
+            stepif_debug(D_ERROR, "Usage: until <$addr> | until cycles <n>\n");
+        }
+        break;
+
     case TOK_FOLLOW:
         stepif_follow_on_run = !stepif_follow_on_run;
         tui_putstring(pcommand, " Follow mode is now %s\n",
@@ -939,8 +2154,8 @@ void process_command(char *cmd) {
         break;
 
     case TOK_WATCH:
-        if (argc != 2) {
-            stepif_debug(D_ERROR, "Usage: watch <addr>\n");
+        if ((argc != 2) && (argc != 3)) {
+            stepif_debug(D_ERROR, "Usage: watch <addr> [r|w|c|-]\n");
             break;
         }
 
@@ -949,8 +2164,46 @@ void process_command(char *cmd) {
             break;
         }
 
-        if (watch_is_set((uint16_t)temp)) {
+        if (argc == 3) {
+            /* emulator-side watchpoint */
+            if(!(stepif_remote_caps & CAP_WATCH)) {
+                stepif_debug(D_ERROR, "Emulator does not support watchpoints\n");
+                break;
+            }
+
+            command.cmd = CMD_WATCH;
+            command.param1 = PARAM_WATCH_SET;
+            command.param2 = temp;
+            for(char *p = argv[2]; *p; p++) {
+                switch(*p) {
+                case 'r':
+                    command.param1 |= WATCH_READ;
+                    break;
+                case 'w':
+                    command.param1 |= WATCH_WRITE;
+                    break;
+                case 'c':
+                    command.param1 |= WATCH_CHANGE;
+                    break;
+                case '-':
+                    command.param1 = (command.param1 & 0xF0) | PARAM_WATCH_DEL;
+                    break;
+                }
+            }
+
+            stepif_command(&command, NULL, &response, &data);
+            if((command.param1 & 0x0F) == PARAM_WATCH_DEL) {
+                watch_remove((uint16_t)temp);
+                tui_putstring(pcommand, " Watchpoint unset\n");
+            } else {
+                if(!watch_is_set((uint16_t)temp))
+                    watch_add((uint16_t)temp);
+                tui_putstring(pcommand, " Watchpoint set\n");
+            }
+        } else if (watch_is_set((uint16_t)temp)) {
             watch_remove((uint16_t)temp);
+            if(stepif_remote_caps & CAP_WATCH)
+                stepif_simple_command(CMD_WATCH, PARAM_WATCH_DEL, temp, NULL, 0);
             tui_putstring(pcommand, " Watch unset\n");
         } else {
             watch_add((uint16_t)temp);
@@ -976,6 +2229,52 @@ void process_command(char *cmd) {
             stepif_debug(D_ERROR, "Radix must be 10 or 16\n");
         break;
 
+    case TOK_STATS:
+        command.cmd = CMD_STATS;
+        if((result = stepif_command(&command, NULL, &response, &data)) != RESPONSE_OK) {
+            stepif_debug(D_ERROR, "Emulator does not support stats\n");
+            break;
+        }
+
+        if(response.extra_len < sizeof(dbg_stats_t))
+            break;
+
+        stats = (dbg_stats_t*)data;
+        tui_putstring(pcommand, " %llu instructions, %llu cycles, %llu irqs\n",
+                      (unsigned long long)stats->instructions,
+                      (unsigned long long)stats->cycles,
+                      (unsigned long long)stats->irqs);
+        tui_putstring(pcommand, " %d.%03d MHz, %llu ms cpu in %llu ms\n",
+                      stats->khz / 1000, stats->khz % 1000,
+                      (unsigned long long)stats->cpu_usec / 1000,
+                      (unsigned long long)stats->wall_usec / 1000);
+        if(stats->target_khz)
+            tui_putstring(pcommand, " paced at %d.%03d MHz, drift %lld us, "
+                          "%llu late slices, %llu resyncs\n",
+                          stats->target_khz / 1000, stats->target_khz % 1000,
+                          (long long)stats->drift_usec,
+                          (unsigned long long)stats->late_slices,
+                          (unsigned long long)stats->resyncs);
+
+        device = (dbg_stats_device_t*)(data + sizeof(dbg_stats_t));
+        for(temp = 0; temp < stats->devices; temp++) {
+            if(response.extra_len < sizeof(dbg_stats_t) +
+               ((temp + 1) * sizeof(dbg_stats_device_t)))
+                break;
+
+            tui_putstring(pcommand, " %-16.16s r:%llu w:%llu rx:%llu tx:%llu\n",
+                          device[temp].name,
+                          (unsigned long long)device[temp].reads,
+                          (unsigned long long)device[temp].writes,
+                          (unsigned long long)device[temp].rx_bytes,
+                          (unsigned long long)device[temp].tx_bytes);
+        }
+        break;
+
+    case TOK_FIND:
+        stepif_find(argc, argv);
+        break;
+
     case TOK_AMBIGUOUS:
         tui_putstring(pcommand, " Ambiguous command\n");
         break;
@@ -995,39 +2294,28 @@ void process_command(char *cmd) {
 }
 
 void display_update_dump(void) {
-    int result;
-    dbg_command_t command;
-    dbg_response_t response;
     uint8_t *data;
+    uint32_t len;
     uint8_t line;
     int pos;
 
     if(stepif_display_mode != DISPLAY_MODE_DUMP)
         return;
 
-    memset((void*)&command, 0, sizeof(command));
-    memset((void*)&response, 0, sizeof(response));
-
-    command.cmd = CMD_READMEM;
-    command.param1 = stepif_dump_addr;
-
-    if(16 * (pdisplay->height - 2) > 0xffff)
-        command.param2 = 0xffff - command.param1;
-    else
-        command.param2 = 16 * (pdisplay->height - 2);
-
-    stepif_debug(D_DEBUG, "Asking for $%04x bytes\n", command.param2);
-
-    result = stepif_command(&command, NULL, &response, &data);
-    if(response.response_status == RESPONSE_ERROR)
+    if(stepif_shadow_sync() != RESPONSE_OK)
         return;
 
+    data = &stepif_shadow[stepif_dump_addr];
+    len = 16 * (pdisplay->height - 2);
+    if(len > 0x10000 - stepif_dump_addr)
+        len = 0x10000 - stepif_dump_addr;
+
     tui_setpos(pdisplay, 0, 1);
     for(line = 0; line < (pdisplay->height - 2); line++) {
         if(stepif_dump_addr + (line * 16) <= 0xffff) {
             tui_putstring(pdisplay, "     %04x: ", stepif_dump_addr + (line * 16));
             for(pos = 0; pos < 16; pos++) {
-                if((line*16 + pos)  < command.param2) {
+                if((line*16 + pos)  < len) {
                     if(watch_is_set(line * 16 + pos + stepif_dump_addr))
                         tui_setcolor(pdisplay, 1);
                     tui_putstring(pdisplay, "%02x", data[(line * 16) + pos]);
@@ -1043,7 +2331,7 @@ void display_update_dump(void) {
                 if(watch_is_set(line * 16 + pos + stepif_dump_addr))
                     tui_setcolor(pdisplay, 1);
 
-                if((line*16 + pos)  < command.param2) {
+                if((line*16 + pos)  < len) {
                     tui_putstring(pdisplay, "%c", xlat[data[(line * 16) + pos]]);
                 tui_resetcolor(pdisplay);
                 }
@@ -1052,8 +2340,6 @@ void display_update_dump(void) {
 
         tui_putstring(pdisplay,"\n");
     }
-
-    free(data);
 }
 
 
@@ -1061,18 +2347,16 @@ void display_update_dump(void) {
  * update the watch display
  */
 void display_update_watch(void) {
-    int result;
-    dbg_command_t command;
-    dbg_response_t response;
-    uint8_t *data;
     uint8_t line;
     uint16_t addr;
     const void *addrp;
-    uint8_t value;
 
     if(stepif_display_mode != DISPLAY_MODE_WATCH)
         return;
 
+    if(stepif_shadow_sync() != RESPONSE_OK)
+        return;
+
     addr = stepif_watch_addr;
 
     line = 0;
@@ -1084,26 +2368,7 @@ void display_update_watch(void) {
         addrp = rblookup(RB_LUGTEQ, (void*)&addr, stepif_watches);
         if(addrp) {
             addr = *(uint16_t*)addrp;
-
-            /* this is terrible */
-
-            memset((void*)&command, 0, sizeof(command));
-            memset((void*)&response, 0, sizeof(response));
-
-            command.cmd = CMD_READMEM;
-            command.param1 = addr;
-            command.param2 = 1;
-
-            stepif_debug(D_DEBUG, "Asking for 1 byte at $%04x\n", addr);
-
-            result = stepif_command(&command, NULL, &response, &data);
-            if(response.response_status == RESPONSE_ERROR)
-                return;
-
-            value = data[0];
-            free(data);
-
-            tui_putstring(pdisplay, "     %04x: %02x\n", addr, value);
+            tui_putstring(pdisplay, "     %04x: %02x\n", addr, stepif_shadow[addr]);
             addr++;
         } else {
             tui_putstring(pdisplay, "\n");
@@ -1119,31 +2384,13 @@ void display_update_watch(void) {
  * update the main display window
  */
 void display_update_disasm(void) {
-    int result;
-    dbg_command_t command;
-    dbg_response_t response;
-    uint8_t *data = NULL;
     uint8_t line;
     int pos;
 
     if(stepif_display_mode != DISPLAY_MODE_DISASM)
         return;
 
-    memset((void*)&command, 0, sizeof(command));
-    memset((void*)&response, 0, sizeof(response));
-
-    command.cmd = CMD_READMEM;
-    command.param1 = stepif_disassemble_addr;
-
-    if(3 * (pdisplay->height - 2) > 0xffff)
-        command.param2 = 0xffff - command.param1;
-    else
-        command.param2 = 3 * (pdisplay->height - 2);
-
-    stepif_debug(D_DEBUG, "Asking for $%04x bytes\n", command.param2);
-
-    result = stepif_command(&command, NULL, &response, &data);
-    if(response.response_status == RESPONSE_ERROR)
+    if(stepif_shadow_sync() != RESPONSE_OK)
         return;
 
     uint8_t opcode;
@@ -1180,9 +2427,9 @@ void display_update_disasm(void) {
             tui_putstring(pdisplay, "   ");
 
         tui_putstring(pdisplay, "%04X: ", pos);
-        opcode = data[pos - stepif_disassemble_addr];
-        b = data[(pos - stepif_disassemble_addr) + 1];
-        w = data[(pos - stepif_disassemble_addr) + 2] << 8 | b;
+        opcode = stepif_shadow[pos];
+        b = stepif_shadow[(pos + 1) & 0xffff];
+        w = stepif_shadow[(pos + 2) & 0xffff] << 8 | b;
 
         popcode = &cpu_opcode_map[opcode];
         len = cpu_addressing_mode_length[popcode->addressing_mode];
@@ -1268,9 +2515,6 @@ void display_update_disasm(void) {
         line++;
         tui_resetcolor(pdisplay);
     }
-
-    if(data)
-        free(data);
 }
 
 void display_update(void) {
@@ -1311,19 +2555,9 @@ void statusbar_update(void) {
  *
  */
 void register_update(void) {
-    int result;
-    dbg_command_t command;
-    dbg_response_t response;
-    cpu_t *cpu_state;
-
-
-    memset((void*)&command, 0, sizeof(command));
-    memset((void*)&response, 0, sizeof(response));
-
-    command.cmd = CMD_REGS;
+    cpu_t *cpu_state = &stepif_state;
 
-    result = stepif_command(&command, NULL, &response, (uint8_t**)&cpu_state);
-    if(response.response_status == RESPONSE_ERROR)
+    if(stepif_shadow_sync() != RESPONSE_OK)
         return;
 
     tui_setpos(pregisters,0,1);
@@ -1345,9 +2579,6 @@ void register_update(void) {
                   cpu_state->p & FLAG_I ? '1' : '0',
                   cpu_state->p & FLAG_Z ? '1' : '0',
                   cpu_state->p & FLAG_C ? '1' : '0');
-
-    memcpy((void*)&stepif_state, (void*)cpu_state, sizeof(cpu_t));
-    free(cpu_state);
 }
 
 
@@ -1356,33 +2587,12 @@ void register_update(void) {
  *
  */
 void stack_update(void) {
-    int result;
-    dbg_command_t command;
-    dbg_response_t response;
-    cpu_t *cpu_state;
-    uint8_t *data;
+    cpu_t *cpu_state = &stepif_state;
+    uint8_t *data = &stepif_shadow[0x100];
 
     uint16_t startaddr;
 
-    memset((void*)&command, 0, sizeof(command));
-    memset((void*)&response, 0, sizeof(response));
-
-    command.cmd = CMD_REGS;
-
-    result = stepif_command(&command, NULL, &response, (uint8_t**)&cpu_state);
-    if(response.response_status == RESPONSE_ERROR)
-        return;
-
-    /* now, get the stack memory */
-    memset((void*)&command, 0, sizeof(command));
-    memset((void*)&response, 0, sizeof(response));
-
-    command.cmd = CMD_READMEM;
-    command.param1 = 0x0100;
-    command.param2 = 256;
-
-    result = stepif_command(&command, NULL, &response, &data);
-    if(response.response_status == RESPONSE_ERROR)
+    if(stepif_shadow_sync() != RESPONSE_OK)
         return;
 
     tui_setpos(pregisters, 0, 1);
@@ -1410,9 +2620,6 @@ void stack_update(void) {
                       data[addr - 0x100]);
 
     }
-
-    free(cpu_state);
-    free(data);
 }
 
 void fkey_callback(int inchar) {
@@ -1441,9 +2648,11 @@ void fkey_callback(int inchar) {
 
 
 void usage(char *a0) {
-    printf("Usage: %s [-c configfile] [-e]\n\n", a0);
+    printf("Usage: %s [-c configfile] [-e emulator] [-b fifo base] [-u socket]\n\n", a0);
     printf("  -c <configfile>  configfile to use for the emulator\n");
-    printf("  -e               control the emulator as part of debugger\n");
+    printf("  -e <emulator>    control the emulator as part of debugger\n");
+    printf("  -b <fifo base>   talk to the emulator over fifos at this path\n");
+    printf("  -u <socket>      talk to the emulator over a unix socket\n");
 }
 
 /**
@@ -1452,16 +2661,21 @@ void usage(char *a0) {
  * be started, returns a pid of 0
  *
  * @param configfile for the emulator (-c option)
+ * @param base_path fifo base for the emulator (-b option)
+ * @param socket_path socket for the emulator (-u option), or NULL
  * @returns pid on success, 0 otherwise
  */
-pid_t start_emu(char *configfile, char *cmd_path, char *emu_path) {
+pid_t start_emu(char *configfile, char *base_path, char *socket_path, char *emu_path) {
     pid_t pid;
     int pipe_fd[2];
+    char *cmd_path;
 
     char *args[] = { "rp65emu",
                      "-c",
                      configfile,
                      "-s",
+                     socket_path ? "-u" : "-b",
+                     socket_path ? socket_path : base_path,
                      NULL };
 
     if (pipe(pipe_fd) == -1) {
@@ -1489,14 +2703,24 @@ pid_t start_emu(char *configfile, char *cmd_path, char *emu_path) {
         /* shouldn't get here */
     }
 
+    close(pipe_fd[PIPE_WRITE_FD]);
+
+    /* the socket is connected to with retries instead */
+    if(socket_path)
+        return pid;
+
     /* wait for the command socket to become writable.
      * monitor startup to see if we get a tty notification
      */
-    close(pipe_fd[PIPE_WRITE_FD]);
+    cmd_path = error_malloc(strlen(base_path) + 5);
+    strcpy(cmd_path, base_path);
+    strcat(cmd_path, "-cmd");
 
     for(int x = 0; x < 20; x++) {
-        if(is_writable(cmd_path))
+        if(is_writable(cmd_path)) {
+            free(cmd_path);
             return pid;
+        }
 
         usleep(100000);
     }
@@ -1547,6 +2771,50 @@ int stepif_open_fifo(char *base_path, char *extension) {
     return fd;
 }
 
+/**
+ * connect to the emulator's socket.  The emulator listens before
+ * it loads hardware, so if we started it, keep trying until it
+ * gets that far.
+ *
+ * @param socket_path path of the socket
+ * @param tries number of attempts, 100ms apart
+ * @returns connected fd
+ */
+int stepif_connect(char *socket_path, int tries) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", socket_path);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    while(tries--) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+
+        if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+            return fd;
+
+        close(fd);
+        if(tries)
+            usleep(100000);
+    }
+
+    if(stepif_emu_pid && (kill(stepif_emu_pid, 0) != -1))
+        kill(stepif_emu_pid, SIGTERM);
+
+    fprintf(stderr, "Emulator not running.\n");
+    exit(EXIT_FAILURE);
+}
+
 
 /**
  * main
@@ -1555,6 +2823,7 @@ int main(int argc, char *argv[]) {
     char buffer[80];
     char *emu_path = DEFAULT_EMU_PATH;
     char *base_path = DEFAULT_FIFO;
+    char *socket_path = NULL;
     char *startup_script = NULL;
     int pos;
     int step_char;
@@ -1566,7 +2835,7 @@ int main(int argc, char *argv[]) {
     char *config_file = NULL;
     int option;
 
-    while((option = getopt(argc, argv, "c:e:s:b:")) != -1) {
+    while((option = getopt(argc, argv, "c:e:s:b:u:")) != -1) {
         switch(option) {
         case 'c':
             config_file = optarg;
@@ -1586,6 +2855,10 @@ int main(int argc, char *argv[]) {
             base_path = optarg;
             break;
 
+        case 'u':
+            socket_path = optarg;
+            break;
+
         default:
             usage(argv[0]);
             exit(EXIT_FAILURE);
@@ -1618,34 +2891,50 @@ int main(int argc, char *argv[]) {
     for(pos = ' '; pos <= '~'; pos++)
         xlat[pos] = pos;
 
-    char *fifo_path;
-    fifo_path = malloc(strlen(base_path) + 5);
-    if(!fifo_path) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
-    }
-
-    strcpy(fifo_path, base_path);
-    strcat(fifo_path, "-cmd");
-
-    if(!is_writable(fifo_path)) {
-        if(!control_emu) {
-            fprintf(stderr, "Emulator not running.\n");
-            exit(EXIT_FAILURE);
-        } else {
-            stepif_emu_pid = start_emu(config_file, fifo_path, emu_path);
+    if(socket_path) {
+        if(control_emu) {
+            stepif_emu_pid = start_emu(config_file, base_path, socket_path, emu_path);
             if(!stepif_emu_pid) {
                 fprintf(stderr, "could not start emulator\n");
                 exit(EXIT_FAILURE);
             }
         }
-    }
 
-    free(fifo_path);
+        stepif_cmd_fd = stepif_connect(socket_path,
+                                       control_emu ? STEPIF_CONNECT_TRIES : 1);
+        stepif_rsp_fd = stepif_cmd_fd;
+        stepif_asy_fd = stepif_cmd_fd;
+        stepif_framed = 1;
+    } else {
+        char *fifo_path;
+        fifo_path = malloc(strlen(base_path) + 5);
+        if(!fifo_path) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        strcpy(fifo_path, base_path);
+        strcat(fifo_path, "-cmd");
+
+        if(!is_writable(fifo_path)) {
+            if(!control_emu) {
+                fprintf(stderr, "Emulator not running.\n");
+                exit(EXIT_FAILURE);
+            } else {
+                stepif_emu_pid = start_emu(config_file, base_path, NULL, emu_path);
+                if(!stepif_emu_pid) {
+                    fprintf(stderr, "could not start emulator\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+
+        free(fifo_path);
 
-    stepif_cmd_fd = stepif_open_fifo(base_path, "-cmd");
-    stepif_rsp_fd = stepif_open_fifo(base_path, "-rsp");
-    stepif_asy_fd = stepif_open_fifo(base_path, "-asy");
+        stepif_cmd_fd = stepif_open_fifo(base_path, "-cmd");
+        stepif_rsp_fd = stepif_open_fifo(base_path, "-rsp");
+        stepif_asy_fd = stepif_open_fifo(base_path, "-asy");
+    }
 
     pscreen = tui_init(NULL, 1);
     tui_set_exit_callback(stepif_exit_callback);
@@ -1677,12 +2966,11 @@ int main(int argc, char *argv[]) {
     stepif_remote_caps = response.response_value;
 
     tui_putstring(pcommand, " Remote caps: %04X\n", stepif_remote_caps);
+    stepif_shm_attach();
 
     /* this is kind of lame, but let's walk through and read off all
      * the async events */
-    fd_blocking(stepif_asy_fd, 0);
-    while(stepif_process_message(stepif_asy_fd) == RESPONSE_OK);
-    fd_blocking(stepif_asy_fd, 1);
+    stepif_drain_async();
 
     tui_putstring(pcommand, " refreshing statusbar...");
     tui_refresh(tui_getstatusbar());
@@ -1712,6 +3000,8 @@ int main(int argc, char *argv[]) {
             case KEY_ENTER:
             case 0x0a:
                 stepif_running = 0;
+                if(stepif_remote_running)
+                    stepif_halt();
                 tui_window_delay(pcommand);
                 break;
             case ERR:
@@ -1721,7 +3011,10 @@ int main(int argc, char *argv[]) {
             /*     tui_putstring(pcommand, buffer); */
             /*     break; */
             }
-            process_command("next");
+            if(stepif_remote_running)
+                stepif_wait_running();
+            else if(stepif_running)
+                process_command("next");
         } else {
             /* make sure we are in delay mode */
             tui_window_delay(pcommand);
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define DBG_MODULE DBG_MOD_CPU
+#include "debug.h"
+#include "6502.h"
+#include "breakpoint.h"
+#include "memory.h"
+#include "metrics.h"
+#include "runloop.h"
+#include "scheduler.h"
+#include "stepwise.h"
+
+/* set from any thread to make run_cpu return */
+int run_halt = 0;
+
+/* address of the last instruction run_cpu executed */
+uint16_t run_last_pc = 0;
+
+/**
+ * ask a running run_cpu to return at the next instruction
+ * boundary
+ */
+void run_request_halt(void) {
+    __atomic_store_n(&run_halt, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * private
+ *
+ * stop check for step-out, done after every instruction:
+ * has an RTS taken the stack above where we started?
+ */
+static int run_stepped_out(run_limits_t *limits, uint8_t opcode) {
+    return (opcode == RUN_OPCODE_RTS) && (cpu_state.sp > limits->start_sp);
+}
+
+/**
+ * run the cpu until a breakpoint, watchpoint, halt request or
+ * limit.  A breakpoint at the starting pc is ignored, so that a
+ * run can continue from the breakpoint it stopped at.
+ *
+ * An until address is implemented as a temporary breakpoint, so
+ * it costs nothing until the pc gets there.
+ *
+ * @param limits when to stop, or NULL to only stop on events
+ * @returns STOP_* reason: STOP_DONE when the until address or
+ *          step-out was reached, STOP_LIMIT when the instruction
+ *          or cycle count ran out
+ */
+uint16_t run_cpu(run_limits_t *limits) {
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    uint64_t max_instructions = 0;
+    uint64_t max_cycles = 0;
+    int until = 0;
+    int until_is_bp = 0;
+    int step_out = 0;
+    uint8_t opcode = 0;
+    uint16_t reason;
+
+    if(limits) {
+        max_instructions = limits->instructions;
+        max_cycles = limits->cycles;
+        until = limits->until;
+        step_out = limits->step_out;
+        limits->start_sp = cpu_state.sp;
+    }
+
+    if(until) {
+        until_is_bp = BREAKPOINT_ISSET(limits->until_addr) ? 1 : 0;
+        breakpoint_set(limits->until_addr);
+    }
+
+    __atomic_store_n(&run_halt, 0, __ATOMIC_RELEASE);
+
+    while(1) {
+        run_last_pc = cpu_state.ip;
+        if(step_out)
+            opcode = memory_peek(run_last_pc);
+
+        cycles += cpu_execute();
+        instructions++;
+
+        if(metrics.cycles >= sched_next)
+            sched_run(metrics.cycles);
+
+        if(!(instructions & RUN_PUBLISH_MASK))
+            memory_publish();
+
+        /* the watch hit is left for the caller to collect */
+        if(memory_watch_pending) {
+            reason = STOP_WATCH;
+            break;
+        }
+
+        if(__atomic_load_n(&run_halt, __ATOMIC_RELAXED)) {
+            reason = STOP_HALT;
+            break;
+        }
+
+        if(step_out && run_stepped_out(limits, opcode)) {
+            reason = STOP_DONE;
+            break;
+        }
+
+        if((max_instructions && (instructions >= max_instructions)) ||
+           (max_cycles && (cycles >= max_cycles))) {
+            reason = STOP_LIMIT;
+            break;
+        }
+
+        if(BREAKPOINT_ISSET(cpu_state.ip)) {
+            if(until && (cpu_state.ip == limits->until_addr) &&
+               (cpu_state.sp >= limits->until_sp)) {
+                reason = STOP_DONE;
+                break;
+            }
+
+            if((!until || (cpu_state.ip != limits->until_addr) || until_is_bp) &&
+               breakpoint_check(cpu_state.ip)) {
+                DEBUG("Breakpoint at $%04x", cpu_state.ip);
+                reason = STOP_BREAK;
+                break;
+            }
+        }
+    }
+
+    if(until && !until_is_bp)
+        breakpoint_clear(limits->until_addr);
+
+    memory_publish();
+
+    if(limits) {
+        limits->instructions_run = instructions;
+        limits->cycles_run = cycles;
+    }
+
+    return reason;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _RUNLOOP_H_
+#define _RUNLOOP_H_
+
+#include <stdint.h>
+
+#define RUN_OPCODE_JSR 0x20
+#define RUN_OPCODE_RTS 0x60
+
+/* how often a free run updates the shared memory view */
+#define RUN_PUBLISH_MASK 0xfff
+
+/* when to give control back to the caller.  Zero means
+ * no limit.
+ *
+ * until stops when the pc reaches until_addr with the stack
+ * pointer at or above until_sp (so recursive calls don't count).
+ * step_out stops after an RTS leaves the stack above where it
+ * was at the start.
+ */
+typedef struct run_limits_t {
+    uint64_t instructions;
+    uint64_t cycles;
+    int until;
+    uint16_t until_addr;
+    uint8_t until_sp;
+    int step_out;
+
+    /* filled in by run_cpu */
+    uint8_t start_sp;
+    uint64_t instructions_run;
+    uint64_t cycles_run;
+} run_limits_t;
+
+extern int run_halt;
+extern uint16_t run_last_pc;
+
+extern uint16_t run_cpu(run_limits_t *limits);
+extern void run_request_halt(void);
+
+#endif /* _RUNLOOP_H_ */
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define DBG_MODULE DBG_MOD_CPU
+#include "debug.h"
+#include "metrics.h"
+#include "scheduler.h"
+
+/* an event slot.  Event ids are the slot and its generation, so
+ * a stale id can't cancel whatever reused the slot. */
+typedef struct sched_event_t {
+    uint64_t cycle;
+    uint64_t seq;
+    hw_event_t callback;
+    void *arg;
+    uint16_t generation;
+    int pos;   /* index in sched_heap, or -1 when free */
+} sched_event_t;
+
+uint64_t sched_next = SCHED_NEVER;
+
+static sched_event_t sched_events[SCHED_MAX_EVENTS];
+static int sched_heap[SCHED_MAX_EVENTS];
+static int sched_count = 0;
+static int sched_slots_used = 0;
+static uint64_t sched_seq = 0;
+
+#define SCHED_ID(slot) ((sched_events[slot].generation << 8) | (slot))
+#define SCHED_SLOT(id) ((id) & 0xff)
+
+/*
+ * private
+ *
+ * heap order: by cycle, and events for the same cycle in the
+ * order they were added, so runs are repeatable
+ */
+static int sched_before(int a, int b) {
+    if(sched_events[a].cycle != sched_events[b].cycle)
+        return sched_events[a].cycle < sched_events[b].cycle;
+    return sched_events[a].seq < sched_events[b].seq;
+}
+
+/*
+ * private
+ *
+ * put a slot at a heap position
+ */
+static void sched_place(int pos, int slot) {
+    sched_heap[pos] = slot;
+    sched_events[slot].pos = pos;
+}
+
+/*
+ * private
+ *
+ * restore heap order around a position that has changed
+ */
+static void sched_fix(int pos) {
+    int slot = sched_heap[pos];
+    int parent, child;
+
+    while(pos > 0) {
+        parent = (pos - 1) / 2;
+        if(!sched_before(slot, sched_heap[parent]))
+            break;
+        sched_place(pos, sched_heap[parent]);
+        pos = parent;
+    }
+
+    while((child = (pos * 2) + 1) < sched_count) {
+        if((child + 1 < sched_count) &&
+           sched_before(sched_heap[child + 1], sched_heap[child]))
+            child++;
+        if(!sched_before(sched_heap[child], slot))
+            break;
+        sched_place(pos, sched_heap[child]);
+        pos = child;
+    }
+
+    sched_place(pos, slot);
+}
+
+/*
+ * private
+ *
+ * take a slot out of the heap and free it
+ */
+static void sched_remove(int slot) {
+    int pos = sched_events[slot].pos;
+
+    sched_count--;
+    if(pos != sched_count) {
+        sched_place(pos, sched_heap[sched_count]);
+        sched_fix(pos);
+    }
+
+    sched_events[slot].pos = -1;
+    sched_events[slot].generation++;
+    sched_next = sched_count ? sched_events[sched_heap[0]].cycle : SCHED_NEVER;
+}
+
+/**
+ * the current cpu cycle count, for devices to schedule against
+ */
+uint64_t sched_cycles(void) {
+    return metrics.cycles;
+}
+
+/**
+ * call back at a cpu cycle.  The callback gets the cycle it
+ * was due at, which the instruction running then may have
+ * overshot, so periodic events can re-arm without drifting.
+ *
+ * @param cycle when to call back; now or earlier is the end
+ *              of the current instruction
+ * @param callback what to call
+ * @param arg passed to callback
+ * @returns an event id for sched_cancel, or -1 if full
+ */
+int sched_add(uint64_t cycle, hw_event_t callback, void *arg) {
+    int slot;
+
+    if(sched_count == SCHED_MAX_EVENTS) {
+        ERROR("Too many scheduled events");
+        return -1;
+    }
+
+    /* slots below sched_slots_used are all in use unless freed */
+    for(slot = 0; slot < sched_slots_used; slot++) {
+        if(sched_events[slot].pos == -1)
+            break;
+    }
+
+    if(slot == sched_slots_used)
+        sched_slots_used++;
+
+    sched_events[slot].cycle = cycle;
+    sched_events[slot].seq = sched_seq++;
+    sched_events[slot].callback = callback;
+    sched_events[slot].arg = arg;
+
+    sched_place(sched_count, slot);
+    sched_count++;
+    sched_fix(sched_count - 1);
+
+    sched_next = sched_events[sched_heap[0]].cycle;
+    return SCHED_ID(slot);
+}
+
+/**
+ * cancel a pending event.  Ids of events that have already
+ * run (or been cancelled) are ignored.
+ *
+ * @param event id from sched_add
+ */
+void sched_cancel(int event) {
+    int slot;
+
+    if(event < 0)
+        return;
+
+    slot = SCHED_SLOT(event);
+    if((slot >= sched_slots_used) || (sched_events[slot].pos == -1) ||
+       (SCHED_ID(slot) != event))
+        return;
+
+    sched_remove(slot);
+}
+
+/**
+ * run the events that are due.  Called from the run loop when
+ * the cycle count reaches sched_next.  Events can add more
+ * events, including ones that are already due.
+ *
+ * @param now current cycle count
+ */
+void sched_run(uint64_t now) {
+    sched_event_t *event;
+    int slot;
+
+    while(sched_count && (sched_events[sched_heap[0]].cycle <= now)) {
+        slot = sched_heap[0];
+        event = &sched_events[slot];
+        sched_remove(slot);
+
+        DEBUG("Event due at %llu, running at %llu",
+              (unsigned long long)event->cycle, (unsigned long long)now);
+        event->callback(event->arg, event->cycle);
+    }
+}
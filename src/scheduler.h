@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <stdint.h>
+
+#include "hardware.h"
+
+/* device events, keyed on the cpu cycle count.  Pending events
+ * are kept in a min-heap, so the run loop only has to compare
+ * the cycle count with sched_next after each instruction.  All
+ * of this belongs to the cpu thread.
+ */
+#define SCHED_MAX_EVENTS 256
+#define SCHED_NEVER      UINT64_MAX
+
+/* cycle of the earliest pending event, or SCHED_NEVER */
+extern uint64_t sched_next;
+
+extern uint64_t sched_cycles(void);
+extern int sched_add(uint64_t cycle, hw_event_t callback, void *arg);
+extern void sched_cancel(int event);
+extern void sched_run(uint64_t now);
+
+#endif /* _SCHEDULER_H_ */
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DBG_MODULE DBG_MOD_BUS
+#include "debug.h"
+#include "6502.h"
+#include "metrics.h"
+#include "shmview.h"
+
+static shm_header_t *shm_header = NULL;
+static char *shm_name = NULL;
+
+/* which addresses already have storage in the image */
+static uint8_t shm_claimed[SHM_IMAGE_SIZE / 8];
+
+/*
+ * private
+ *
+ * remove the segment on the way out
+ */
+static void shmview_unlink(void) {
+    if(shm_name)
+        shm_unlink(shm_name);
+}
+
+/**
+ * create the shared memory view.  Must be called before memory
+ * modules are loaded, so they can allocate from it.
+ *
+ * @param name posix shm name, like "/rp65emu"
+ * @returns 1 on success, 0 on failure
+ */
+int shmview_init(const char *name) {
+    int fd;
+    void *segment;
+    size_t size = SHM_HEADER_SIZE + SHM_IMAGE_SIZE;
+
+    fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if(fd == -1) {
+        ERROR("Can't create shared memory %s: %s", name, strerror(errno));
+        return 0;
+    }
+
+    if(ftruncate(fd, size) == -1) {
+        ERROR("Can't size shared memory %s: %s", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return 0;
+    }
+
+    segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(segment == MAP_FAILED) {
+        ERROR("Can't map shared memory %s: %s", name, strerror(errno));
+        shm_unlink(name);
+        return 0;
+    }
+
+    shm_header = (shm_header_t*)segment;
+    shm_header->magic = SHM_MAGIC;
+    shm_header->version = SHM_VERSION;
+
+    shm_name = strdup(name);
+    atexit(shmview_unlink);
+
+    INFO("Shared memory view at %s", name);
+    return 1;
+}
+
+/**
+ * @returns name of the shared memory segment, or NULL if
+ *          there isn't one
+ */
+const char *shmview_name(void) {
+    return shm_name;
+}
+
+/**
+ * hand out storage for a memory device from the shared image.
+ * Its pages are flagged as live by shmview_map_page, once reads
+ * of them go to the device.
+ *
+ * @param start first address of the device
+ * @param end last address of the device
+ * @returns storage for start to end, or NULL if there is no
+ *          shared view or part of the range is already taken
+ */
+uint8_t *shmview_alloc(uint16_t start, uint16_t end) {
+    uint32_t addr;
+
+    if(!shm_header || (end < start))
+        return NULL;
+
+    for(addr = start; addr <= end; addr++) {
+        if(shm_claimed[addr >> 3] & (1 << (addr & 7)))
+            return NULL;
+    }
+
+    for(addr = start; addr <= end; addr++)
+        shm_claimed[addr >> 3] |= (1 << (addr & 7));
+
+    DEBUG("Shared $%04x-$%04x", start, end);
+    return SHM_IMAGE(shm_header) + start;
+}
+
+/**
+ * flag a page live or not when the page table changes.  It is
+ * live if the device reads go to keeps that page in the image;
+ * with something else banked in over it, the image has what's
+ * underneath, not what the cpu sees.
+ *
+ * @param page page number
+ * @param live whether reads of the page go to the image
+ */
+void shmview_map_page(int page, int live) {
+    if(!shm_header)
+        return;
+
+    if(live)
+        shm_header->page_flags[page] |= SHM_PAGE_RAM;
+    else
+        shm_header->page_flags[page] &= ~SHM_PAGE_RAM;
+}
+
+/**
+ * update the cpu state and counters in the header.  Only call
+ * from the thread running the cpu.
+ */
+void shmview_publish(void) {
+    uint32_t seq;
+
+    if(!shm_header)
+        return;
+
+    seq = shm_header->seq;
+    __atomic_store_n(&shm_header->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    shm_header->cpu = cpu_state;
+    shm_header->instructions = metrics.instructions;
+    shm_header->cycles = metrics.cycles;
+
+    __atomic_store_n(&shm_header->seq, seq + 2, __ATOMIC_RELEASE);
+}
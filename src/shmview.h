@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SHMVIEW_H_
+#define _SHMVIEW_H_
+
+#include <stdint.h>
+
+#include "6502.h"
+
+/* layout of the shared memory view.  A header page, then a
+ * 64k image of the address space.  Only pages with
+ * SHM_PAGE_RAM set in page_flags are live in the image; the
+ * rest (I/O, unmapped, or banked over by a rom) have to be read
+ * through the debugger protocol.  The flags change as banks are
+ * switched.
+ *
+ * The cpu state and counters are guarded by a seqlock: seq is
+ * odd while they are being updated.  Readers copy them, and
+ * retry if seq was odd or changed.  They are updated after
+ * every debugger command and every few thousand instructions
+ * of a free run.  Memory in the image is always live.
+ */
+#define SHM_MAGIC        0x35365052  /* "RP65" */
+#define SHM_VERSION      1
+#define SHM_HEADER_SIZE  4096
+#define SHM_IMAGE_SIZE   0x10000
+
+#define SHM_PAGE_RAM     0x01
+
+typedef struct shm_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    uint32_t reserved;
+    cpu_t cpu;
+    uint64_t instructions;
+    uint64_t cycles;
+    uint8_t page_flags[256];
+} shm_header_t;
+
+#define SHM_IMAGE(header) ((uint8_t*)(header) + SHM_HEADER_SIZE)
+
+extern int shmview_init(const char *name);
+extern const char *shmview_name(void);
+extern uint8_t *shmview_alloc(uint16_t start, uint16_t end);
+extern void shmview_map_page(int page, int live);
+extern void shmview_publish(void);
+
+#endif /* _SHMVIEW_H_ */
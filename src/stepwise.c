@@ -18,34 +18,455 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #include "stepwise.h"
+#define DBG_MODULE DBG_MOD_DEBUGGER
 #include "debug.h"
 #include "6502.h"
 #include "memory.h"
-#include "redblack.h"
+#include "metrics.h"
+#include "breakpoint.h"
+#include "runloop.h"
+#include "scheduler.h"
+#include "shmview.h"
+#include "loader.h"
 
 #define DEFAULT_DEBUG_FIFO "/tmp/debug";
 #define VERSION "0.1"
 
-static int step_cmd_fd = -1;
-static int step_rsp_fd = -1;
-static int step_asy_fd = -1;
-
-static struct rbtree *step_bp = NULL;
-static int step_run = 0;
+/* output a client hasn't read yet.  Clients are written without
+ * blocking, so one that stops reading can't hold up the cpu or the
+ * other clients: what doesn't go straight out waits here, and the
+ * debugger thread sends it when poll says the fd is writable.
+ */
+typedef struct step_queue_t {
+    int fd;
+    uint8_t *data;
+    size_t start;
+    size_t len;
+} step_queue_t;
+
+/* a debugger connection.  The fifo client reads and writes bare
+ * messages on three fds, a socket client framed messages on one.
+ * Input is buffered until a whole command has arrived, in a buffer
+ * allocated with the client that holds the largest command.
+ * asy is the queue for async messages: asy_queue for the fifo
+ * client, out for a socket client, so they stay in order.
+ */
+typedef struct step_client_t {
+    int in_fd;
+    step_queue_t out;
+    step_queue_t asy_queue;
+    step_queue_t *asy;
+    int framed;
+    int dead;
+    int sub_mask;
+    uint16_t tag;
+    uint8_t *buffer;
+    size_t buffer_len;
+    struct step_client_t *pnext;
+} step_client_t;
+
+#define STEP_MAX_CLIENTS  16
+#define STEP_READ_CHUNK   4096
+#define STEP_BUFFER_SIZE  (sizeof(dbg_frame_t) + sizeof(dbg_command_t) + \
+                           0xffff + STEP_READ_CHUNK)
+#define STEP_QUEUE_SIZE   0x40000
+#define STEP_MAX_HWNOTIFY 16
+#define STEP_NOTIFY_MAX   512
+
+static int step_listen_fd = -1;
+static char *step_listen_path = NULL;
+
+/* written when a queue fills from another thread, so the debugger
+ * thread wakes up and polls for it to drain */
+static int step_wake_fds[2] = { -1, -1 };
+
+/* the client list is only changed by the debugger thread, but
+ * under step_async_lock, as other threads walk it to send async
+ * events.  step_current is the client being answered. */
+static step_client_t *step_clients = NULL;
+static step_client_t *step_current = NULL;
+
+/* hardware notifications are sent while the modules load, before
+ * a socket client could have connected, so keep them to replay */
+static dbg_command_t step_hwnotify[STEP_MAX_HWNOTIFY];
+static uint8_t *step_hwnotify_data[STEP_MAX_HWNOTIFY];
+static int step_hwnotify_count = 0;
 
 #define STEP_BAD_REG "Bad register specified"
 #define STEP_BAD_FILE "Cannot open file"
+#define STEP_BAD_COND "Invalid breakpoint condition"
+#define STEP_RUNNING "Emulator is running"
+#define STEP_BAD_UNTIL "Bad run-until target"
+#define STEP_BAD_RANGE "Bad memory range"
+#define STEP_NO_SHM "No shared memory view"
+#define STEP_BAD_BATCH "Bad batch"
+#define STEP_BAD_SEARCH "Bad search pattern"
+#define STEP_BAD_CMD "Unknown command"
+
+/* async messages come from the run thread and hardware
+ * threads as well as the debugger thread */
+static pthread_mutex_t step_async_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* free-run state.  step_running is set while the run thread
+ * is executing, step_run_joinable until it has been joined */
+static pthread_t step_run_tid;
+static int step_running = 0;
+static int step_run_joinable = 0;
+static run_limits_t step_run_limits;
+
+/* the most a stepping command runs on the debugger thread, where
+ * nothing can halt it.  Anything longer goes to the run thread. */
+#define STEP_SYNC_INSTRUCTIONS 0x10000
+#define STEP_SYNC_CYCLES       0x40000
+
+/* event publishing.  The publisher thread is started by the
+ * first CMD_SUBSCRIBE that asks for periodic events */
+#define STEP_PUB_DEFAULT_HZ 10
+#define STEP_PUB_MAX_HZ     1000
+
+static pthread_t step_pub_tid;
+static int step_pub_started = 0;
+static int step_sub_mask = SUB_STOPPED | SUB_WATCH;
+static int step_sub_rate = STEP_PUB_DEFAULT_HZ;
+static int step_pub_reset = 0;
+
+/* while a CMD_BATCH runs, step_return collects the responses of
+ * its commands here rather than sending them */
+static int step_batching = 0;
+static int step_batch_full = 0;
+static uint8_t step_batch_status;
+static uint32_t step_batch_len;
+static uint8_t step_batch_buf[BATCH_MAX_RESPONSE];
+
+/* responses with extra data are built here, so answering a
+ * command doesn't touch the heap.  Only the debugger thread
+ * uses it. */
+static uint8_t step_out_buf[0x10000];
+
+
+/*
+ * private
+ *
+ * malloc for the debugger interface
+ */
+static void *step_malloc(size_t size) {
+    void *retval;
+
+    retval = malloc(size);
+    if(!retval) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    return retval;
+}
+
+
+/*
+ * private
+ *
+ * get the debugger thread out of poll
+ */
+static void step_wake(void) {
+    uint8_t byte = 0;
+
+    if(step_wake_fds[1] != -1)
+        write(step_wake_fds[1], &byte, 1);
+}
+
+/*
+ * private
+ *
+ * write a whole message to a client in as few syscalls as it
+ * takes, without blocking.  Whatever the fd won't take now is
+ * queued.  If the queue is full, the client has stopped reading:
+ * an async message is dropped, a response drops the client.
+ * Must be called with step_async_lock held.
+ */
+static void step_client_writev(step_client_t *client, step_queue_t *queue,
+                               struct iovec *iov, int count, int droppable) {
+    ssize_t written = 0;
+    size_t total = 0;
+    size_t skip;
+    int index;
+
+    if(client->dead)
+        return;
+
+    for(index = 0; index < count; index++)
+        total += iov[index].iov_len;
+
+    if(!queue->len) {
+        do {
+            written = writev(queue->fd, iov, count);
+        } while((written == -1) && (errno == EINTR));
+
+        if(written == -1) {
+            if(errno != EAGAIN) {
+                DEBUG("Dropping debugger client: %s", strerror(errno));
+                client->dead = 1;
+                return;
+            }
+            written = 0;
+        }
+
+        if((size_t)written == total)
+            return;
+    }
+
+    if(queue->len + total - written > STEP_QUEUE_SIZE) {
+        if(droppable && !written) {
+            DEBUG("Debugger client not reading, dropping async message");
+            return;
+        }
+        DEBUG("Dropping debugger client: not reading");
+        client->dead = 1;
+        return;
+    }
+
+    if(queue->start + queue->len + total - written > STEP_QUEUE_SIZE) {
+        memmove(queue->data, queue->data + queue->start, queue->len);
+        queue->start = 0;
+    }
 
+    if(!queue->len)
+        step_wake();
+
+    skip = written;
+    for(index = 0; index < count; index++) {
+        if(skip >= iov[index].iov_len) {
+            skip -= iov[index].iov_len;
+            continue;
+        }
+
+        memcpy(queue->data + queue->start + queue->len,
+               (uint8_t*)iov[index].iov_base + skip,
+               iov[index].iov_len - skip);
+        queue->len += iov[index].iov_len - skip;
+        skip = 0;
+    }
+}
+
+/*
+ * private
+ *
+ * send what a client has queued, as far as it will take it.
+ * Must be called with step_async_lock held.
+ */
+static void step_queue_flush(step_client_t *client, step_queue_t *queue) {
+    ssize_t written;
+
+    while(queue->len && !client->dead) {
+        written = write(queue->fd, queue->data + queue->start, queue->len);
+        if(written == -1) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                return;
+            DEBUG("Dropping debugger client: %s", strerror(errno));
+            client->dead = 1;
+            return;
+        }
+
+        queue->start += written;
+        queue->len -= written;
+    }
+
+    if(!queue->len)
+        queue->start = 0;
+}
+
+/*
+ * private
+ *
+ * send a message and its extra data to a client, framing it if
+ * the client is on the socket.  Must be called with step_async_lock
+ * held.
+ */
+static void step_client_send(step_client_t *client, step_queue_t *queue,
+                             uint8_t type, void *msg, size_t msg_len,
+                             uint8_t *data, uint16_t len) {
+    dbg_frame_t frame;
+    struct iovec iov[3];
+    int count = 0;
+
+    if(client->framed) {
+        frame.type = type;
+        frame.tag = (type == FRAME_RESPONSE) ? client->tag : 0;
+        iov[count].iov_base = &frame;
+        iov[count++].iov_len = sizeof(frame);
+    }
+
+    iov[count].iov_base = msg;
+    iov[count++].iov_len = msg_len;
+
+    if(len) {
+        iov[count].iov_base = data;
+        iov[count++].iov_len = len;
+    }
+
+    step_client_writev(client, queue, iov, count, type == FRAME_ASYNC);
+}
+
+/*
+ * private
+ *
+ * the subscription an async message needs, or 0 if every client
+ * gets it
+ */
+static int step_async_event(uint8_t message) {
+    switch(message) {
+    case ASYNC_WATCH:
+        return SUB_WATCH;
+    case ASYNC_STOPPED:
+        return SUB_STOPPED;
+    case ASYNC_REGS:
+        return SUB_REGS;
+    case ASYNC_DIRTY:
+        return SUB_DIRTY;
+    }
+
+    return 0;
+}
+
+/*
+ * private
+ *
+ * recompute the events any client wants.  Must be called with
+ * step_async_lock held.
+ */
+static void step_update_mask(void) {
+    step_client_t *client;
+    int mask = 0;
+
+    for(client = step_clients; client; client = client->pnext) {
+        if(!client->dead)
+            mask |= client->sub_mask;
+    }
+
+    __atomic_store_n(&step_sub_mask, mask, __ATOMIC_RELAXED);
+}
+
+/*
+ * private
+ *
+ * add a client to the list
+ */
+static step_client_t *step_client_add(int in_fd, int out_fd,
+                                      int asy_fd, int framed) {
+    step_client_t *client;
+
+    client = (step_client_t*)step_malloc(sizeof(step_client_t));
+    memset(client, 0, sizeof(step_client_t));
+    client->buffer = (uint8_t*)step_malloc(STEP_BUFFER_SIZE);
+
+    client->in_fd = in_fd;
+    client->out.fd = out_fd;
+    client->out.data = (uint8_t*)step_malloc(STEP_QUEUE_SIZE);
+    client->asy = &client->out;
+    if(asy_fd != out_fd) {
+        client->asy_queue.fd = asy_fd;
+        client->asy_queue.data = (uint8_t*)step_malloc(STEP_QUEUE_SIZE);
+        client->asy = &client->asy_queue;
+    }
+    client->framed = framed;
+    client->sub_mask = SUB_STOPPED | SUB_WATCH;
+
+    pthread_mutex_lock(&step_async_lock);
+    client->pnext = step_clients;
+    step_clients = client;
+    step_update_mask();
+    pthread_mutex_unlock(&step_async_lock);
+
+    return client;
+}
+
+/*
+ * private
+ *
+ * close a client's fds and free it
+ */
+static void step_client_free(step_client_t *client) {
+    close(client->in_fd);
+    if(client->out.fd != client->in_fd)
+        close(client->out.fd);
+    if(client->asy == &client->asy_queue) {
+        close(client->asy_queue.fd);
+        free(client->asy_queue.data);
+    }
+
+    free(client->out.data);
+    free(client->buffer);
+    free(client);
+}
+
+/*
+ * private
+ *
+ * drop the clients that have hung up or failed a write
+ */
+static void step_client_reap(void) {
+    step_client_t **pclient;
+    step_client_t *client;
+
+    pthread_mutex_lock(&step_async_lock);
+    pclient = &step_clients;
+    while(*pclient) {
+        client = *pclient;
+        if(client->dead) {
+            DEBUG("Debugger client disconnected");
+            *pclient = client->pnext;
+            step_client_free(client);
+        } else {
+            pclient = &client->pnext;
+        }
+    }
+    step_update_mask();
+    pthread_mutex_unlock(&step_async_lock);
+}
+
+/*
+ * private
+ *
+ * add a batched command's response to the batch response.  There
+ * is always room left for a response with no data, to say the
+ * real one didn't fit.
+ */
+static void step_batch_append(dbg_response_t *response, uint8_t *data) {
+    if(step_batch_len + 2 * sizeof(dbg_response_t) + response->extra_len >
+       BATCH_MAX_RESPONSE) {
+        response->response_status = RESPONSE_ERROR;
+        response->extra_len = 0;
+        step_batch_full = 1;
+    }
+
+    memcpy(step_batch_buf + step_batch_len, response, sizeof(dbg_response_t));
+    step_batch_len += sizeof(dbg_response_t);
+
+    if(response->extra_len) {
+        memcpy(step_batch_buf + step_batch_len, data, response->extra_len);
+        step_batch_len += response->extra_len;
+    }
+
+    step_batch_status = response->response_status;
+}
 
 void step_return(uint8_t result, uint16_t retval,
                  uint16_t len, uint8_t *data) {
@@ -55,18 +476,33 @@ void step_return(uint8_t result, uint16_t retval,
     response.response_value = retval;
     response.extra_len = len;
 
-    write(step_rsp_fd, (char*)&response, sizeof(response));
+    if(step_batching) {
+        step_batch_append(&response, data);
+        return;
+    }
+
+    /* the shared view should be current by the time the client
+     * hears back.  A running cpu thread keeps it current itself. */
+    if(!step_run_joinable)
+        memory_publish();
+
     DEBUG("Returning response: %s", result ? "Error" : "Success");
-    if(len) {
+    if(len)
         DEBUG("Returning %d bytes of extra data", len);
-        write(step_rsp_fd, (char*) data, response.extra_len);
-    }
+
+    pthread_mutex_lock(&step_async_lock);
+    if(step_current)
+        step_client_send(step_current, &step_current->out, FRAME_RESPONSE,
+                         &response, sizeof(response), data, len);
+    pthread_mutex_unlock(&step_async_lock);
 }
 
 void step_send_async(uint8_t message, uint16_t param1,
                      uint16_t param2, uint16_t len,
                      uint8_t *data) {
     dbg_command_t cmd;
+    step_client_t *client;
+    int event;
 
     cmd.cmd = message;
     cmd.param1 = param1;
@@ -74,63 +510,275 @@ void step_send_async(uint8_t message, uint16_t param1,
     cmd.extra_len = len;
     DEBUG("Sending async cmd %d", cmd.cmd);
 
-    write(step_asy_fd, (char*)&cmd, sizeof(cmd));
-    if(len) {
-        DEBUG("Writing %d bytes of extra data", len);
-        write(step_asy_fd, (char*)data, cmd.extra_len);
+    event = step_async_event(message);
+
+    pthread_mutex_lock(&step_async_lock);
+    if((message == ASYNC_HWNOTIFY) &&
+       (step_hwnotify_count < STEP_MAX_HWNOTIFY)) {
+        step_hwnotify[step_hwnotify_count] = cmd;
+        step_hwnotify_data[step_hwnotify_count] = NULL;
+        if(len) {
+            step_hwnotify_data[step_hwnotify_count] = (uint8_t*)step_malloc(len);
+            memcpy(step_hwnotify_data[step_hwnotify_count], data, len);
+        }
+        step_hwnotify_count++;
     }
+
+    for(client = step_clients; client; client = client->pnext) {
+        if(event && !(client->sub_mask & event))
+            continue;
+        step_client_send(client, client->asy, FRAME_ASYNC,
+                         &cmd, sizeof(cmd), data, len);
+    }
+    pthread_mutex_unlock(&step_async_lock);
 }
 
 /*
  * FIXME(rp): this should probably be serialized
  */
 void stepwise_notification(char *format, ...) {
-    char *buffer = NULL;
+    char buffer[STEP_NOTIFY_MAX];
 
     va_list args;
     va_start(args, format);
-    vasprintf(&buffer, format, args);
+    vsnprintf(buffer, sizeof(buffer), format, args);
     va_end(args);
 
     /* send it out! */
     step_send_async(ASYNC_NOTIFICATION, 0, 0, strlen(buffer) + 1,
                     (uint8_t*) buffer);
+}
+
+/**
+ * report a watchpoint hit from the last instruction, if any
+ *
+ * @param pc address of the instruction that was executed
+ * @returns STOP_WATCH if a watchpoint was hit, else STOP_NONE
+ */
+uint16_t step_check_watch(uint16_t pc) {
+    mem_watch_t hit;
+    dbg_watch_t watch;
+
+    if(!memory_watch_hit(&hit))
+        return STOP_NONE;
+
+    watch.pc = pc;
+    watch.addr = hit.addr;
+    watch.old_value = hit.old_value;
+    watch.new_value = hit.new_value;
+    watch.type = hit.type;
+
+    DEBUG("Watchpoint at $%04x hit by $%04x", hit.addr, pc);
+    if(__atomic_load_n(&step_sub_mask, __ATOMIC_RELAXED) & SUB_WATCH)
+        step_send_async(ASYNC_WATCH, pc, hit.addr, sizeof(watch),
+                    (uint8_t*)&watch);
+    return STOP_WATCH;
+}
+
+/*
+ * private
+ *
+ * run thread: free-run the cpu, then report why it stopped
+ */
+static void *step_run_proc(void *arg) {
+    uint16_t reason;
+
+    metrics_cpu_thread();
+
+    reason = run_cpu(&step_run_limits);
+    if(reason == STOP_WATCH)
+        step_check_watch(run_last_pc);
+
+    DEBUG("Free run stopped: %d", reason);
+    __atomic_store_n(&step_running, 0, __ATOMIC_RELEASE);
+    if(__atomic_load_n(&step_sub_mask, __ATOMIC_RELAXED) & SUB_STOPPED)
+        step_send_async(ASYNC_STOPPED, reason, cpu_state.ip, sizeof(cpu_t),
+                        (uint8_t*)&cpu_state);
+    return NULL;
+}
+
+/*
+ * private
+ *
+ * publisher thread: send dirty pages and registers at the
+ * subscribed rate, when they have changed.  Registers are
+ * copied without stopping the cpu, so a frame may be slightly
+ * torn -- it's a display, not a checkpoint.
+ */
+static void *step_pub_proc(void *arg) {
+    uint8_t bitmap[DIRTY_BITMAP_LEN];
+    cpu_t regs;
+    cpu_t last_regs;
+    struct timespec delay;
+    uint64_t interval;
+    uint32_t since = 0;
+    int mask;
+    int pages;
+
+    memset(&last_regs, 0, sizeof(last_regs));
+    memory_dirty_since(&since, bitmap);
+
+    while(1) {
+        interval = 1000000000ULL / __atomic_load_n(&step_sub_rate, __ATOMIC_RELAXED);
+        delay.tv_sec = interval / 1000000000ULL;
+        delay.tv_nsec = interval % 1000000000ULL;
+        nanosleep(&delay, NULL);
+
+        mask = __atomic_load_n(&step_sub_mask, __ATOMIC_RELAXED);
+        if(!(mask & (SUB_REGS | SUB_DIRTY)))
+            continue;
+
+        /* only report what's dirty since the subscribe */
+        if(__atomic_exchange_n(&step_pub_reset, 0, __ATOMIC_RELAXED))
+            memory_dirty_since(&since, bitmap);
+
+        pages = 0;
+        if(mask & SUB_DIRTY) {
+            pages = memory_dirty_since(&since, bitmap);
+            if(pages)
+                step_send_async(ASYNC_DIRTY, pages, 0, sizeof(bitmap), bitmap);
+        }
+
+        if(mask & SUB_REGS) {
+            memcpy(&regs, (void*)&cpu_state, sizeof(cpu_t));
+            if(pages || memcmp(&regs, &last_regs, sizeof(cpu_t))) {
+                step_send_async(ASYNC_REGS, 0, regs.ip, sizeof(cpu_t),
+                                (uint8_t*)&regs);
+                last_regs = regs;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * private
+ *
+ * join the run thread if it has stopped on its own
+ */
+static void step_run_reap(void) {
+    if(step_run_joinable && !__atomic_load_n(&step_running, __ATOMIC_ACQUIRE)) {
+        pthread_join(step_run_tid, NULL);
+        step_run_joinable = 0;
+        metrics_cpu_thread();
+    }
+}
 
-    if(buffer)
-        free(buffer);
+/*
+ * private
+ *
+ * stop the run thread, if it is running, and wait for it
+ */
+static void step_run_halt(void) {
+    if(!step_run_joinable)
+        return;
+
+    run_request_halt();
+    pthread_join(step_run_tid, NULL);
+    step_run_joinable = 0;
+    metrics_cpu_thread();
 }
 
-ssize_t readblock(int fd, void *buf, size_t size) {
-    char *bufp;
-    ssize_t bytesread;
-    size_t bytestoread;
-    size_t totalbytes;
-
-    for (bufp = buf, bytestoread = size, totalbytes = 0;
-         bytestoread > 0;
-         bufp += bytesread, bytestoread -= bytesread) {
-        bytesread = read(fd, bufp, bytestoread);
-        DEBUG("Read %d bytes", bytesread);
-        if ((bytesread == 0) && (totalbytes == 0))
-            return 0;
-        if (bytesread == 0) {
-            errno = EINVAL;
-            return -1;
-        }
-        if ((bytesread) == -1 && (errno != EINTR))
-            return -1;
-        if (bytesread == -1)
-            bytesread = 0;
-        totalbytes += bytesread;
-    }
-    return totalbytes;
+/*
+ * private
+ *
+ * run to a limit on the debugger thread, and respond with the
+ * reason and the final cpu state
+ */
+static void step_run_sync(run_limits_t *limits) {
+    uint16_t reason;
+
+    reason = run_cpu(limits);
+    if(reason == STOP_WATCH)
+        step_check_watch(run_last_pc);
+
+    DEBUG("Ran %llu instructions, stopped: %d",
+          (unsigned long long)limits->instructions_run, reason);
+    step_return(RESPONSE_OK, reason, sizeof(cpu_t), (uint8_t*)&cpu_state);
+}
+
+/*
+ * private
+ *
+ * run to a limit on the run thread, and respond straight away.
+ * ASYNC_STOPPED reports where it ended.
+ */
+static void step_run_async(run_limits_t *limits) {
+    int error;
+
+    step_run_limits = *limits;
+
+    __atomic_store_n(&step_running, 1, __ATOMIC_RELEASE);
+    error = pthread_create(&step_run_tid, NULL, step_run_proc, NULL);
+    if(error) {
+        __atomic_store_n(&step_running, 0, __ATOMIC_RELEASE);
+        step_return(RESPONSE_ERROR, 0, strlen(strerror(error)) + 1,
+                    (uint8_t*)strerror(error));
+        return;
+    }
+
+    step_run_joinable = 1;
+    step_return(RESPONSE_OK, STOP_NONE, 0, NULL);
+}
+
+/*
+ * private
+ *
+ * run a stepping command: short ones synchronously, anything
+ * unbounded or long enough to want a halt on the run thread
+ */
+static void step_run_limited(run_limits_t *limits) {
+    if((limits->instructions || limits->cycles) &&
+       (limits->instructions <= STEP_SYNC_INSTRUCTIONS) &&
+       (limits->cycles <= STEP_SYNC_CYCLES))
+        step_run_sync(limits);
+    else
+        step_run_async(limits);
 }
 
 void step_eval(dbg_command_t *cmd, uint8_t *data) {
     char *version = VERSION;
     uint8_t *memory;
     uint16_t start, len, current;
-    uint16_t *paddr = malloc(sizeof(uint16_t));
+    dbg_bp_cond_t *cond;
+    run_limits_t limits;
+    dbg_range_t *range;
+    uint8_t *out;
+    uint32_t total;
+    dbg_sync_t *sync;
+    uint32_t since;
+    int rate;
+    int page;
+    dbg_command_t sub;
+    int count;
+    dbg_load_t load;
+    loader_result_t loaded;
+    int error;
+    dbg_search_t *search;
+    uint16_t *matches;
+
+    step_run_reap();
+
+    /* these can't change under a running cpu */
+    if(step_run_joinable) {
+        switch(cmd->cmd) {
+        case CMD_WRITEMEM:
+        case CMD_LOAD:
+        case CMD_SET:
+        case CMD_NEXT:
+        case CMD_WATCH:
+        case CMD_BP:
+        case CMD_RUN:
+        case CMD_STEPN:
+        case CMD_STEPOVER:
+        case CMD_STEPOUT:
+        case CMD_RUNUNTIL:
+            step_return(RESPONSE_ERROR, 0, strlen(STEP_RUNNING) + 1,
+                        (uint8_t*)STEP_RUNNING);
+            return;
+        }
+    }
 
     switch(cmd->cmd) {
     case CMD_NOP:
@@ -151,18 +799,90 @@ void step_eval(dbg_command_t *cmd, uint8_t *data) {
 
         DEBUG("Attemping to read $%04x bytes from $%04x", len, start);
 
-        memory = (uint8_t*)malloc(len);
-        if(!memory) {
-            perror("malloc");
-            exit(EXIT_FAILURE);
+        memory = step_out_buf;
+
+        /* wraps at $ffff, like the cpu */
+        total = 0x10000 - start;
+        if(total > len)
+            total = len;
+        memory_peek_block(start, memory, total);
+        memory_peek_block(0, memory + total, len - total);
+
+        step_return(RESPONSE_OK, 0, len, memory);
+        break;
+
+    case CMD_READMULTI:
+        range = (dbg_range_t*)data;
+        total = (cmd->param1 & READMULTI_REGS) ? sizeof(cpu_t) : 0;
+
+        if(cmd->extra_len != cmd->param2 * sizeof(dbg_range_t)) {
+            step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_RANGE) + 1,
+                        (uint8_t*)STEP_BAD_RANGE);
+            break;
         }
 
-        for(current = 0; current < len; current++) {
-            memory[current] = memory_read(current + start);
+        for(current = 0; current < cmd->param2; current++) {
+            if((uint32_t)range[current].addr + range[current].len > 0x10000)
+                break;
+            total += range[current].len;
         }
 
-        step_return(RESPONSE_OK, 0, len, memory);
-        free(memory);
+        if((current != cmd->param2) || (total > 0xffff)) {
+            step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_RANGE) + 1,
+                        (uint8_t*)STEP_BAD_RANGE);
+            break;
+        }
+
+        memory = step_out_buf;
+        out = memory;
+        if(cmd->param1 & READMULTI_REGS) {
+            memcpy(out, &cpu_state, sizeof(cpu_t));
+            out += sizeof(cpu_t);
+        }
+
+        for(current = 0; current < cmd->param2; current++) {
+            memory_peek_block(range[current].addr, out, range[current].len);
+            out += range[current].len;
+        }
+
+        step_return(RESPONSE_OK, 0, total, memory);
+        break;
+
+    case CMD_SYNC:
+        if((cmd->extra_len != sizeof(uint32_t)) || (cmd->param1 > 0xff)) {
+            step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_RANGE) + 1,
+                        (uint8_t*)STEP_BAD_RANGE);
+            break;
+        }
+
+        memory = step_out_buf;
+        sync = (dbg_sync_t*)memory;
+        memcpy(&since, data, sizeof(uint32_t));
+        memory_dirty_since(&since, sync->pages);
+        sync->generation = since;
+
+        /* drop pages before the first asked for, and past the
+         * most that fit, counting what's left over */
+        out = memory + sizeof(dbg_sync_t);
+        total = 0;
+        len = 0;
+        for(page = 0; page < 256; page++) {
+            if(!(sync->pages[page >> 3] & (1 << (page & 7))))
+                continue;
+
+            if((page < cmd->param1) || (total == SYNC_MAX_PAGES)) {
+                sync->pages[page >> 3] &= ~(1 << (page & 7));
+                if(page >= cmd->param1)
+                    len++;
+                continue;
+            }
+
+            memory_peek_block(page << 8, out, 256);
+            out += 256;
+            total++;
+        }
+
+        step_return(RESPONSE_OK, len, out - memory, memory);
         break;
 
     case CMD_WRITEMEM:
@@ -171,22 +891,50 @@ void step_eval(dbg_command_t *cmd, uint8_t *data) {
 
         DEBUG("Attempting to write $%04x bytes to $%04x", len, start);
 
-        for(current = 0; current < len; current++) {
-            memory_write(current + start, data[current]);
-        }
+        /* wraps at $ffff, like the cpu */
+        total = 0x10000 - start;
+        if(total > len)
+            total = len;
+        memory_poke_block(start, data, total, 0);
+        memory_poke_block(0, data + total, len - total, 0);
 
         step_return(RESPONSE_OK, 0, 0, NULL);
         break;
 
-        /* FIXME: rewrite by loading the file and bytewise writing it */
+    case CMD_LOAD:
+        if(cmd->param2 & LOAD_DATA) {
+            if((uint32_t)cmd->param1 + cmd->extra_len > 0x10000) {
+                step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_RANGE) + 1,
+                            (uint8_t*)STEP_BAD_RANGE);
+                break;
+            }
+
+            memory_poke_block(cmd->param1, data, cmd->extra_len, 1);
+            load.bytes = cmd->extra_len;
+            load.entry = cmd->param1;
+        } else {
+            if(!cmd->extra_len || data[cmd->extra_len - 1]) {
+                step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_FILE) + 1,
+                            (uint8_t*)STEP_BAD_FILE);
+                break;
+            }
+
+            error = loader_load((char*)data, cmd->param1, &loaded);
+            if(error != LOADER_OK) {
+                step_return(RESPONSE_ERROR, 0, strlen(loader_error(error)) + 1,
+                            (uint8_t*)loader_error(error));
+                break;
+            }
+
+            load.bytes = loaded.bytes;
+            load.entry = loaded.entry;
+        }
 
-    /* case CMD_LOAD: */
-    /*     if(memory_load(cmd->param1, (char*)data, 0) != E_MEM_SUCCESS) { */
-    /*         step_return(RESPONSE_ERROR, strlen(STEP_BAD_FILE)+1, (uint8_t*)STEP_BAD_FILE); */
-    /*     } else { */
-    /*         step_return(RESPONSE_OK, 0, NULL); */
-    /*     } */
-    /*     break; */
+        if(cmd->param2 & LOAD_SET_PC)
+            cpu_state.ip = load.entry;
+
+        step_return(RESPONSE_OK, 0, sizeof(load), (uint8_t*)&load);
+        break;
 
     case CMD_SET:
         switch(cmd->param1) {
@@ -218,45 +966,246 @@ void step_eval(dbg_command_t *cmd, uint8_t *data) {
         break;
 
     case CMD_NEXT:
+        current = cpu_state.ip;
         cpu_execute();
-        step_return(RESPONSE_OK, 0, sizeof(cpu_t),(uint8_t*)&cpu_state);
+        if(metrics.cycles >= sched_next)
+            sched_run(metrics.cycles);
+        step_return(RESPONSE_OK, step_check_watch(current),
+                    sizeof(cpu_t),(uint8_t*)&cpu_state);
         break;
 
     case CMD_CAPS:
-        step_return(RESPONSE_OK, CAP_BP | CAP_RUN, 0, NULL);
+        step_return(RESPONSE_OK, CAP_BP | CAP_RUN | CAP_WATCH | CAP_STEPN |
+                    CAP_READMULTI | CAP_SUBSCRIBE | CAP_SYNC | CAP_BATCH | CAP_LOAD | CAP_SEARCH |
+                    (shmview_name() ? CAP_SHM : 0), 0, NULL);
         break;
 
-    case CMD_BP:
-        if(!paddr) {
-            perror("malloc");
-            exit(EXIT_FAILURE);
+    case CMD_WATCH:
+        len = 1;
+        if(cmd->extra_len == sizeof(uint16_t))
+            memcpy(&len, data, sizeof(uint16_t));
+
+        for(current = 0; current < len; current++) {
+            if((cmd->param1 & 0x0F) == PARAM_WATCH_SET)
+                memory_watch_set(cmd->param2 + current, cmd->param1 & 0xF0);
+            else
+                memory_watch_clear(cmd->param2 + current, cmd->param1 & 0xF0);
         }
-        *paddr = cmd->param2;
 
+        step_return(RESPONSE_OK, 0, 0, NULL);
+        break;
+
+    case CMD_BP:
         switch(cmd->param1) {
         case PARAM_BP_SET:
-            rbsearch((void*)paddr, step_bp);
+            if(cmd->extra_len >= sizeof(dbg_bp_cond_t)) {
+                cond = (dbg_bp_cond_t*)data;
+                if(!breakpoint_set_condition(cmd->param2, cond->count, cond->code,
+                                             cmd->extra_len - sizeof(dbg_bp_cond_t))) {
+                    step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_COND) + 1,
+                                (uint8_t*)STEP_BAD_COND);
+                    return;
+                }
+            } else {
+                breakpoint_clear(cmd->param2);
+                breakpoint_set(cmd->param2);
+            }
             break;
         case PARAM_BP_DEL:
-            rbdelete((void*)paddr, step_bp);
+            breakpoint_clear(cmd->param2);
             break;
         }
         step_return(RESPONSE_OK, 0, 0, NULL);
         break;
 
     case CMD_RUN:
-        step_run = 1;
+        memset(&limits, 0, sizeof(limits));
+        limits.instructions = ((uint32_t)cmd->param2 << 16) | cmd->param1;
+        step_run_async(&limits);
+        break;
+
+    case CMD_STEPN:
+        memset(&limits, 0, sizeof(limits));
+        limits.instructions = ((uint32_t)cmd->param2 << 16) | cmd->param1;
+        if(!limits.instructions)
+            limits.instructions = 1;
+        step_run_limited(&limits);
+        break;
+
+    case CMD_STEPOVER:
+        memset(&limits, 0, sizeof(limits));
+        if(memory_peek(cpu_state.ip) == RUN_OPCODE_JSR) {
+            limits.instructions = ((uint32_t)cmd->param2 << 16) | cmd->param1;
+            limits.until = 1;
+            limits.until_addr = cpu_state.ip + 3;
+            limits.until_sp = cpu_state.sp;
+        } else {
+            limits.instructions = 1;
+        }
+
+        step_run_limited(&limits);
+        break;
+
+    case CMD_STEPOUT:
+        memset(&limits, 0, sizeof(limits));
+        limits.instructions = ((uint32_t)cmd->param2 << 16) | cmd->param1;
+        limits.step_out = 1;
+
+        step_run_limited(&limits);
+        break;
+
+    case CMD_RUNUNTIL:
+        memset(&limits, 0, sizeof(limits));
+        if(cmd->param1 & PARAM_UNTIL_ADDR) {
+            limits.until = 1;
+            limits.until_addr = cmd->param2;
+        }
+
+        if((cmd->param1 & PARAM_UNTIL_CYCLES) &&
+           (cmd->extra_len == sizeof(uint64_t))) {
+            memcpy(&limits.cycles, data, sizeof(uint64_t));
+        }
+
+        if(!limits.until && !limits.cycles) {
+            step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_UNTIL) + 1,
+                        (uint8_t*)STEP_BAD_UNTIL);
+            break;
+        }
+
+        step_run_limited(&limits);
+        break;
+
+    case CMD_STEP:
+        step_run_halt();
+        step_return(RESPONSE_OK, 0, sizeof(cpu_t), (uint8_t*)&cpu_state);
+        break;
+
+    case CMD_SUBSCRIBE:
+        __atomic_store_n(&step_pub_reset, 1, __ATOMIC_RELAXED);
+        rate = cmd->param2 ? cmd->param2 : STEP_PUB_DEFAULT_HZ;
+        if(rate > STEP_PUB_MAX_HZ)
+            rate = STEP_PUB_MAX_HZ;
+        __atomic_store_n(&step_sub_rate, rate, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&step_async_lock);
+        step_current->sub_mask = cmd->param1;
+        step_update_mask();
+        pthread_mutex_unlock(&step_async_lock);
+
+        if(!step_pub_started && (cmd->param1 & (SUB_REGS | SUB_DIRTY))) {
+            error = pthread_create(&step_pub_tid, NULL, step_pub_proc, NULL);
+            if(error) {
+                step_return(RESPONSE_ERROR, 0, strlen(strerror(error)) + 1,
+                            (uint8_t*)strerror(error));
+                break;
+            }
+            pthread_detach(step_pub_tid);
+            step_pub_started = 1;
+        }
+
         step_return(RESPONSE_OK, 0, 0, NULL);
         break;
 
+    case CMD_SHM:
+        if(!shmview_name()) {
+            step_return(RESPONSE_ERROR, 0, strlen(STEP_NO_SHM) + 1,
+                        (uint8_t*)STEP_NO_SHM);
+            break;
+        }
+
+        step_return(RESPONSE_OK, 0, strlen(shmview_name()) + 1,
+                    (uint8_t*)shmview_name());
+        break;
+
+    case CMD_SEARCH:
+        if(cmd->param2 < cmd->param1) {
+            step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_RANGE) + 1,
+                        (uint8_t*)STEP_BAD_RANGE);
+            break;
+        }
+
+        search = (dbg_search_t*)data;
+        if((cmd->extra_len < sizeof(dbg_search_t)) || !search->len ||
+           (cmd->extra_len != sizeof(dbg_search_t) +
+            search->len * ((search->flags & SEARCH_MASK) ? 2 : 1))) {
+            step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_SEARCH) + 1,
+                        (uint8_t*)STEP_BAD_SEARCH);
+            break;
+        }
+
+        matches = (uint16_t*)step_out_buf;
+        out = data + sizeof(dbg_search_t);
+        count = memory_search(cmd->param1, (uint32_t)cmd->param2 - cmd->param1 + 1,
+                              out, (search->flags & SEARCH_MASK) ? out + search->len : NULL,
+                              search->len, matches, SEARCH_MAX_MATCHES);
+
+        step_return(RESPONSE_OK, count > 0xffff ? 0xffff : count,
+                    (count < SEARCH_MAX_MATCHES ? count : SEARCH_MAX_MATCHES) * sizeof(uint16_t),
+                    (uint8_t*)matches);
+        break;
+
+    case CMD_BATCH:
+        if(step_batching) {
+            step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_BATCH) + 1,
+                        (uint8_t*)STEP_BAD_BATCH);
+            break;
+        }
+
+        step_batching = 1;
+        step_batch_full = 0;
+        step_batch_len = 0;
+        step_batch_status = RESPONSE_OK;
+        total = 0;
+        count = 0;
+
+        /* a bad entry gets an error response of its own, so the
+         * last response is always the one that stopped the batch */
+        while(total < cmd->extra_len) {
+            if(cmd->extra_len - total < sizeof(sub)) {
+                step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_BATCH) + 1,
+                            (uint8_t*)STEP_BAD_BATCH);
+                count++;
+                break;
+            }
+
+            memcpy(&sub, data + total, sizeof(sub));
+            total += sizeof(sub);
+
+            if((sub.cmd == CMD_STOP) || (cmd->extra_len - total < sub.extra_len)) {
+                step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_BATCH) + 1,
+                            (uint8_t*)STEP_BAD_BATCH);
+                count++;
+                break;
+            }
+
+            step_eval(&sub, sub.extra_len ? data + total : NULL);
+            total += sub.extra_len;
+            count++;
+
+            if(step_batch_full || (step_batch_status != RESPONSE_OK))
+                break;
+        }
+
+        step_batching = 0;
+        DEBUG("Batch ran %d commands", count);
+        step_return(step_batch_status, count, step_batch_len, step_batch_buf);
+        break;
+
+    case CMD_STATS:
+        len = metrics_snapshot(step_out_buf, 0xffff);
+        step_return(RESPONSE_OK, 0, len, step_out_buf);
+        break;
+
     case CMD_STOP:
-        step_run = 0;
         step_return(RESPONSE_OK, 0, 0, NULL);
         break;
 
     default:
+        /* one client's mistake shouldn't take the others down */
         ERROR("Unknown command from debugger: %d", cmd->cmd);
-        exit(EXIT_FAILURE);
+        step_return(RESPONSE_ERROR, 0, strlen(STEP_BAD_CMD) + 1,
+                    (uint8_t*)STEP_BAD_CMD);
+        break;
     }
 }
 
@@ -268,11 +1217,7 @@ int make_fifo(char *base, char *extension) {
     if(!base)
         base = DEFAULT_DEBUG_FIFO;
 
-    file = malloc(strlen(base) + 5);
-    if(!file) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
-    }
+    file = step_malloc(strlen(base) + 5);
 
     strcpy(file, base);
     strcat(file, extension);
@@ -301,65 +1246,327 @@ int make_fifo(char *base, char *extension) {
 }
 
 void step_init(char *fifo) {
+    int cmd_fd, rsp_fd, asy_fd;
+
     DEBUG("Initializing fds");
 
-    step_cmd_fd = make_fifo(fifo, "-cmd");
-    step_rsp_fd = make_fifo(fifo, "-rsp");
-    step_asy_fd = make_fifo(fifo, "-asy");
+    cmd_fd = make_fifo(fifo, "-cmd");
+    rsp_fd = make_fifo(fifo, "-rsp");
+    asy_fd = make_fifo(fifo, "-asy");
+
+    /* written under step_async_lock, from any thread: a reader
+     * that stops reading gets its output queued instead */
+    fcntl(rsp_fd, F_SETFL, fcntl(rsp_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(asy_fd, F_SETFL, fcntl(asy_fd, F_GETFL) | O_NONBLOCK);
+
+    step_client_add(cmd_fd, rsp_fd, asy_fd, 0);
 }
 
+/**
+ * listen for debugger clients on a unix socket.  Any number of
+ * clients (up to STEP_MAX_CLIENTS) can be attached at once.  The
+ * socket is ready when this returns, so a client started after it
+ * can simply connect.
+ *
+ * @param path filesystem path of the socket
+ */
+void step_listen(char *path) {
+    struct sockaddr_un addr;
+    struct stat sb;
+    int fd;
 
-void stepwise_debugger(void) {
-    dbg_command_t cmd;
-    uint8_t *data = NULL;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        FATAL("Socket path too long: %s", path);
+        exit(EXIT_FAILURE);
+    }
+
+    if(stat(path, &sb) == 0) {
+        if(!S_ISSOCK(sb.st_mode)) {
+            FATAL("File '%s' exists, and is not a socket", path);
+            exit(EXIT_FAILURE);
+        }
+        unlink(path);
+    }
+
+    /* a client going away is noticed on write */
+    signal(SIGPIPE, SIG_IGN);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    if(listen(fd, STEP_MAX_CLIENTS) == -1) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    DEBUG("Listening on %s", path);
+    step_listen_fd = fd;
+    step_listen_path = strdup(path);
+}
+
+/*
+ * private
+ *
+ * accept a socket client, and tell it about the hardware
+ */
+static void step_accept(void) {
+    step_client_t *client;
+    int count = 0;
+    int fd;
+    int index;
+
+    fd = accept(step_listen_fd, NULL, NULL);
+    if(fd == -1) {
+        DEBUG("accept: %s", strerror(errno));
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    for(client = step_clients; client; client = client->pnext)
+        count++;
+
+    if(count >= STEP_MAX_CLIENTS) {
+        ERROR("Too many debugger clients");
+        close(fd);
+        return;
+    }
+
+    DEBUG("Debugger client connected");
+    client = step_client_add(fd, fd, fd, 1);
+
+    pthread_mutex_lock(&step_async_lock);
+    for(index = 0; index < step_hwnotify_count; index++) {
+        step_client_send(client, client->asy, FRAME_ASYNC,
+                         &step_hwnotify[index], sizeof(dbg_command_t),
+                         step_hwnotify_data[index],
+                         step_hwnotify[index].extra_len);
+    }
+    pthread_mutex_unlock(&step_async_lock);
+}
+
+/*
+ * private
+ *
+ * read whatever a client has sent.  Returns 0 if it hung up.
+ */
+static int step_client_read(step_client_t *client) {
     ssize_t bytes_read;
 
-    DEBUG("Waiting for input");
+    /* anything left over is less than one command, so there is
+     * always at least STEP_READ_CHUNK free */
+    bytes_read = read(client->in_fd, client->buffer + client->buffer_len,
+                      STEP_BUFFER_SIZE - client->buffer_len);
+    if((bytes_read == -1) && ((errno == EINTR) || (errno == EAGAIN)))
+        return 1;
+    if(bytes_read <= 0)
+        return 0;
+
+    DEBUG("Read %d bytes", bytes_read);
+    client->buffer_len += bytes_read;
+    return 1;
+}
 
-    while(1) {
-        bytes_read = readblock(step_cmd_fd, (char*) &cmd, sizeof(cmd));
-        if(bytes_read != sizeof(cmd)) {
-            FATAL("Bad read.  Expecting %d, read %d",
-                  sizeof(cmd), bytes_read);
-            exit(EXIT_FAILURE);
+/*
+ * private
+ *
+ * evaluate every whole command a client has buffered, in order.
+ * Returns 1 if one of them was CMD_STOP.
+ */
+static int step_client_dispatch(step_client_t *client) {
+    dbg_frame_t frame;
+    dbg_command_t cmd;
+    uint8_t *msg;
+    size_t header = client->framed ? sizeof(frame) : 0;
+    size_t used = 0;
+    int stop = 0;
+
+    while(!stop && !client->dead &&
+          (client->buffer_len - used >= header + sizeof(cmd))) {
+        msg = client->buffer + used;
+
+        if(client->framed) {
+            memcpy(&frame, msg, sizeof(frame));
+            if(frame.type != FRAME_COMMAND) {
+                /* out of step with the stream: drop just this client */
+                ERROR("Bad frame from debugger client: %d, disconnecting", frame.type);
+                client->dead = 1;
+                break;
+            }
         }
 
+        memcpy(&cmd, msg + header, sizeof(cmd));
+        if(client->buffer_len - used < header + sizeof(cmd) + cmd.extra_len)
+            break;
+
         DEBUG("Received command: %02x",cmd.cmd);
 
+        step_current = client;
+        if(client->framed)
+            client->tag = frame.tag;
+
         if(cmd.cmd == CMD_STOP) {
             INFO("Exiting emulator at debugger request");
+            step_run_halt();
             step_return(RESPONSE_OK, 0, 0, NULL);
-            return;
+            stop = 1;
+        } else {
+            DEBUG("Evaluating command");
+            step_eval(&cmd, cmd.extra_len ? msg + header + sizeof(cmd) : NULL);
+        }
+        step_current = NULL;
+
+        used += header + sizeof(cmd) + cmd.extra_len;
+    }
+
+    if(used) {
+        memmove(client->buffer, client->buffer + used, client->buffer_len - used);
+        client->buffer_len -= used;
+    }
+
+    return stop;
+}
+
+/*
+ * private
+ *
+ * add an fd to the poll set, or more events to it if it's
+ * already there.  Returns the new count.
+ */
+static int step_poll_add(struct pollfd *fds, step_client_t **clients,
+                         int count, step_client_t *client,
+                         int fd, short events) {
+    int index;
+
+    for(index = 0; index < count; index++) {
+        if(fds[index].fd == fd) {
+            fds[index].events |= events;
+            return count;
         }
+    }
 
-        if(data) free(data);
-        data = NULL;
+    fds[count].fd = fd;
+    fds[count].events = events;
+    fds[count].revents = 0;
+    clients[count] = client;
+    return count + 1;
+}
 
-        if(cmd.extra_len) {
-            DEBUG("Reading %d bytes of extra info", cmd.extra_len);
-            data = (uint8_t*)malloc(cmd.extra_len);
-            if(!data) {
-                perror("malloc");
-                exit(EXIT_FAILURE);
+/**
+ * serve debugger clients until one of them sends CMD_STOP
+ */
+void stepwise_debugger(void) {
+    struct pollfd fds[3 * STEP_MAX_CLIENTS + 2];
+    step_client_t *clients[3 * STEP_MAX_CLIENTS + 2];
+    step_client_t *client;
+    uint8_t drain[64];
+    int count;
+    int index;
+    int stop = 0;
+
+    if(pipe(step_wake_fds) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(step_wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(step_wake_fds[1], F_SETFL, O_NONBLOCK);
+
+    metrics_debugger_thread();
+
+    DEBUG("Waiting for input");
+
+    while(!stop) {
+        step_client_reap();
+
+        count = 0;
+        fds[count].fd = step_wake_fds[0];
+        fds[count].events = POLLIN;
+        clients[count++] = NULL;
+
+        if(step_listen_fd != -1) {
+            fds[count].fd = step_listen_fd;
+            fds[count].events = POLLIN;
+            clients[count++] = NULL;
+        }
+
+        pthread_mutex_lock(&step_async_lock);
+        for(client = step_clients; client; client = client->pnext) {
+            count = step_poll_add(fds, clients, count, client,
+                                  client->in_fd, POLLIN);
+            if(client->out.len)
+                count = step_poll_add(fds, clients, count, client,
+                                      client->out.fd, POLLOUT);
+            if(client->asy->len)
+                count = step_poll_add(fds, clients, count, client,
+                                      client->asy->fd, POLLOUT);
+        }
+        pthread_mutex_unlock(&step_async_lock);
+
+        if(poll(fds, count, -1) == -1) {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        for(index = 0; (index < count) && !stop; index++) {
+            if(!fds[index].revents)
+                continue;
+
+            client = clients[index];
+            if(!client) {
+                if(fds[index].fd == step_wake_fds[0])
+                    while(read(step_wake_fds[0], drain, sizeof(drain)) > 0)
+                        ;
+                else
+                    step_accept();
+                continue;
             }
 
-            if(readblock(step_cmd_fd,data,cmd.extra_len) != cmd.extra_len) {
-                FATAL("Short read from remote debugger");
-                exit(EXIT_FAILURE);
+            if(fds[index].revents & POLLOUT) {
+                pthread_mutex_lock(&step_async_lock);
+                step_queue_flush(client, &client->out);
+                step_queue_flush(client, client->asy);
+                pthread_mutex_unlock(&step_async_lock);
             }
-        }
 
-        DEBUG("Evaluating command");
-        step_eval(&cmd, data);
+            if((fds[index].fd != client->in_fd) ||
+               !(fds[index].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
 
-        if(data) {
-            free(data);
-            data = NULL;
+            if(!step_client_read(client)) {
+                client->dead = 1;
+                continue;
+            }
+
+            stop = step_client_dispatch(client);
         }
-        DEBUG("Waiting for input");
     }
 
-    close(step_cmd_fd);
-    close(step_rsp_fd);
-    close(step_asy_fd);
+    /* the last response, at least, should get out */
+    pthread_mutex_lock(&step_async_lock);
+    while(step_clients) {
+        client = step_clients;
+        step_clients = client->pnext;
+        step_queue_flush(client, &client->out);
+        step_client_free(client);
+    }
+    pthread_mutex_unlock(&step_async_lock);
+
+    if(step_listen_fd != -1) {
+        close(step_listen_fd);
+        unlink(step_listen_path);
+    }
 }
@@ -47,11 +47,24 @@
  */
 #define CMD_WRITEMEM 0x04
 
-/* LOAD loads a binary object.  Param1 is address
- * to load at, while extra data is filename (zero terminated)
+/* LOAD loads a program.  Extra data is the zero terminated path
+ * of a file the emulator can read, see loader.h: a raw binary is
+ * loaded at param1, split binaries and hex files where they say.
+ * With LOAD_DATA in param2, extra data is instead a raw image to
+ * load at param1.  With LOAD_SET_PC, the pc is set to the entry
+ * point (a hex file's start address, else the first address
+ * loaded).  Responds with a dbg_load_t.
  */
 #define CMD_LOAD     0x05
 
+#define LOAD_SET_PC  0x01
+#define LOAD_DATA    0x02
+
+typedef struct __attribute__((packed)) dbg_load_t {
+    uint32_t bytes;
+    uint16_t entry;
+} dbg_load_t;
+
 /* Load a register specified in param1 with the value specified
  * in param2
  */
@@ -64,10 +77,17 @@
 #define PARAM_SP 0x05
 #define PARAM_IP 0x06
 
-/* execute next step
+/* execute next step.  response_value is a STOP_* reason
  */
 #define CMD_NEXT 0x07
 
+#define STOP_NONE  0x00
+#define STOP_BREAK 0x01
+#define STOP_WATCH 0x02
+#define STOP_HALT  0x03
+#define STOP_LIMIT 0x04   /* instruction or cycle limit ran out */
+#define STOP_DONE  0x05   /* reached the until address, or stepped out */
+
 /* Get capabilities
  */
 #define CMD_CAPS 0x08
@@ -75,22 +95,215 @@
 #define CAP_BP    0x01
 #define CAP_WATCH 0x02
 #define CAP_RUN   0x04
+#define CAP_STEPN 0x08
+#define CAP_READMULTI 0x10
+#define CAP_SUBSCRIBE 0x20
+#define CAP_SYNC      0x40
+#define CAP_SHM       0x80
+#define CAP_BATCH     0x100
+#define CAP_LOAD      0x200
+#define CAP_SEARCH    0x400
 
-/* Add and remove breakpoints
+/* Add and remove breakpoints.  param2 is the address.  A
+ * PARAM_BP_SET may carry a dbg_bp_cond_t as extra data.
  */
 #define CMD_BP   0x09
 
 #define PARAM_BP_SET 0x01
 #define PARAM_BP_DEL 0x02
 
-/* free-run until breakpoint (or cmd_step)
+/* breakpoint condition bytecode.  Programs run on a stack of
+ * 16 bit values, and the breakpoint fires if the value left on
+ * top is non-zero.  Comparisons push 0 or 1.
+ */
+#define BC_END   0x00   /* stop, result is top of stack */
+#define BC_PUSH  0x01   /* followed by uint16_t value */
+#define BC_REG   0x02   /* followed by uint8_t PARAM_* register */
+#define BC_MEM   0x03   /* pop address, push byte at address */
+#define BC_EQ    0x10
+#define BC_NE    0x11
+#define BC_LT    0x12
+#define BC_LE    0x13
+#define BC_GT    0x14
+#define BC_GE    0x15
+#define BC_LAND  0x16
+#define BC_LOR   0x17
+#define BC_NOT   0x18
+#define BC_AND   0x19
+#define BC_OR    0x1A
+#define BC_ADD   0x1B
+#define BC_SUB   0x1C
+
+#define BC_STACK_DEPTH 16
+#define BC_MAX_LEN     256
+
+/* stop on the count'th time the condition holds (0 and 1 both
+ * mean the first), and every time after that.  An empty code
+ * means the condition always holds.
+ */
+typedef struct __attribute__((packed)) dbg_bp_cond_t {
+    uint16_t count;
+    uint8_t code[];
+} dbg_bp_cond_t;
+
+/* free-run on a separate thread until breakpoint, watchpoint
+ * or CMD_STEP.  param1 and param2 are the low and high words of
+ * an instruction limit, zero for none.  Responds immediately;
+ * ASYNC_STOPPED is sent when the run ends.  While running, only
+ * read-only commands, CMD_STEP and CMD_STOP are accepted.
  */
 #define CMD_RUN  0x0A
 
 /* stop free-running, and go back to
-   stepwise execution */
+   stepwise execution.  Returns cpu_t */
 #define CMD_STEP 0x0B
 
+/* STATS responds with a dbg_stats_t, followed by
+ * dbg_stats_t.devices dbg_stats_device_t records
+ */
+#define CMD_STATS 0x0C
+
+/* Add and remove watchpoints.  param1 is PARAM_WATCH_SET or
+ * PARAM_WATCH_DEL, or'ed with the WATCH_* types (none on delete
+ * means all), param2 is the address.  Optional extra data is a
+ * uint16_t count of bytes to watch, starting at param2.
+ */
+#define CMD_WATCH 0x0D
+
+#define PARAM_WATCH_SET 0x01
+#define PARAM_WATCH_DEL 0x02
+
+#define WATCH_READ   0x10
+#define WATCH_WRITE  0x20
+#define WATCH_CHANGE 0x40
+
+/* The following run to completion inside the emulator and
+ * respond once, with a STOP_* reason as the response value and
+ * cpu_t as extra data.  STOP_DONE means the command got where
+ * it was going, STOP_LIMIT that it ran out of instructions or
+ * cycles first (for CMD_STEPN, and CMD_STEPOVER on anything but
+ * a JSR, that is finishing normally).
+ * Breakpoints and watchpoints still stop them early.
+ *
+ * With no limit, CMD_STEPOVER (over a JSR), CMD_STEPOUT and
+ * CMD_RUNUNTIL (address only) might never finish, and a large
+ * limit (over $10000 instructions or $40000 cycles) could take a
+ * while, so they run like CMD_RUN instead: the response is
+ * STOP_NONE with no extra data, ASYNC_STOPPED is sent when they
+ * end, and CMD_STEP halts them.
+ */
+
+/* execute param1 (low word) and param2 (high word) instructions
+ */
+#define CMD_STEPN     0x0E
+
+/* like CMD_NEXT, but a JSR runs until it returns.  param1 and
+ * param2 are the low and high words of an instruction limit,
+ * zero for none.
+ */
+#define CMD_STEPOVER  0x0F
+
+/* run until an RTS returns from the current subroutine.
+ * param1 and param2 are an instruction limit, as CMD_STEPOVER.
+ */
+#define CMD_STEPOUT   0x10
+
+/* run until the pc reaches the address in param2 (param1 has
+ * PARAM_UNTIL_ADDR), or the uint64_t cycle count in the extra
+ * data has run (param1 has PARAM_UNTIL_CYCLES), whichever is
+ * first.
+ */
+#define CMD_RUNUNTIL  0x11
+
+#define PARAM_UNTIL_ADDR   0x01
+#define PARAM_UNTIL_CYCLES 0x02
+
+/* read several blocks of memory at once.  param1 is a mask of
+ * READMULTI_* flags, param2 the number of dbg_range_t records in
+ * the extra data.  Returns cpu_t if READMULTI_REGS was asked for,
+ * followed by the contents of each range in order.  A range may
+ * not run past $ffff, and the whole response must fit in 64k.
+ */
+#define CMD_READMULTI 0x12
+
+#define READMULTI_REGS 0x01
+
+typedef struct __attribute__((packed)) dbg_range_t {
+    uint16_t addr;
+    uint16_t len;
+} dbg_range_t;
+
+/* choose which async events to send.  param1 is a mask of
+ * SUB_* events, param2 the rate in Hz to publish ASYNC_REGS and
+ * ASYNC_DIRTY at (0 for the default of 10).  Until a client
+ * subscribes, only stop and watch events are sent.  The mask is
+ * per client; the rate is shared, last subscriber wins.
+ */
+#define CMD_SUBSCRIBE 0x13
+
+#define SUB_STOPPED 0x01   /* ASYNC_STOPPED */
+#define SUB_WATCH   0x02   /* ASYNC_WATCH */
+#define SUB_REGS    0x04   /* ASYNC_REGS */
+#define SUB_DIRTY   0x08   /* ASYNC_DIRTY */
+
+/* fetch the pages written since a generation.  Extra data is the
+ * uint32_t generation the client last synced to, 0 for all pages.
+ * param1 is the first page to consider.  Returns a dbg_sync_t and
+ * the 256 bytes of each page in its bitmap, lowest first.  At most
+ * SYNC_MAX_PAGES are returned; the response value is the number of
+ * changed pages left over.  Fetch those by asking again with the
+ * same since and param1 past the last page returned, then keep the
+ * generation from the first response.
+ */
+#define CMD_SYNC      0x14
+
+#define SYNC_MAX_PAGES 255
+
+typedef struct __attribute__((packed)) dbg_sync_t {
+    uint32_t generation;
+    uint8_t pages[32];
+} dbg_sync_t;
+
+/* SHM responds with the zero terminated name of the shared
+ * memory view (see shmview.h), or an error if there isn't one
+ */
+#define CMD_SHM       0x15
+
+/* run several commands in one round trip.  Extra data is a list
+ * of dbg_command_t, each followed by its own extra data.  They run
+ * in order, stopping after the first one that fails.  The response
+ * value is how many ran, and the extra data their dbg_response_t
+ * and extra data, one after another.  On RESPONSE_ERROR the last
+ * of those is the entry that failed: entry (value - 1) of the
+ * list.  An unknown command, CMD_STOP, or an entry cut short by
+ * the end of the list fails the batch.  The whole must fit in
+ * BATCH_MAX_RESPONSE; a command whose response would not still
+ * runs, but answers RESPONSE_ERROR with no data and ends the batch.
+ * CMD_BATCH and CMD_STOP can't be batched.
+ */
+#define CMD_BATCH     0x16
+
+#define BATCH_MAX_RESPONSE 0xffff
+
+/* search memory from param1 to param2 inclusive.  Extra data is a
+ * dbg_search_t, the pattern, and with SEARCH_MASK a mask of the
+ * same length giving the bits of each byte that must match.  Look
+ * for a 16 bit value by searching for its two bytes, low first.
+ * The response value is the number of matches (at most $ffff), and
+ * the extra data the uint16_t addresses of the first
+ * SEARCH_MAX_MATCHES.  Memory is read as for CMD_READMEM.
+ */
+#define CMD_SEARCH    0x17
+
+#define SEARCH_MASK   0x01
+
+#define SEARCH_MAX_MATCHES 1024
+
+typedef struct __attribute__((packed)) dbg_search_t {
+    uint8_t flags;
+    uint16_t len;
+} dbg_search_t;
+
 /* Terminate the emulator
  */
 #define CMD_STOP     0xFF
@@ -105,7 +318,7 @@ typedef struct __attribute__((packed)) dbg_command_t {
 
 /* Reponse data is specified in request comments.  An error
  * response will return an error string as the extra
- * data
+ * data.  An unknown command gets an error response.
  */
 #define RESPONSE_OK    0x00
 #define RESPONSE_ERROR 0x01
@@ -116,6 +329,60 @@ typedef struct __attribute__((packed)) dbg_response_t {
     uint16_t extra_len;
 } dbg_response_t;
 
+/* socket transport.  Over the unix socket every message is
+ * preceded by a frame header, and commands, responses and async
+ * events share the one stream.  A command's tag is echoed in its
+ * response, so a client may send several commands without waiting.
+ * Commands are answered in the order they were sent.  Async events
+ * carry tag 0.  The fifos carry the bare messages.  A client that
+ * sends anything but a FRAME_COMMAND is disconnected; the others
+ * carry on.
+ */
+#define FRAME_COMMAND  0x01
+#define FRAME_RESPONSE 0x02
+#define FRAME_ASYNC    0x03
+
+typedef struct __attribute__((packed)) dbg_frame_t {
+    uint8_t type;
+    uint16_t tag;
+} dbg_frame_t;
+
+/* CMD_STATS payload.  Times are in microseconds, khz is
+ * effective clock rate (cycles over wall time since startup),
+ * allocs the heap allocations made on the debugger thread (all
+ * ones unless rp65emu was configured with --enable-alloc-stats).
+ * When the cpu is paced, target_khz is the rate it's paced at,
+ * drift_usec how far behind the wall clock the last slice ended,
+ * late_slices how many ended late, and resyncs how many times
+ * it fell too far behind to catch up.
+ */
+typedef struct __attribute__((packed)) dbg_stats_t {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t irqs;
+    uint64_t wall_usec;
+    uint64_t cpu_usec;
+    uint32_t khz;
+    uint64_t allocs;
+    uint32_t target_khz;
+    int64_t drift_usec;
+    uint64_t late_slices;
+    uint64_t resyncs;
+    uint16_t devices;
+} dbg_stats_t;
+
+#define STATS_NAME_LEN 16
+
+typedef struct __attribute__((packed)) dbg_stats_device_t {
+    char name[STATS_NAME_LEN];
+    uint8_t hw_family;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t refreshes;
+} dbg_stats_device_t;
+
 /* reponse is literal string notification from emulator to
  * whatever is driving the emulator.  This is typically information
  * that must be passed -- vnc port, what pty, etc.
@@ -139,10 +406,46 @@ typedef struct __attribute__((packed)) dbg_response_t {
 
 #define ASYNC_HWNOTIFY     0x01
 
+/* a watchpoint was hit.  param1 is the pc of the instruction
+ * that triggered it, param2 the address.  Extra data is a
+ * dbg_watch_t.
+ */
+#define ASYNC_WATCH        0x02
+
+/* a free run ended.  param1 is the STOP_* reason, param2
+ * the pc.  Extra data is cpu_t.
+ */
+#define ASYNC_STOPPED      0x03
+
+/* cpu state, published while it changes.  param2 is the pc,
+ * extra data is cpu_t.
+ */
+#define ASYNC_REGS         0x04
+
+/* pages written since the last ASYNC_DIRTY.  param1 is the
+ * number of pages, extra data a 32 byte bitmap, bit n set
+ * for page n.  Sent before the ASYNC_REGS of the same frame.
+ */
+#define ASYNC_DIRTY        0x05
+
+#define DIRTY_BITMAP_LEN   32
+
+typedef struct __attribute__((packed)) dbg_watch_t {
+    uint16_t pc;
+    uint16_t addr;
+    uint8_t old_value;
+    uint8_t new_value;
+    uint8_t type;
+} dbg_watch_t;
+
 
 extern void stepwise_debugger(void);
 extern void stepwise_notification(char *format, ...);
 extern void step_init(char *fifo);
+extern void step_listen(char *path);
+extern void step_send_async(uint8_t message, uint16_t param1,
+                            uint16_t param2, uint16_t len,
+                            uint8_t *data);
 
 
 #endif /* _STEPWISE_H_ */
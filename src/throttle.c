@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define DBG_MODULE DBG_MOD_CPU
+#include "debug.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "throttle.h"
+
+static uint32_t throttle_khz;
+static uint64_t throttle_slice;
+static uint64_t throttle_base_cycle;
+static uint64_t throttle_base_nsec;
+
+/*
+ * private
+ *
+ * CLOCK_MONOTONIC in nanoseconds
+ */
+static uint64_t throttle_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+/*
+ * private
+ *
+ * start timing from here
+ */
+static void throttle_resync(uint64_t cycle, uint64_t now) {
+    throttle_base_cycle = cycle;
+    throttle_base_nsec = now;
+}
+
+/*
+ * private
+ *
+ * scheduler event at the end of each slice: sleep until the wall
+ * clock reaches the time the slice should have ended, then set up
+ * the next one.  The deadline is from the cycle the slice was due,
+ * not when it got here, so sleep and wakeup latency don't add up.
+ */
+static void throttle_slice_done(void *arg, uint64_t cycle) {
+    uint64_t target;
+    uint64_t now = throttle_now();
+    struct timespec until;
+
+    target = throttle_base_nsec +
+        (((cycle - throttle_base_cycle) * 1000000ULL) / throttle_khz);
+
+    if(now < target) {
+        until.tv_sec = target / 1000000000ULL;
+        until.tv_nsec = target % 1000000000ULL;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+            ;
+        now = throttle_now();
+    } else {
+        metrics.late_slices++;
+    }
+
+    metrics.drift_nsec = (int64_t)(now - target);
+
+    if(now > target + (THROTTLE_WINDOW_USEC * 1000ULL)) {
+        DEBUG("%llu us behind, resyncing",
+              (unsigned long long)(now - target) / 1000);
+        metrics.resyncs++;
+        throttle_resync(cycle, now);
+    }
+
+    sched_add(cycle + throttle_slice, throttle_slice_done, NULL);
+}
+
+/**
+ * @returns the clock rate the cpu is paced at in kHz, or 0 if
+ *          it runs flat out
+ */
+uint32_t throttle_clock_khz(void) {
+    return throttle_khz;
+}
+
+/**
+ * pace the cpu at a clock rate.  Call before the cpu starts
+ * running, after metrics_init.
+ *
+ * @param khz clock rate to run at, or 0 to run flat out
+ */
+void throttle_init(uint32_t khz) {
+    if(!khz)
+        return;
+
+    throttle_khz = khz;
+    throttle_slice = ((uint64_t)khz * THROTTLE_SLICE_USEC) / 1000;
+    if(!throttle_slice)
+        throttle_slice = 1;
+
+    metrics.target_khz = khz;
+
+    INFO("Pacing cpu at %d.%03d MHz", khz / 1000, khz % 1000);
+    throttle_resync(sched_cycles(), throttle_now());
+    sched_add(sched_cycles() + throttle_slice, throttle_slice_done, NULL);
+}
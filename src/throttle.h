@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _THROTTLE_H_
+#define _THROTTLE_H_
+
+#include <stdint.h>
+
+/* real-time pacing.  The cpu runs in slices of THROTTLE_SLICE_USEC
+ * of emulated time; at the end of each it sleeps until the wall
+ * clock catches up.  A cpu that falls behind runs flat out to
+ * catch up, unless it's more than THROTTLE_WINDOW_USEC behind
+ * (stopped in the debugger, host stall), when the clock is
+ * resynced instead.
+ */
+#define THROTTLE_SLICE_USEC  1000
+#define THROTTLE_WINDOW_USEC 100000
+
+extern void throttle_init(uint32_t khz);
+extern uint32_t throttle_clock_khz(void);
+
+#endif /* _THROTTLE_H_ */
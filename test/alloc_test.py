@@ -0,0 +1,50 @@
+#!/usr/bin/env python
+
+# the debugger interface shouldn't touch the heap once it's
+# running: step an infinite loop and read memory for a while,
+# and check the allocation count in the stats hasn't moved.
+# That counts every malloc, calloc and realloc made on the
+# debugger thread, not just the debugger's own, when rp65emu is
+# configured with --enable-alloc-stats.
+
+import sys
+import emu.rp65emu
+
+rpemu = emu.rp65emu.RP65Emu()
+
+start = 4096
+code = bytearray([0xe8,              # inx
+                  0x86, 0x20,        # stx $20
+                  0x4c, 0x00, 0x10]) # jmp $1000
+rpemu.set_memory(start, code)
+rpemu.pc = start
+
+
+def exercise():
+    rpemu.step()
+    rpemu.step_n(10)
+    rpemu.get_memory(0, 256)
+    rpemu.get_memory(0xff00, 512)
+    rpemu.get_memory_multi([(0, 16), (start, len(code))], regs=True)
+    rpemu.search(code, 0, 0xffff)
+    rpemu.batch([(rpemu.CMD_REGS, 0, 0, None),
+                 (rpemu.CMD_READMEM, 0x20, 1, None)])
+    rpemu.stats()
+
+
+# warm up, then measure
+exercise()
+before = rpemu.stats()['allocs']
+
+if before == 0xffffffffffffffff:
+    print('configure with --enable-alloc-stats for this test')
+    sys.exit(1)
+
+for x in range(0, 1000):
+    exercise()
+
+after = rpemu.stats()['allocs']
+
+if after != before:
+    print('expecting no allocations, got %d' % (after - before))
+    sys.exit(1)
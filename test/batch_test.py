@@ -0,0 +1,38 @@
+#!/usr/bin/env python
+
+# CMD_BATCH stops at the first entry that fails, and that entry's
+# error response is the last one back.  An unknown command fails
+# the batch, not the emulator.
+
+import sys
+import emu.rp65emu
+
+rpemu = emu.rp65emu.RP65Emu()
+
+start = 4096
+results = rpemu.batch([
+    (rpemu.CMD_WRITEMEM, start, 0, bytearray([0xea])),
+    (0x40, 0, 0, None),
+    (rpemu.CMD_READMEM, start, 1, None)])
+
+if len(results) != 2:
+    print('expecting the batch to stop at entry 1, ran %d' % len(results))
+    sys.exit(1)
+
+if results[0][0] != rpemu.RESPONSE_OK or results[1][0] != rpemu.RESPONSE_ERROR:
+    print('expecting ok then an error, got %s' % str(results))
+    sys.exit(1)
+
+# CMD_STOP can't be batched
+results = rpemu.batch([
+    (rpemu.CMD_NOP, 0, 0, None),
+    (rpemu.CMD_STOP, 0, 0, None)])
+
+if len(results) != 2 or results[1][0] != rpemu.RESPONSE_ERROR:
+    print('expecting CMD_STOP to fail entry 1, got %s' % str(results))
+    sys.exit(1)
+
+# and the emulator is still there
+if rpemu.get_memory(start, 1) != bytearray([0xea]):
+    print('expecting the emulator to carry on after the batch')
+    sys.exit(1)
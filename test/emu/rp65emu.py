@@ -1,5 +1,9 @@
 #!/usr/bin/env python
 
+import collections
+import mmap
+import os
+import socket
 import struct
 
 class RP65Emu(object):
@@ -8,9 +12,24 @@ class RP65Emu(object):
     CMD_REGS = 2       # cpu_state struct
     CMD_READMEM = 3    # param1: start, param2: len
     CMD_WRITEMEM = 4   # param1: start, param2: len, extra: data
-    CMD_LOAD = 5       # param1: start, param2: zt filename
+    CMD_LOAD = 5       # param1: start, param2: LOAD_*, extra: path or data
     CMD_SET = 6        # param1: register, param2: value
-    CMD_NEXT = 7       # step
+    CMD_NEXT = 7       # step, returns STOP_* reason
+    CMD_BP = 9         # param1: set/del, param2: addr
+    CMD_RUN = 10       # param1/2: instruction limit, stops async
+    CMD_STEP = 11      # halt a free run
+    CMD_STATS = 12     # dbg_stats_t, then dbg_stats_device_t per device
+    CMD_WATCH = 13     # param1: set/del | type, param2: addr, extra: len
+    CMD_STEPN = 14     # param1/2: instruction count, returns STOP_*
+    CMD_STEPOVER = 15  # param1/2: instruction limit
+    CMD_STEPOUT = 16   # param1/2: instruction limit
+    CMD_RUNUNTIL = 17  # param1: until flags, param2: addr, extra: cycles
+    CMD_READMULTI = 18 # param1: flags, param2: range count, extra: ranges
+    CMD_SUBSCRIBE = 19 # param1: SUB_* mask, param2: rate in Hz
+    CMD_SYNC = 20      # param1: first page, extra: since generation
+    CMD_SHM = 21       # name of the shared memory view
+    CMD_BATCH = 22     # extra: commands, returns their responses
+    CMD_SEARCH = 23    # param1: start, param2: end, extra: pattern
     CMD_STOP = 255     # terminate emulator
 
     RESPONSE_OK = 0
@@ -23,9 +42,69 @@ class RP65Emu(object):
     PARAM_SP = 5
     PARAM_IP = 6
 
-    def __init__(self, fifo_path='/tmp/debug'):
-        self.cmd_fd = open('%s-cmd' % fifo_path, 'rb+', 0)
-        self.rsp_fd = open('%s-rsp' % fifo_path, 'rb+', 0)
+    PARAM_WATCH_SET = 0x01
+    PARAM_WATCH_DEL = 0x02
+    WATCH_READ = 0x10
+    WATCH_WRITE = 0x20
+    WATCH_CHANGE = 0x40
+
+    PARAM_BP_SET = 0x01
+    PARAM_BP_DEL = 0x02
+
+    PARAM_UNTIL_ADDR = 0x01
+    PARAM_UNTIL_CYCLES = 0x02
+
+    READMULTI_REGS = 0x01
+
+    LOAD_SET_PC = 0x01
+    LOAD_DATA = 0x02
+
+    SEARCH_MASK = 0x01
+
+    # shared memory view, see shmview.h
+    SHM_MAGIC = 0x35365052
+    SHM_HEADER_SIZE = 4096
+    SHM_PAGE_RAM = 0x01
+
+    STOP_NONE = 0
+    STOP_BREAK = 1
+    STOP_WATCH = 2
+    STOP_HALT = 3
+    STOP_LIMIT = 4
+    STOP_DONE = 5
+
+    SUB_STOPPED = 0x01
+    SUB_WATCH = 0x02
+    SUB_REGS = 0x04
+    SUB_DIRTY = 0x08
+
+    ASYNC_STOPPED = 3
+    ASYNC_REGS = 4
+    ASYNC_DIRTY = 5
+
+    FRAME_COMMAND = 1
+    FRAME_RESPONSE = 2
+    FRAME_ASYNC = 3
+
+    def __init__(self, fifo_path='/tmp/debug', socket_path=None):
+        # with socket_path, talk to an emulator started with -u,
+        # alongside any other clients it has
+        self.sock = None
+        self.tag = 0
+        self.pending = collections.deque()
+        if socket_path:
+            self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.sock.connect(socket_path)
+            self.cmd_fd = self.sock.makefile('rwb', buffering=0)
+            self.rsp_fd = self.cmd_fd
+            self.asy_fd = self.cmd_fd
+        else:
+            self.cmd_fd = open('%s-cmd' % fifo_path, 'rb+', 0)
+            self.rsp_fd = open('%s-rsp' % fifo_path, 'rb+', 0)
+            self.asy_fd = open('%s-asy' % fifo_path, 'rb+', 0)
+        self.mirror = bytearray(0x10000)
+        self.generation = 0
+        self.shm = None
         self._update_registers()
 
     def _send_command(self, cmd, param1, param2, extra_len, extra_data):
@@ -42,35 +121,119 @@ class RP65Emu(object):
         #     uint16_t extra_len;
         # } dbg_response_t;
 
-        req = None
-        rsp = None
+        self._write(self._pack_command(cmd, param1, param2,
+                                       extra_len, extra_data))
+
+        rsp_status, rsp_response, rsp_extra_data = self._read_response()
+        self.last_value = rsp_response
+
+        if rsp_status != self.RESPONSE_OK:
+            raise 'error sending command'
+
+        return rsp_extra_data
 
+    def _pack_command(self, cmd, param1, param2, extra_len, extra_data):
         if extra_len > 0:
-            fmt = 'BHHH%ds' % extra_len
+            fmt = '<BHHH%ds' % extra_len
             req = struct.pack(fmt, cmd, param1, param2, extra_len, extra_data)
         else:
-            req = struct.pack('BHHH', cmd, param1, param2, 0)
-
-        self.cmd_fd.write(req);
+            req = struct.pack('<BHHH', cmd, param1, param2, 0)
 
-        rsp = self.rsp_fd.read(struct.calcsize('BHH'))
+        if self.sock:
+            self.tag = (self.tag + 1) & 0xffff
+            req = struct.pack('<BH', self.FRAME_COMMAND, self.tag) + req
 
-        rsp_extra_data = None
-        rsp_status, rsp_response, rsp_extra_len = struct.unpack('BHH', rsp)
+        return req
 
-        if rsp_status != self.RESPONSE_OK:
-            raise 'error sending command'
+    def _write(self, req):
+        if self.sock:
+            self.sock.sendall(req)
+        else:
+            self.cmd_fd.write(req)
+
+    def _read(self, fd, length):
+        # socket reads can come up short
+        data = b''
+        while len(data) < length:
+            chunk = fd.read(length - len(data))
+            if not chunk:
+                raise IOError('emulator went away')
+            data += chunk
+        return data
 
-        if rsp_extra_len != 0:
-            rsp_extra_data = self.rsp_fd.read(rsp_extra_len)
+    def _read_message(self, fd, fmt):
+        # a response or async message, and its extra data
+        fields = struct.unpack(fmt, self._read(fd, struct.calcsize(fmt)))
+        extra_len = fields[-1]
+        data = self._read(fd, extra_len) if extra_len else None
+        return fields[:-1] + (data,)
+
+    def _read_response(self):
+        # returns (status, value, data).  On the socket, async
+        # messages ahead of the response are kept for read_async()
+        while self.sock:
+            frame_type, tag = struct.unpack(
+                '<BH', self._read(self.rsp_fd, struct.calcsize('<BH')))
+            if frame_type == self.FRAME_RESPONSE:
+                break
+            self.pending.append(self._read_message(self.rsp_fd, '<BHHH'))
+
+        return self._read_message(self.rsp_fd, '<BHH')
+
+    def pipeline(self, commands):
+        # send (cmd, param1, param2, extra) tuples without waiting,
+        # then collect their (status, value, data) responses in order
+        req = b''
+        for cmd, param1, param2, extra in commands:
+            req += self._pack_command(cmd, param1, param2,
+                                      len(extra) if extra else 0, extra)
+        self._write(req)
+
+        return [self._read_response() for command in commands]
+
+    def batch(self, commands):
+        # run (cmd, param1, param2, extra) tuples in one round trip.
+        # Returns (status, value, data) for each one that ran; the
+        # emulator stops at the first failure
+        extra = b''.join(struct.pack('<BHHH', cmd, param1, param2,
+                                     len(data) if data else 0) + (data or b'')
+                         for cmd, param1, param2, data in commands)
+        self._write(self._pack_command(self.CMD_BATCH, 0, 0,
+                                       len(extra), extra))
+        status, count, data = self._read_response()
+
+        results = []
+        pos = 0
+        for index in range(count):
+            rsp_status, rsp_value, rsp_len = struct.unpack_from('<BHH', data, pos)
+            pos += struct.calcsize('<BHH')
+            results.append((rsp_status, rsp_value,
+                            data[pos:pos + rsp_len] if rsp_len else None))
+            pos += rsp_len
+        return results
+
+    def run_at(self, location, code, steps=1):
+        # write code, point the pc at it and step, in one round trip.
+        # Returns the STOP_* reason of the last step
+        if isinstance(code, list):
+            code = struct.pack('%sB' % len(code), *code)
+
+        results = self.batch([
+            (self.CMD_WRITEMEM, location, len(code), code),
+            (self.CMD_SET, self.PARAM_IP, location, None),
+            (self.CMD_STEPN, steps & 0xffff, steps >> 16, None)])
+        if len(results) != 3 or results[2][0] != self.RESPONSE_OK:
+            raise IOError('batch failed')
 
-        return rsp_extra_data
+        (self._p, self._a, self._x, self._y,
+         self._ip, self._sp, self._irq) = struct.unpack('<BBBBHBB', results[2][2])
+        return results[2][1]
 
     def _update_registers(self):
         data = self._send_command(self.CMD_REGS, 0, 0, 0, None)
 
         (self._p, self._a, self._x, self._y,
-         self._ip, self._sp, self._irq) = struct.unpack('BBBBHBB', data)
+         self._ip, self._sp, self._irq) = struct.unpack('<BBBBHBB', data)
 
     @property
     def a(self):
@@ -131,6 +294,85 @@ class RP65Emu(object):
                                   length, 0, None)
         return data
 
+    def get_memory_multi(self, ranges, regs=False):
+        # ranges is a list of (start, length); returns a list of
+        # blocks, and updates the registers if regs is set
+        extra = b''.join(struct.pack('<HH', start, length)
+                         for start, length in ranges)
+        data = self._send_command(self.CMD_READMULTI,
+                                  self.READMULTI_REGS if regs else 0,
+                                  len(ranges), len(extra), extra)
+        pos = 0
+        if regs:
+            (self._p, self._a, self._x, self._y,
+             self._ip, self._sp, self._irq) = struct.unpack('<BBBBHBB',
+                                                            data[:8])
+            pos = 8
+
+        blocks = []
+        for start, length in ranges:
+            blocks.append(data[pos:pos + length])
+            pos += length
+        return blocks
+
+    def sync_memory(self):
+        # bring self.mirror up to date, fetching only the pages
+        # written since the last sync; returns the pages updated
+        since = struct.pack('<I', self.generation)
+        first = 0
+        generation = None
+        updated = []
+        while True:
+            data = self._send_command(self.CMD_SYNC, first, 0,
+                                      len(since), since)
+            remaining = self.last_value
+            gen, = struct.unpack('<I', data[:4])
+            if generation is None:
+                generation = gen
+            pages = self.dirty_pages(data[4:36])
+            pos = 36
+            for page in pages:
+                self.mirror[page << 8:(page + 1) << 8] = data[pos:pos + 256]
+                pos += 256
+            updated += pages
+            if not remaining:
+                break
+            first = pages[-1] + 1
+        self.generation = generation
+        return updated
+
+    def attach_shm(self):
+        # map the emulator's shared memory view (linux only)
+        name = self._send_command(self.CMD_SHM, 0, 0, 0, None)
+        name = name.rstrip(b'\0').decode()
+        fd = os.open('/dev/shm' + name, os.O_RDONLY)
+        try:
+            self.shm = mmap.mmap(fd, self.SHM_HEADER_SIZE + 0x10000,
+                                 mmap.MAP_SHARED, mmap.PROT_READ)
+        finally:
+            os.close(fd)
+        magic, = struct.unpack_from('<I', self.shm, 0)
+        if magic != self.SHM_MAGIC:
+            raise ValueError('bad shared memory magic')
+
+    def shm_pages(self):
+        # pages that are live in the shared view
+        flags = self.shm[40:40 + 256]
+        return [page for page in range(256) if flags[page] & self.SHM_PAGE_RAM]
+
+    def shm_read(self, start, length):
+        base = self.SHM_HEADER_SIZE + start
+        return self.shm[base:base + length]
+
+    def shm_state(self):
+        # returns (p, a, x, y, ip, sp, irq, instructions, cycles),
+        # retrying while the emulator is updating it
+        while True:
+            seq, = struct.unpack_from('<I', self.shm, 8)
+            state = struct.unpack_from('<BBBBHBBQQ', self.shm, 16)
+            if not seq & 1 and struct.unpack_from('<I', self.shm, 8)[0] == seq:
+                return state
+
     def set_memory(self, start, data):
         if isinstance(data, list):
             data = struct.pack('%sB' % len(data), *data)
@@ -140,7 +382,156 @@ class RP65Emu(object):
         self._send_command(self.CMD_WRITEMEM, start, data_length,
                            data_length, data)
 
-    def step(self):
-        data = self._send_command(self.CMD_NEXT, 0, 0, 0, None)
+
+    def load(self, path, addr=0, set_pc=False):
+        # load a file the emulator can read: raw binary (at addr),
+        # split binary, split base name or intel hex.  Returns
+        # (bytes loaded, entry point)
+        path = os.path.abspath(path).encode() + b'\0'
+        data = self._send_command(self.CMD_LOAD, addr,
+                                  self.LOAD_SET_PC if set_pc else 0,
+                                  len(path), path)
+        if set_pc:
+            self._update_registers()
+        return struct.unpack('<IH', data)
+
+    def load_data(self, addr, data, set_pc=False):
+        # like set_memory, but writes rom as well
+        flags = self.LOAD_DATA | (self.LOAD_SET_PC if set_pc else 0)
+        self._send_command(self.CMD_LOAD, addr, flags, len(data), data)
+        if set_pc:
+            self._update_registers()
+
+    def search(self, pattern, start=0, end=0xffff, mask=None):
+        # returns (match count, addresses of the first matches)
+        flags = self.SEARCH_MASK if mask is not None else 0
+        extra = struct.pack('<BH', flags, len(pattern)) + bytes(pattern)
+        if mask is not None:
+            extra += bytes(mask)
+        data = self._send_command(self.CMD_SEARCH, start, end,
+                                  len(extra), extra)
+        if data is None:
+            return (self.last_value, [])
+
+        return (self.last_value,
+                list(struct.unpack('<%dH' % (len(data) // 2), data)))
+
+    def search_word(self, value, start=0, end=0xffff):
+        return self.search(struct.pack('<H', value), start, end)
+
+    def _step_remote(self, cmd, param1, param2, extra=None):
+        data = self._send_command(cmd, param1, param2,
+                                  len(extra) if extra else 0, extra)
+        if data is None:
+            # no limit, so it went to the run thread
+            return self.wait_stopped()
+
         (self._p, self._a, self._x, self._y,
-         self._ip, self._sp, self._irq) = struct.unpack('BBBBHBB', data)
+         self._ip, self._sp, self._irq) = struct.unpack('<BBBBHBB', data)
+        return self.last_value
+
+    def step(self):
+        return self._step_remote(self.CMD_NEXT, 0, 0)
+
+    def step_n(self, count):
+        return self._step_remote(self.CMD_STEPN, count & 0xffff, count >> 16)
+
+    def step_over(self, limit=0):
+        return self._step_remote(self.CMD_STEPOVER, limit & 0xffff,
+                                 limit >> 16)
+
+    def step_out(self, limit=0):
+        return self._step_remote(self.CMD_STEPOUT, limit & 0xffff,
+                                 limit >> 16)
+
+    def run_until_addr(self, addr, max_cycles=0):
+        flags = self.PARAM_UNTIL_ADDR
+        extra = None
+        if max_cycles:
+            flags |= self.PARAM_UNTIL_CYCLES
+            extra = struct.pack('<Q', max_cycles)
+        return self._step_remote(self.CMD_RUNUNTIL, flags, addr, extra)
+
+    def run_until_cycles(self, cycles):
+        return self._step_remote(self.CMD_RUNUNTIL, self.PARAM_UNTIL_CYCLES, 0,
+                                 struct.pack('<Q', cycles))
+
+    def run(self, limit=0):
+        # returns immediately; see wait_stopped() and halt()
+        self._send_command(self.CMD_RUN, limit & 0xffff,
+                           limit >> 16, 0, None)
+
+    def halt(self):
+        self._send_command(self.CMD_STEP, 0, 0, 0, None)
+        return self.wait_stopped()
+
+    def subscribe(self, mask, rate=0):
+        self._send_command(self.CMD_SUBSCRIBE, mask, rate, 0, None)
+
+    def read_async(self):
+        # returns (msg, param1, param2, data)
+        if self.pending:
+            return self.pending.popleft()
+
+        if self.sock:
+            frame_type, tag = struct.unpack(
+                '<BH', self._read(self.asy_fd, struct.calcsize('<BH')))
+            if frame_type != self.FRAME_ASYNC:
+                raise IOError('unexpected frame %d' % frame_type)
+
+        return self._read_message(self.asy_fd, '<BHHH')
+
+    def dirty_pages(self, data):
+        # page numbers set in an ASYNC_DIRTY bitmap
+        return [page for page in range(256)
+                if data[page >> 3] & (1 << (page & 7))]
+
+    def wait_stopped(self):
+        # skip other async messages until the run ends
+        while True:
+            msg, param1, param2, data = self.read_async()
+            if msg == self.ASYNC_STOPPED:
+                (self._p, self._a, self._x, self._y,
+                 self._ip, self._sp, self._irq) = struct.unpack('<BBBBHBB', data)
+                return param1
+
+    def set_breakpoint(self, addr, code=None, count=0):
+        # code is BC_* condition bytecode, see stepwise.h
+        if code is None and not count:
+            self._send_command(self.CMD_BP, self.PARAM_BP_SET, addr, 0, None)
+            return
+
+        extra = struct.pack('<H', count) + (code or b'')
+        self._send_command(self.CMD_BP, self.PARAM_BP_SET, addr,
+                           len(extra), extra)
+
+    def clear_breakpoint(self, addr):
+        self._send_command(self.CMD_BP, self.PARAM_BP_DEL, addr, 0, None)
+
+    def watch(self, start, types, length=1):
+        self._send_command(self.CMD_WATCH, self.PARAM_WATCH_SET | types,
+                           start, 2, struct.pack('<H', length))
+
+    def unwatch(self, start, length=1):
+        self._send_command(self.CMD_WATCH, self.PARAM_WATCH_DEL,
+                           start, 2, struct.pack('<H', length))
+
+    def stats(self):
+        data = self._send_command(self.CMD_STATS, 0, 0, 0, None)
+        fields = ('instructions', 'cycles', 'irqs', 'wall_usec',
+                  'cpu_usec', 'khz', 'allocs', 'target_khz', 'drift_usec',
+                  'late_slices', 'resyncs')
+        header = struct.unpack('<QQQQQIQIqQQH', data[:82])
+        result = dict(zip(fields, header))
+        result['devices'] = {}
+
+        offset = 82
+        for _ in range(header[-1]):
+            record = struct.unpack('<16sBQQQQQ', data[offset:offset + 57])
+            name = record[0].rstrip(b'\0').decode()
+            result['devices'][name] = dict(zip(
+                ('hw_family', 'reads', 'writes', 'rx_bytes', 'tx_bytes',
+                 'refreshes'), record[1:]))
+            offset += 57
+
+        return result
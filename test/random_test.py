@@ -112,7 +112,6 @@ while(1):
     descr, instr, store_addr = genrandom.get_opcode(pyemu)
 
     pyemu.set_memory(8192, instr)
-    rpemu.set_memory(8192, instr)
 
     (byte_len, real_instr) = pyemu.disassemble(8192)
     opcode_list.append(real_instr)
@@ -122,10 +121,9 @@ while(1):
         sys.exit(1)
 
     pyemu.pc = 8192
-    rpemu.pc = 8192
-
     pyemu.step()
-    rpemu.step()
+
+    rpemu.run_at(8192, instr)
 
     pystate = get_state(pyemu)
     rpstate = get_state(rpemu)
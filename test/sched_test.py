@@ -0,0 +1,38 @@
+#!/usr/bin/env python
+
+# device events are due by cycle count, and have to fire when the
+# cpu is single-stepped as well as when it runs.  Start the emulator
+# paced (-k 1000): the pacer is a scheduler event at the end of each
+# 1000 cycle slice.  Sleeping between steps leaves it far behind the
+# wall clock, so the slice that ends during the step has to resync.
+
+import sys
+import time
+import emu.rp65emu
+
+rpemu = emu.rp65emu.RP65Emu()
+
+if not rpemu.stats()['target_khz']:
+    print('start the emulator with -k 1000 for this test')
+    sys.exit(1)
+
+start = 4096
+rpemu.set_memory(start, bytearray([0x4c, 0x00, 0x10]))  # jmp $1000
+rpemu.pc = start
+
+before = rpemu.stats()
+time.sleep(0.5)
+
+# past the end of the current slice
+for x in range(0, 400):
+    rpemu.step()
+
+after = rpemu.stats()
+if after['cycles'] - before['cycles'] < 1000:
+    print('expecting to step a slice, only ran %d cycles' %
+          (after['cycles'] - before['cycles']))
+    sys.exit(1)
+
+if after['resyncs'] == before['resyncs']:
+    print('expecting the slice event to fire while stepping')
+    sys.exit(1)
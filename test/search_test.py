@@ -0,0 +1,24 @@
+#!/usr/bin/env python
+
+# CMD_SEARCH: find a pattern that's there, then one that isn't
+
+import sys
+import emu.rp65emu
+
+rpemu = emu.rp65emu.RP65Emu()
+
+start = 4096
+pattern = bytearray([0xa9, 0x5a, 0x8d, 0x34, 0x12])  # lda #$5a / sta $1234
+rpemu.set_memory(start, pattern)
+
+count, matches = rpemu.search(pattern, start, start + 0xff)
+if count != 1 or matches != [start]:
+    print('expecting a match at $%04x, got %d: %s' % (start, count, matches))
+    sys.exit(1)
+
+# a pattern that can't be in the range: it overlaps the one above
+missing = bytearray([0xa9, 0x5a, 0x8d, 0x34, 0x13])
+count, matches = rpemu.search(missing, start, start + 0xff)
+if count != 0 or matches != []:
+    print('expecting no matches, got %d: %s' % (count, matches))
+    sys.exit(1)
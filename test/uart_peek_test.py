@@ -0,0 +1,56 @@
+#!/usr/bin/env python
+
+# debugger reads of a 16550 have to leave it alone: the received
+# byte stays in the fifo for the cpu, even while the cpu is running.
+# Start the emulator with a 16550 at $c000 (or the address given)
+# and pass the pty it opened.
+
+import os
+import sys
+import time
+import emu.rp65emu
+
+if len(sys.argv) < 2:
+    print('usage: uart_peek_test.py <pty> [uart address]')
+    sys.exit(1)
+
+uart = int(sys.argv[2], 0) if len(sys.argv) > 2 else 0xc000
+lsr = uart + 5
+
+rpemu = emu.rp65emu.RP65Emu()
+pty = os.open(sys.argv[1], os.O_RDWR | os.O_NOCTTY)
+
+start = 4096
+rpemu.set_memory(start, bytearray([0x4c, 0x00, 0x10]))  # jmp $1000
+rpemu.pc = start
+
+# the lcr could be anything from an earlier run
+rpemu.set_memory(uart + 3, bytearray([0x03]))
+
+os.write(pty, b'AB')
+time.sleep(0.2)
+
+rpemu.run()
+for x in range(0, 10):
+    if rpemu.get_memory(uart, 1)[0] != ord('A'):
+        print('expecting to see $41 in rbr')
+        sys.exit(1)
+    if not rpemu.get_memory(lsr, 1)[0] & 0x01:
+        print('expecting data ready in lsr')
+        sys.exit(1)
+rpemu.halt()
+
+# the cpu still gets both bytes, in order
+received = []
+for x in range(0, 2):
+    rpemu.run_at(start + 16, [0xad, uart & 0xff, uart >> 8])  # lda uart
+    received.append(rpemu.a)
+
+if received != [ord('A'), ord('B')]:
+    print('expecting the cpu to read $41 $42, got %s' %
+          ' '.join('$%02x' % x for x in received))
+    sys.exit(1)
+
+if rpemu.get_memory(lsr, 1)[0] & 0x01:
+    print('expecting the fifo to be empty')
+    sys.exit(1)